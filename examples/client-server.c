@@ -65,11 +65,13 @@ static void hextobin( const char *str, uint8_t *dst, size_t len );
 
 static _Bool joinNetwork();
 
-static void serverCb( uint16_t locPort, uint16_t peerPort, char *peerName,
-                      uint8_t *udpPld, uint16_t udpPldLen );
+static void serverCb( kbi_dev_t *dev, uint16_t locPort, uint16_t peerPort,
+                      const struct in6_addr *peerAddr, uint8_t *udpPld,
+                      uint16_t udpPldLen );
 
-static void clientCb( uint16_t locPort, uint16_t peerPort, char *peerName,
-                      uint8_t *udpPld, uint16_t udpPldLen );
+static void clientCb( kbi_dev_t *dev, uint16_t locPort, uint16_t peerPort,
+                      const struct in6_addr *peerAddr, uint8_t *udpPld,
+                      uint16_t udpPldLen );
 
 /****************************************************************************
 **                                                                         **
@@ -83,6 +85,9 @@ static void clientCb( uint16_t locPort, uint16_t peerPort, char *peerName,
 **                                                                         **
 ****************************************************************************/
 
+/* Connected KiNOS device */
+static kbi_dev_t dev;
+
 /****************************************************************************
 **                                                                         **
 **                           EXPORTED FUNCTIONS                            **
@@ -94,7 +99,7 @@ int main( void )
   time_t  testEnd = time( NULL ) + TEST_DURATION;
   uint8_t pld[ 18 ]; /* Generalistic payload variable */
 
-  if ( kbi_init( UART_PORT ) )
+  if ( kbi_init( &dev, UART_PORT ) )
     printf( "Module in port %s initialized correctly.\n", UART_PORT );
   else
     progExit( EXIT_FAILURE, "Unable to init module port." );
@@ -110,23 +115,23 @@ int main( void )
     /* Force destination unreachable notification */
     printf( "\nshow mlprefix\n" );
     memset( pld, 0, sizeof( pld ) );
-    if ( kbi_cmd( CMDS_FCCMD_READ, CMDS_CMD_MESH_LOCAL_PREFIX, NULL, 0 ) )
-      memcpy( pld, cmds_rx_buf.frame_s.pld, 8 );
+    if ( kbi_cmd( &dev, CMDS_FCCMD_READ, CMDS_CMD_MESH_LOCAL_PREFIX, NULL, 0 ) )
+      memcpy( pld, dev.cmds.rxBuf.frame_s.pld, 8 );
     pld[ 11 ] = 0xff;
     pld[ 12 ] = 0xfe;
     printf( "\nping other router\n" );
-    kbi_cmd( CMDS_FCCMD_WRITE, CMDS_CMD_PING, pld, 18 );
-    cmds_recv( kbi_ntf );
+    kbi_cmd( &dev, CMDS_FCCMD_WRITE, CMDS_CMD_PING, pld, 18 );
+    kbi_recv( &dev );
 
     /* Listen on all addresses */
     printf( "\nsocket open\n" );
-    if ( !kbi_socketBind( SERVER_UDP_PORT, serverCb ) )
+    if ( !kbi_socketBind( &dev, SERVER_UDP_PORT, serverCb ) )
       progExit( EXIT_FAILURE, "Unable to open socket." );
 
     /* Loop */
     printf( "\nWaiting for clients...\n" );
     while ( time( NULL ) < testEnd )
-      cmds_recv( kbi_ntf );
+      kbi_recv( &dev );
   }
   /* Client code */
   else
@@ -137,19 +142,20 @@ int main( void )
     /* Find parent RLOC */
     printf( "\nshow mlprefix\n" );
     memset( pld, 0, sizeof( pld ) );
-    if ( kbi_cmd( CMDS_FCCMD_READ, CMDS_CMD_MESH_LOCAL_PREFIX, NULL, 0 ) )
-      memcpy( pld, cmds_rx_buf.frame_s.pld, 8 );
+    if ( kbi_cmd( &dev, CMDS_FCCMD_READ, CMDS_CMD_MESH_LOCAL_PREFIX, NULL, 0 ) )
+      memcpy( pld, dev.cmds.rxBuf.frame_s.pld, 8 );
     pld[ 11 ] = 0xff;
     pld[ 12 ] = 0xfe;
     printf( "\nshow rloc16\n" );
-    if ( kbi_cmd( CMDS_FCCMD_READ, CMDS_CMD_SHORT_MAC_ADDRESS, NULL, 0 ) )
-      pld[ 14 ] = cmds_rx_buf.frame_s.pld[ 0 ] & 0xFC;
+    if ( kbi_cmd( &dev, CMDS_FCCMD_READ, CMDS_CMD_SHORT_MAC_ADDRESS, NULL, 0 ) )
+      pld[ 14 ] = dev.cmds.rxBuf.frame_s.pld[ 0 ] & 0xFC;
     inet_ntop( AF_INET6, ( ( struct in6_addr * ) pld )->s6_addr, svrAddr,
                INET6_ADDRSTRLEN );
 
     /* Open socket */
     printf( "\nsocket open\n" );
-    locPort = kbi_socketConnect( 0, SERVER_UDP_PORT, svrAddr, clientCb );
+    locPort =
+      kbi_socketConnect( &dev, 0, SERVER_UDP_PORT, svrAddr, clientCb );
 
     /* Set the UDP payload */
     strcpy( pld, CLIENT_UDP_PAYLOAD );
@@ -158,15 +164,15 @@ int main( void )
     while ( time( NULL ) < testEnd )
     {
       printf( "\nSending request...\n" );
-      kbi_socketSend( locPort, 0, NULL, pld, strlen( pld ) );
-      if ( cmds_recv( kbi_ntf ) )
+      kbi_socketSend( &dev, locPort, 0, NULL, pld, strlen( pld ) );
+      if ( kbi_recv( &dev ) )
         sleep( KBI_PORT_TOUT_MS / 1000 );
     }
   }
 
   /* Finish */
   printf( "\nsocket close\n" );
-  kbi_finish();
+  kbi_finish( &dev );
   progExit( EXIT_SUCCESS, "\nDone." );
 }
 
@@ -213,48 +219,54 @@ static _Bool joinNetwork()
 
   /* Clear existing configuration */
   printf( "\nclear\n" );
-  kbi_cmd( CMDS_FCCMD_WRITE, CMDS_CMD_CLEAR, NULL, 0 );
+  kbi_cmd( &dev, CMDS_FCCMD_WRITE, CMDS_CMD_CLEAR, NULL, 0 );
   pld[ 0 ] = CMDS_STATUS_NONE;
   pld[ 1 ] = CMDS_STATUS_NONE_NOT_CONFIG;
   printf( "\nwait_for status none\n" );
-  kbi_waitFor( CMDS_CMD_STATUS, pld, 2, 5 );
+  kbi_waitFor( &dev, CMDS_CMD_STATUS, pld, 2, 5 );
 
-  /* OOB configuration */
+  /* OOB configuration, every setting is sent without waiting */
   printf( "\noob configuration\n" );
-  kbi_cmd( CMDS_FCCMD_WRITE, CMDS_CMD_OOB_COMMISSIONING_MODE, NULL, 0 );
+  kbi_pipeCmd( &dev, CMDS_FCCMD_WRITE, CMDS_CMD_OOB_COMMISSIONING_MODE, NULL, 0,
+               NULL, NULL );
 
   pld[ 0 ] = NET_ROLE;
-  kbi_cmd( CMDS_FCCMD_WRITE, CMDS_CMD_ROLE, pld, 1 );
+  kbi_pipeCmd( &dev, CMDS_FCCMD_WRITE, CMDS_CMD_ROLE, pld, 1, NULL, NULL );
 
   pld[ 0 ] = NET_CHANNEL;
-  kbi_cmd( CMDS_FCCMD_WRITE, CMDS_CMD_CHANNEL, pld, 1 );
+  kbi_pipeCmd( &dev, CMDS_FCCMD_WRITE, CMDS_CMD_CHANNEL, pld, 1, NULL, NULL );
 
   hextobin( NET_PANID, pld, sizeof( pld ) );
-  kbi_cmd( CMDS_FCCMD_WRITE, CMDS_CMD_PAN_ID, pld, 2 );
+  kbi_pipeCmd( &dev, CMDS_FCCMD_WRITE, CMDS_CMD_PAN_ID, pld, 2, NULL, NULL );
 
   strcpy( pld, NET_NAME );
-  kbi_cmd( CMDS_FCCMD_WRITE, CMDS_CMD_NETWORK_NAME, pld, strlen( pld ) );
+  kbi_pipeCmd( &dev, CMDS_FCCMD_WRITE, CMDS_CMD_NETWORK_NAME, pld,
+               strlen( pld ), NULL, NULL );
 
   inet_pton( AF_INET6, NET_PREFIX, pld );
-  kbi_cmd( CMDS_FCCMD_WRITE, CMDS_CMD_MESH_LOCAL_PREFIX, pld, 8 );
+  kbi_pipeCmd( &dev, CMDS_FCCMD_WRITE, CMDS_CMD_MESH_LOCAL_PREFIX, pld, 8, NULL,
+               NULL );
 
   hextobin( NET_KEY, pld, sizeof( pld ) );
-  kbi_cmd( CMDS_FCCMD_WRITE, CMDS_CMD_MASTER_KEY, pld, 16 );
+  kbi_pipeCmd( &dev, CMDS_FCCMD_WRITE, CMDS_CMD_MASTER_KEY, pld, 16, NULL,
+               NULL );
 
   hextobin( NET_EXT_PANID, pld, sizeof( pld ) );
-  kbi_cmd( CMDS_FCCMD_WRITE, CMDS_CMD_EXTENDED_PAN_ID, pld, 8 );
+  kbi_pipeCmd( &dev, CMDS_FCCMD_WRITE, CMDS_CMD_EXTENDED_PAN_ID, pld, 8, NULL,
+               NULL );
 
   strcpy( pld, NET_COMM_CRED );
-  kbi_cmd( CMDS_FCCMD_WRITE, CMDS_CMD_COMMISSIONING_CREDENTIAL, pld,
-           strlen( pld ) );
+  kbi_pipeCmd( &dev, CMDS_FCCMD_WRITE, CMDS_CMD_COMMISSIONING_CREDENTIAL, pld,
+               strlen( pld ), NULL, NULL );
+  kbi_pipeWait( &dev );
 
   /* Bring interface up */
   printf( "\nifup\n" );
-  kbi_cmd( CMDS_FCCMD_WRITE, CMDS_CMD_IFUP, NULL, 0 );
+  kbi_cmd( &dev, CMDS_FCCMD_WRITE, CMDS_CMD_IFUP, NULL, 0 );
 
   printf( "\nwait_for status joined\n" );
   pld[ 0 ] = CMDS_STATUS_JOINED;
-  if ( kbi_waitFor( CMDS_CMD_STATUS, pld, 1, 20 ) )
+  if ( kbi_waitFor( &dev, CMDS_CMD_STATUS, pld, 1, 20 ) )
     return 1;
   else
     return 0;
@@ -262,19 +274,21 @@ static _Bool joinNetwork()
 
 /***************************************************************************/
 /***************************************************************************/
-static void serverCb( uint16_t locPort, uint16_t peerPort, char *peerName,
-                      uint8_t *udpPld, uint16_t udpPldLen )
+static void serverCb( kbi_dev_t *dev, uint16_t locPort, uint16_t peerPort,
+                      const struct in6_addr *peerAddr, uint8_t *udpPld,
+                      uint16_t udpPldLen )
 {
   printf( "Request received (%u bytes). Sending response...\n", udpPldLen );
 
   /* Echo response */
-  kbi_socketSend( locPort, peerPort, peerName, udpPld, udpPldLen );
+  kbi_socketSendAddr( dev, locPort, peerPort, peerAddr, udpPld, udpPldLen );
 }
 
 /***************************************************************************/
 /***************************************************************************/
-static void clientCb( uint16_t locPort, uint16_t peerPort, char *peerName,
-                      uint8_t *udpPld, uint16_t udpPldLen )
+static void clientCb( kbi_dev_t *dev, uint16_t locPort, uint16_t peerPort,
+                      const struct in6_addr *peerAddr, uint8_t *udpPld,
+                      uint16_t udpPldLen )
 {
   printf( "Response received (%u bytes).\n", udpPldLen );
 }
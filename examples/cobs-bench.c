@@ -0,0 +1,858 @@
+/**
+ * @file  cobs-bench.c
+ *
+ * @brief COBS codec benchmark and roundtrip checker.
+ *
+ * Built with -DCOBS_FUZZ it becomes a libFuzzer/AFL++ roundtrip harness
+ * instead, e.g:
+ *   clang -g -O1 -fsanitize=fuzzer,address -DCOBS_FUZZ -I include/ \
+ *     src/cobs.c examples/cobs-bench.c -o cobs-fuzz
+ */
+
+/****************************************************************************
+**                                                                         **
+**                              MODULES USED                               **
+**                                                                         **
+****************************************************************************/
+
+#include "cmds.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/****************************************************************************
+**                                                                         **
+**                         DEFINITIONS AND MACROS                          **
+**                                                                         **
+****************************************************************************/
+
+#define FRAME_MAX_LEN ( CMDS_FRAME_HEADER_LEN + CMDS_FRAME_PAYLOAD_MAX_LEN )
+
+/* Frames in every benchmark set, varied enough to defeat branch history */
+#define BENCH_FRAMES 64
+
+/* Default benchmark parameters */
+#define BENCH_PLD_LEN 1024
+#define BENCH_MIN_MS 500
+#define VERIFY_FRAMES 200000
+
+/* Codes the reference encoder keeps apart, instead of in place of a zero */
+#define REF_CODES 10
+
+/****************************************************************************
+**                                                                         **
+**                         TYPEDEFS AND STRUCTURES                         **
+**                                                                         **
+****************************************************************************/
+
+/* Payload profile, fills a frame payload of the given length */
+typedef struct profile_t
+{
+  const char *name;
+  void ( *fill )( uint8_t *pld, uint16_t len );
+} profile_t;
+
+/* Payload of a KBI frame */
+typedef struct kbiPld_t
+{
+  const uint8_t *pld;
+  uint16_t       len;
+} kbiPld_t;
+
+/* State of the reference encoder */
+typedef struct refTx_t
+{
+  uint16_t totBytes; /* Total number of bytes to send. */
+  uint16_t proBytes; /* Number of processed bytes. */
+  struct
+  {
+    uint16_t pos[ REF_CODES ];
+    uint8_t  code[ REF_CODES ];
+    uint8_t  codePos;
+  } cobs;
+} refTx_t;
+
+/* Set of frames to be encoded and decoded */
+typedef struct frameSet_t
+{
+  uint8_t  frame[ BENCH_FRAMES ][ FRAME_MAX_LEN ];
+  uint16_t len[ BENCH_FRAMES ];
+  uint8_t  enc[ BENCH_FRAMES ][ FRAME_MAX_LEN + FRAME_MAX_LEN / 8 ];
+  uint16_t encLen[ BENCH_FRAMES ];
+  uint32_t bytes;
+} frameSet_t;
+
+/****************************************************************************
+**                                                                         **
+**                      PROTOTYPES OF LOCAL FUNCTIONS                      **
+**                                                                         **
+****************************************************************************/
+
+static uint16_t buildFrame( uint8_t *frame, uint8_t typ, uint8_t cmd,
+                            const uint8_t *pld, uint16_t pldLen );
+
+static _Bool roundtrip( const uint8_t *frame, uint16_t len, uint16_t chunk );
+
+#ifndef COBS_FUZZ
+static void usage( void );
+
+static uint64_t nowNs( void );
+
+static void fillZero( uint8_t *pld, uint16_t len );
+
+static void fillNoZero( uint8_t *pld, uint16_t len );
+
+static void fillRandom( uint8_t *pld, uint16_t len );
+
+static void fillKbi( uint8_t *pld, uint16_t len );
+
+static void fillEdges( uint8_t *pld, uint16_t len );
+
+static void bench( const profile_t *prof, uint16_t pldLen, uint32_t minMs );
+
+static _Bool verify( uint32_t frames );
+
+static _Bool sameAsRef( const uint8_t *frame, uint16_t len );
+
+static _Bool sameKernels( const uint8_t *frame, uint16_t len );
+
+static int16_t refEncode( const uint8_t *frame, uint16_t len, uint8_t *out );
+#endif
+
+/****************************************************************************
+**                                                                         **
+**                            GLOBAL VARIABLES                             **
+**                                                                         **
+****************************************************************************/
+
+#ifndef COBS_FUZZ
+/* Payload profiles to be benchmarked */
+static const profile_t profiles[] = {
+    { "zero", fillZero },
+    { "nozero", fillNoZero },
+    { "random", fillRandom },
+    { "kbi", fillKbi },
+};
+
+/* Payloads of typical KBI frames, see fillKbi() */
+static const uint8_t kbiSockRecv[] = {
+    0x1d, 0x3d, 0xc0, 0x01, 0xfd, 0x00, 0x0d, 0xb8, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xff, 0xfe, 0x00, 0x04, 0x00, 0x00, 0x17,
+    0x00, 0x2a, 0x01, 0x03, 0x00, 0x00, 0x00, 0x64, 0x0c, 0xe4 };
+
+static const uint8_t kbiSockSend[] = {
+    0xc0, 0x01, 0x1d, 0x3d, 0xfd, 0xde, 0xad, 0x00, 0xbe, 0xef, 0x00,
+    0x00, 0x3c, 0x52, 0x8a, 0x0f, 0x91, 0x2b, 0x6e, 0xd4, 'H',  'e',
+    'l',  'l',  'o',  ',',  ' ',  'w',  'o',  'r',  'l',  'd',  '!' };
+
+static const uint8_t kbiFwuBlock[] = {
+    0x00, 0x05, 0x00, 0x00, 0x02, 0x20, 0x85, 0x01, 0x01, 0x00,
+    0xd9, 0x01, 0x01, 0x00, 0xdb, 0x01, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x10, 0xb5, 0x04, 0x46, 0x00, 0xf0, 0x1e, 0xf8,
+    0x20, 0x46, 0xbd, 0xe8, 0x10, 0x40, 0x70, 0x47, 0x00, 0xbf };
+
+static const uint8_t kbiVersion[] = "KiNOS-GEN-KTWM102-1.3.7402.73020";
+
+static const uint8_t kbiUptime[] = { 0x00, 0x01, 0x51, 0x80 };
+
+static const uint8_t kbiStatus[] = { CMDS_STATUS_JOINED, 0x00 };
+
+static const uint8_t kbiIpAddr[] = {
+    0xfd, 0x00, 0x0d, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xff, 0xfe, 0x00, 0x04, 0x00, 0xfe, 0x80, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0xe0, 0xa0, 0xff, 0xfe, 0x00, 0x00, 0x01 };
+
+static const kbiPld_t kbiPlds[] = {
+    { kbiSockRecv, sizeof( kbiSockRecv ) },
+    { kbiSockSend, sizeof( kbiSockSend ) },
+    { kbiFwuBlock, sizeof( kbiFwuBlock ) },
+    { kbiVersion, sizeof( kbiVersion ) },
+    { kbiUptime, sizeof( kbiUptime ) },
+    { kbiStatus, sizeof( kbiStatus ) },
+    { kbiIpAddr, sizeof( kbiIpAddr ) } };
+
+static frameSet_t set;
+#endif
+
+/****************************************************************************
+**                                                                         **
+**                           EXPORTED FUNCTIONS                            **
+**                                                                         **
+****************************************************************************/
+
+#ifdef COBS_FUZZ
+
+int LLVMFuzzerTestOneInput( const uint8_t *data, size_t size )
+{
+  static uint8_t out[ FRAME_MAX_LEN ];
+  uint8_t        frame[ FRAME_MAX_LEN ];
+  cobs_dec_t     dec;
+  const uint8_t *in = data;
+  size_t         left = size;
+  uint16_t       used;
+  uint16_t       len;
+
+  /* Anything received must be decoded safely, whatever it is */
+  memset( &dec, 0, sizeof( dec ) );
+  while ( left > 0 )
+  {
+    len = ( left > UINT16_MAX ) ? UINT16_MAX : left;
+    cobs_decFeed( &dec, out, sizeof( out ), in, len, &used );
+    in += used;
+    left -= used;
+  }
+
+  /* And any frame must come back byte for byte, whatever the span size */
+  if ( size > CMDS_FRAME_PAYLOAD_MAX_LEN )
+    size = CMDS_FRAME_PAYLOAD_MAX_LEN;
+  len = buildFrame( frame, CMDS_FTNTF, 0, data, size );
+  if ( !roundtrip( frame, len, 1 + size % 64 ) ||
+       !roundtrip( frame, len, UINT16_MAX ) )
+    abort();
+
+  return 0;
+}
+
+#else /* !COBS_FUZZ */
+
+int main( int argc, char *argv[] )
+{
+  uint16_t pldLen = BENCH_PLD_LEN;
+  uint32_t minMs  = BENCH_MIN_MS;
+  uint32_t frames = 0;
+  uint8_t  i;
+  int      arg;
+
+  for ( arg = 1; arg < argc; arg++ )
+  {
+    if ( ( strcmp( argv[ arg ], "--size" ) == 0 ) && ( arg + 1 < argc ) )
+      pldLen = atoi( argv[ ++arg ] );
+    else if ( ( strcmp( argv[ arg ], "--time" ) == 0 ) && ( arg + 1 < argc ) )
+      minMs = atoi( argv[ ++arg ] );
+    else if ( strcmp( argv[ arg ], "--verify" ) == 0 )
+      frames = VERIFY_FRAMES;
+    else
+      usage();
+  }
+  if ( pldLen > CMDS_FRAME_PAYLOAD_MAX_LEN )
+    usage();
+
+  srand( 1 );
+  if ( frames )
+    return verify( frames ) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  printf( "%-8s %6s %12s %12s %12s %12s\n", "profile", "bytes", "enc MB/s",
+          "enc ns/frm", "dec MB/s", "dec ns/frm" );
+  for ( i = 0; i < sizeof( profiles ) / sizeof( profiles[ 0 ] ); i++ )
+    bench( &profiles[ i ], pldLen, minMs );
+
+  return EXIT_SUCCESS;
+}
+
+#endif /* COBS_FUZZ */
+
+/****************************************************************************
+**                                                                         **
+**                             LOCAL FUNCTIONS                             **
+**                                                                         **
+****************************************************************************/
+
+/**
+ * @brief Build a KBI frame with a valid length header and checksum.
+ *
+ * @return        Length of the frame.
+ */
+static uint16_t buildFrame( uint8_t *frame, uint8_t typ, uint8_t cmd,
+                            const uint8_t *pld, uint16_t pldLen )
+{
+  uint16_t len = CMDS_FRAME_HEADER_LEN + pldLen;
+  uint16_t i;
+  uint8_t  cks = 0;
+
+  frame[ 0 ] = pldLen >> 8;
+  frame[ 1 ] = pldLen & 0xFF;
+  frame[ 2 ] = typ;
+  frame[ 3 ] = cmd;
+  frame[ 4 ] = 0;
+  memmove( frame + CMDS_FRAME_HEADER_LEN, pld, pldLen );
+  for ( i = 0; i < len; i++ )
+    cks ^= frame[ i ];
+  frame[ CMDS_FRAME_POS_CKS ] = cks;
+
+  return len;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Encode a frame, check the encoding is well formed and decode it back
+ *        feeding the decoder with spans of the given size.
+ *
+ * @return        1 The frame came back byte for byte, 0 Mismatch.
+ */
+static _Bool roundtrip( const uint8_t *frame, uint16_t len, uint16_t chunk )
+{
+  uint8_t    enc[ FRAME_MAX_LEN + FRAME_MAX_LEN / 8 ];
+  uint8_t    dec[ FRAME_MAX_LEN ];
+  cobs_dec_t state;
+  int32_t    encLen;
+  int32_t    pos;
+  int16_t    result = COBS_RESULT_NONE;
+  uint16_t   span;
+  uint16_t   used;
+
+  encLen = cobs_encodeBuf( frame, len, enc, sizeof( enc ) );
+  if ( ( encLen < 2 ) || ( ( uint32_t ) encLen > cobs_encodeMax( len ) ) ||
+       enc[ 0 ] )
+    return 0;
+  if ( memchr( enc + 1, 0, encLen - 1 ) )
+    return 0;
+
+  memset( &state, 0, sizeof( state ) );
+  for ( pos = 0; ( pos < encLen ) && ( result == COBS_RESULT_NONE ); )
+  {
+    span = ( encLen - pos < chunk ) ? encLen - pos : chunk;
+    result =
+      cobs_decFeed( &state, dec, sizeof( dec ), enc + pos, span, &used );
+    pos += used;
+  }
+
+  if ( ( result != len ) || memcmp( dec, frame, len ) )
+    return 0;
+
+  /* A trailing code may be left, it must not be taken as garbage */
+  cobs_decFeed( &state, dec, sizeof( dec ), enc + pos, encLen - pos, &used );
+  return ( state.dropped == 0 );
+}
+
+#ifndef COBS_FUZZ
+/***************************************************************************/
+/***************************************************************************/
+static void usage( void )
+{
+  printf( "Usage:\n" );
+  printf( "cobs-bench [--size PAYLOAD_LEN] [--time MS]\n" );
+  printf( "cobs-bench --verify\n" );
+  exit( EXIT_FAILURE );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+static uint64_t nowNs( void )
+{
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  return ( uint64_t ) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+static void fillZero( uint8_t *pld, uint16_t len ) { memset( pld, 0, len ); }
+
+/***************************************************************************/
+/***************************************************************************/
+static void fillNoZero( uint8_t *pld, uint16_t len )
+{
+  while ( len-- )
+    *pld++ = 1 + rand() % 255;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+static void fillRandom( uint8_t *pld, uint16_t len )
+{
+  while ( len-- )
+    *pld++ = rand();
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief KBI traffic: payloads of typical frames in random order, back to
+ *        back up to the length asked for. They are laid out as this library
+ *        and KiNOS build them, sensor readings, socket data and a block of a
+ *        Cortex-M image, there is no device capture to take them from.
+ */
+static void fillKbi( uint8_t *pld, uint16_t len )
+{
+  const kbiPld_t *kbi;
+  uint16_t        num;
+
+  while ( len )
+  {
+    kbi = &kbiPlds[ rand() % ( sizeof( kbiPlds ) / sizeof( kbiPlds[ 0 ] ) ) ];
+    num = ( kbi->len < len ) ? kbi->len : len;
+    memcpy( pld, kbi->pld, num );
+    pld += num;
+    len -= num;
+  }
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Mix of the encoding corner cases: data runs around 0xD0 blocks and
+ *        the two-zero codes, zero runs around 0x0F and trailing zeroes.
+ */
+static void fillEdges( uint8_t *pld, uint16_t len )
+{
+  static const uint16_t runs[] = { 1,   2,   3,   14,  15,  16,  30,
+                                   31,  206, 207, 208, 413, 414, 415 };
+  uint16_t              run;
+  uint16_t              i = 0;
+
+  while ( i < len )
+  {
+    run = runs[ rand() % ( sizeof( runs ) / sizeof( runs[ 0 ] ) ) ];
+    if ( run > len - i )
+      run = len - i;
+    if ( rand() % 2 )
+      memset( pld + i, 0, run );
+    else
+      fillNoZero( pld + i, run );
+    i += run;
+  }
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Encode and decode a set of frames of a profile over and over for at
+ *        least the given time, then print the rates.
+ */
+static void bench( const profile_t *prof, uint16_t pldLen, uint32_t minMs )
+{
+  uint8_t    pld[ CMDS_FRAME_PAYLOAD_MAX_LEN ];
+  uint8_t    out[ FRAME_MAX_LEN ];
+  cobs_dec_t dec;
+  uint64_t   start;
+  uint64_t   encNs;
+  uint64_t   decNs;
+  uint32_t   rounds;
+  uint32_t   r;
+  uint16_t   used;
+  uint8_t    i;
+
+  set.bytes = 0;
+  for ( i = 0; i < BENCH_FRAMES; i++ )
+  {
+    prof->fill( pld, pldLen );
+    set.len[ i ] = buildFrame( set.frame[ i ], CMDS_FTNTF | CMDS_FCNTF_SOCKRECV,
+                               0, pld, pldLen );
+    set.encLen[ i ] = cobs_encodeBuf( set.frame[ i ], set.len[ i ],
+                                      set.enc[ i ], sizeof( set.enc[ i ] ) );
+    set.bytes += set.len[ i ];
+    if ( !roundtrip( set.frame[ i ], set.len[ i ], UINT16_MAX ) )
+    {
+      printf( "%-8s roundtrip mismatch\n", prof->name );
+      return;
+    }
+  }
+
+  /* Encode, doubling the rounds until the run is long enough */
+  for ( rounds = 1;; rounds *= 2 )
+  {
+    start = nowNs();
+    for ( r = 0; r < rounds; r++ )
+    {
+      for ( i = 0; i < BENCH_FRAMES; i++ )
+        cobs_encodeBuf( set.frame[ i ], set.len[ i ], set.enc[ i ],
+                        sizeof( set.enc[ i ] ) );
+    }
+    encNs = nowNs() - start;
+    if ( encNs >= ( uint64_t ) minMs * 1000000 )
+      break;
+  }
+  encNs /= rounds;
+
+  /* Decode the same way */
+  memset( &dec, 0, sizeof( dec ) );
+  for ( rounds = 1;; rounds *= 2 )
+  {
+    start = nowNs();
+    for ( r = 0; r < rounds; r++ )
+    {
+      for ( i = 0; i < BENCH_FRAMES; i++ )
+        cobs_decFeed( &dec, out, sizeof( out ), set.enc[ i ],
+                      set.encLen[ i ], &used );
+    }
+    decNs = nowNs() - start;
+    if ( decNs >= ( uint64_t ) minMs * 1000000 )
+      break;
+  }
+  decNs /= rounds;
+
+  printf( "%-8s %6u %12.1f %12.1f %12.1f %12.1f\n", prof->name,
+          set.bytes / BENCH_FRAMES, ( double ) set.bytes * 1000 / encNs,
+          ( double ) encNs / BENCH_FRAMES, ( double ) set.bytes * 1000 / decNs,
+          ( double ) decNs / BENCH_FRAMES );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Roundtrip frames of every length and profile, decoded from spans of
+ *        random sizes, and check they are encoded as the reference encoder
+ *        does, with the SIMD kernels and the portable ones alike.
+ *
+ * @return        1 All frames came back, 0 Some mismatch.
+ */
+static _Bool verify( uint32_t frames )
+{
+  static void ( *fills[] )( uint8_t *, uint16_t ) = {
+      fillZero, fillNoZero, fillRandom, fillKbi, fillEdges };
+  uint8_t  pld[ CMDS_FRAME_PAYLOAD_MAX_LEN ];
+  uint8_t  frame[ FRAME_MAX_LEN ];
+  uint16_t pldLen;
+  uint16_t len;
+  uint16_t chunk;
+  uint32_t n;
+  uint32_t bad = 0;
+
+  for ( n = 0; n < frames; n++ )
+  {
+    /* Every length once, then random ones */
+    if ( n <= CMDS_FRAME_PAYLOAD_MAX_LEN )
+      pldLen = n;
+    else
+      pldLen = rand() % ( CMDS_FRAME_PAYLOAD_MAX_LEN + 1 );
+    fills[ n % ( sizeof( fills ) / sizeof( fills[ 0 ] ) ) ]( pld, pldLen );
+    len   = buildFrame( frame, rand(), rand(), pld, pldLen );
+    chunk = ( n % 3 ) ? 1 + rand() % 64 : UINT16_MAX;
+    if ( !roundtrip( frame, len, chunk ) || !sameAsRef( frame, len ) ||
+         !sameKernels( frame, len ) )
+    {
+      if ( bad++ < 10 )
+        printf( "Mismatch in frame %u, %u bytes\n", n, len );
+    }
+  }
+
+  printf( "%u frames, %u mismatches\n", frames, bad );
+  return ( bad == 0 );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Check a frame is encoded byte for byte as the reference encoder does.
+ *
+ * @return        1 Same encoding, 0 Mismatch.
+ */
+static _Bool sameAsRef( const uint8_t *frame, uint16_t len )
+{
+  uint8_t enc[ FRAME_MAX_LEN + FRAME_MAX_LEN / 8 ];
+  uint8_t ref[ FRAME_MAX_LEN + FRAME_MAX_LEN / 8 ];
+  int32_t encLen;
+
+  encLen = cobs_encodeBuf( frame, len, enc, sizeof( enc ) );
+  return ( refEncode( frame, len, ref ) == encLen ) &&
+         !memcmp( enc, ref, encLen );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Encode, decode and XOR a frame at a random alignment with the SIMD
+ *        kernels picked for the CPU, then with the portable ones, and compare
+ *        the results. The XOR is also checked a byte at a time.
+ *
+ * @return        1 Same results, 0 Mismatch.
+ */
+static _Bool sameKernels( const uint8_t *frame, uint16_t len )
+{
+  uint8_t    in[ FRAME_MAX_LEN + 32 ];
+  uint8_t    enc[ 2 ][ FRAME_MAX_LEN + FRAME_MAX_LEN / 8 ];
+  uint8_t    dec[ 2 ][ FRAME_MAX_LEN ];
+  uint8_t    cpy[ 2 ][ FRAME_MAX_LEN ];
+  uint8_t    xor[ 2 ];
+  uint8_t    decXor[ 2 ];
+  int32_t    encLen[ 2 ];
+  int16_t    decLen[ 2 ];
+  cobs_dec_t state;
+  uint8_t *  src = in + rand() % 32;
+  uint8_t    ref = 0;
+  uint16_t   used;
+  uint16_t   i;
+  uint8_t    k;
+
+  memcpy( src, frame, len );
+  for ( i = 0; i < len; i++ )
+    ref ^= src[ i ];
+  for ( k = 0; k < 2; k++ )
+  {
+    cobs_setSimd( k == 0 );
+    encLen[ k ] = cobs_encodeBuf( src, len, enc[ k ], sizeof( enc[ k ] ) );
+    memset( &state, 0, sizeof( state ) );
+    decLen[ k ] = cobs_decFeed( &state, dec[ k ], sizeof( dec[ k ] ), enc[ k ],
+                                encLen[ k ], &used );
+    decXor[ k ] = state.xor;
+    xor[ k ]    = cobs_copyXor( cpy[ k ], src, len );
+  }
+  cobs_setSimd( 1 );
+
+  return ( encLen[ 0 ] == encLen[ 1 ] ) &&
+         !memcmp( enc[ 0 ], enc[ 1 ], encLen[ 0 ] ) &&
+         ( decLen[ 0 ] == decLen[ 1 ] ) && ( decLen[ 0 ] == len ) &&
+         !memcmp( dec[ 0 ], dec[ 1 ], len ) &&
+         ( decXor[ 0 ] == decXor[ 1 ] ) && ( xor[ 0 ] == ref ) &&
+         ( xor[ 1 ] == ref ) && !memcmp( cpy[ 0 ], cpy[ 1 ], len );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Encoder cobs.c had before cobs_encodeBuf(), kept as the reference
+ *        for --verify. It writes the codes in place of the zeroes, so it works
+ *        on a copy of the frame.
+ *
+ * @return        Length of the encoded frame, start delimiter included.
+ */
+static int16_t refEncode( const uint8_t *frame, uint16_t len, uint8_t *out )
+{
+  refTx_t  tx;
+  uint8_t  buff[ FRAME_MAX_LEN ];
+  uint8_t *tmpPtr      = buff;
+  uint8_t *lastZeroPtr = NULL;
+  uint8_t *codePtr     = NULL;
+  uint16_t codePos     = 0;
+  uint16_t code        = 0x01;
+  uint8_t  numZeroes   = 0;
+  int16_t  outIdx      = 0;
+
+  /* Initialize COBS structure. */
+  memcpy( buff, frame, len );
+  memset( &tx, 0, sizeof( tx ) );
+  codePtr = tx.cobs.code;
+
+  /*
+   * proBytes = number of encoded bytes
+   * length   = Number of in data bytes to encode
+   */
+  while ( tx.proBytes < len )
+  {
+    if ( *tmpPtr == 0 )
+    {
+      numZeroes++;
+      if ( ( numZeroes == 2 ) && ( code != 0x01 ) )
+      {
+        if ( ( code + 0xDF ) <= 0xFE )
+        {
+          /* The (n-E0) data bytes, plus two trailing zeroes. */
+          code += 0xDF;
+          numZeroes = 0;
+        }
+        else
+        {
+          /* The (n-1) data bytes followed by a single zero. */
+          numZeroes = 1;
+        }
+
+        *codePtr = code;
+        tx.totBytes++;
+        if ( codePtr == tx.cobs.code + tx.cobs.codePos )
+        {
+          tx.cobs.pos[ tx.cobs.codePos ] = codePos;
+          tx.cobs.codePos++;
+        }
+
+        /* Reset counters. */
+        codePtr = tmpPtr;
+        codePos = tx.proBytes;
+        code    = 0x01;
+      }
+      else if ( numZeroes == 0x0F )
+      {
+        /* We have reached maximun number of zeroes in a row. */
+        code     = numZeroes + 0xD0;
+        codePtr  = lastZeroPtr;
+        *codePtr = code;
+        tx.totBytes++;
+
+        /* Reset counters. */
+        codePtr   = tmpPtr;
+        codePos   = tx.proBytes;
+        numZeroes = 0;
+        code      = 0x01;
+      }
+      else if ( ( codePtr == tx.cobs.code + tx.cobs.codePos ) &&
+                ( code == 0x01 ) && ( numZeroes == 1 ) )
+      {
+        codePtr = tmpPtr;
+        codePos = tx.proBytes;
+      }
+
+      lastZeroPtr = tmpPtr;
+    }
+    else if ( numZeroes )
+    {
+      /* Finish previous block. */
+      if ( numZeroes < 3 )
+      {
+        if ( code == 0x01 )
+        {
+          if ( numZeroes == 2 )
+          {
+            /* The (n-E0) data bytes, plus two trailing zeroes. */
+            code += 0xDF;
+          }
+          else
+          {
+            /* The (n-1) data bytes followed by a single zero. */
+            /* Nothing to do. */
+          }
+
+          *codePtr = code;
+          tx.totBytes++;
+
+          if ( codePtr != lastZeroPtr )
+          {
+            codePtr = lastZeroPtr;
+            codePos = tx.proBytes - 1;
+          }
+          else
+          {
+            /* Add aditional byte. */
+            codePtr = tx.cobs.code + tx.cobs.codePos;
+            codePos = tx.proBytes;
+          }
+        }
+        else
+        {
+          /* The (n-1) data bytes followed by a single zero. */
+          *codePtr = code;
+          tx.totBytes++;
+
+          if ( codePtr == tx.cobs.code + tx.cobs.codePos )
+          {
+            tx.cobs.pos[ tx.cobs.codePos ] = codePos;
+            tx.cobs.codePos++;
+          }
+
+          codePtr = lastZeroPtr;
+          codePos = tx.proBytes - 1;
+        }
+      }
+      else
+      {
+        /* A run of (n-D0) zeroes. */
+        code     = numZeroes + 0xD0;
+        *codePtr = code;
+        tx.totBytes++;
+        codePtr = lastZeroPtr;
+        codePos = tx.proBytes - 1;
+      }
+
+      /* Reset counters. */
+      numZeroes = 0;
+      code      = 0x02;
+      tx.totBytes++;
+    }
+    else
+    {
+      /* Increment code. */
+      code++;
+      if ( code == 0xD0 )
+      {
+        /*
+         * We have reached the maximum number of bytes not followed by a
+         * zero.
+         */
+        *codePtr = 0xD0;
+        tx.totBytes++;
+        if ( codePtr == tx.cobs.code + tx.cobs.codePos )
+        {
+          tx.cobs.pos[ tx.cobs.codePos ] = codePos;
+          tx.cobs.codePos++;
+        }
+
+        /* Add aditional byte.*/
+        codePtr = tx.cobs.code + tx.cobs.codePos;
+        codePos = tx.proBytes + 1;
+
+        /* Reset counters. */
+        code = 0x01;
+      }
+
+      tx.totBytes++;
+    }
+
+    /* Increment pointers. */
+    tmpPtr++;
+    tx.proBytes++;
+  }
+
+  /* Finish message. */
+  numZeroes++;
+  if ( numZeroes == 2 )
+  {
+    if ( ( code + 0xDF ) <= 0xFE )
+    {
+      /* The (n-E0) data bytes, plus two trailing zeroes. */
+      code += 0xDF;
+    }
+    else
+    {
+      /* The (n-1) data bytes followed by a single zero. */
+      *codePtr = code;
+      tx.totBytes++;
+      if ( codePtr == tx.cobs.code + tx.cobs.codePos )
+      {
+        tx.cobs.pos[ tx.cobs.codePos ] = codePos;
+        tx.cobs.codePos++;
+      }
+
+      codePtr = lastZeroPtr;
+      code    = 0x01;
+    }
+  }
+  else if ( numZeroes > 2 )
+  {
+    /* A run of zeroes. */
+    code = numZeroes + 0xD0;
+  }
+
+  *codePtr = code;
+  tx.totBytes++;
+  if ( codePtr == tx.cobs.code + tx.cobs.codePos )
+    tx.cobs.pos[ tx.cobs.codePos ] = codePos;
+
+  /* Write out the encoded bytes */
+  tx.proBytes     = 0;
+  tx.cobs.codePos = 0;
+  while ( outIdx < tx.totBytes + 1 )
+  {
+    if ( outIdx == 0 )
+    {
+      /* First zero as start delimiter */
+      out[ outIdx++ ] = 0x00;
+    }
+    else if ( ( tx.cobs.pos[ tx.cobs.codePos ] == tx.proBytes ) &&
+              ( tx.cobs.code[ tx.cobs.codePos ] != 0 ) )
+    {
+      out[ outIdx++ ] = tx.cobs.code[ tx.cobs.codePos ];
+      tx.cobs.codePos++;
+    }
+    else
+    {
+      uint8_t data = 0;
+
+      while ( data == 0 )
+      {
+        data = buff[ tx.proBytes++ ];
+        if ( data != 0 )
+          out[ outIdx++ ] = data;
+      }
+    }
+  }
+
+  return ( outIdx );
+}
+#endif /* !COBS_FUZZ */
+
+/****************************************************************************
+**                                                                         **
+**                                   EOF                                   **
+**                                                                         **
+****************************************************************************/
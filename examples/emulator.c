@@ -0,0 +1,1222 @@
+/**
+ * @file  emulator.c
+ *
+ * @brief KiNOS device emulator, serving KBI over pseudo terminals.
+ *
+ */
+
+/****************************************************************************
+**                                                                         **
+**                              MODULES USED                               **
+**                                                                         **
+****************************************************************************/
+
+#include "kbi.h"
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/****************************************************************************
+**                                                                         **
+**                         DEFINITIONS AND MACROS                          **
+**                                                                         **
+****************************************************************************/
+
+/* Emulated nodes, all of them in the same radio space */
+#define NODES_MAX 8
+#define NODES_DEFAULT 2
+
+/* Time to process a command, and for a packet to reach another node, in
+ * microseconds */
+#define LATENCY_DEFAULT_US 1000
+
+/* Bits on the line per byte, start, 8 data bits and stop */
+#define UART_BITS 10
+
+/* Frames waiting to go out of every node, must be a power of two */
+#define QUEUE_LEN 32
+
+/* Time to attach to a network and to boot after a reset, in microseconds */
+#define ATTACH_US 200000
+#define BOOT_US 300000
+
+/* UDP sockets of every node, and the first port given when none is asked */
+#define SOCKETS_MAX 16
+#define EPHEMERAL_PORT 49152
+
+/* Blocks of a firmware image */
+#define FWU_BLOCKS_MAX 32768
+
+/* Settings stored as given, with command codes below CMDS_SETTINGS */
+#define CMDS_SETTINGS 0x44
+#define SETTING_MAX_LEN 32
+
+/* Node identity, the index is added to the EUI-64 */
+#define EUI64_BASE 0x02E0A0FFFE000000ull
+#define SW_VERSION "KiNOS-EMU-1.%u"
+#define HW_VERSION "KiNOS emulator"
+
+/* Default mesh local prefix */
+#define ML_PREFIX_DEFAULT 0xFD, 0xDE, 0xAD, 0x00, 0xBE, 0xEF, 0x00, 0x00
+
+/* Address kinds */
+#define ADDR_RLOC 0
+#define ADDR_MLEID 1
+#define ADDR_LINK_LOCAL 2
+
+/****************************************************************************
+**                                                                         **
+**                         TYPEDEFS AND STRUCTURES                         **
+**                                                                         **
+****************************************************************************/
+
+/* Node counters, given by CMDS_CMD_STATISTICS in this order, 32 bit big
+ * endian each */
+typedef struct stats_t
+{
+  uint32_t rxFrames;   /* Commands received */
+  uint32_t rxErrors;   /* Undecodable frames, or sent at another rate */
+  uint32_t txFrames;   /* Responses and notifications sent */
+  uint32_t txDropped;  /* Frames dropped with the queue full */
+  uint32_t udpTx;      /* Datagrams sent */
+  uint32_t udpRx;      /* Datagrams delivered to a socket */
+  uint32_t udpLost;    /* Datagrams lost in the air or without a socket */
+  uint32_t fwuBlocks;  /* Firmware blocks taken */
+} stats_t;
+
+/* Rate of a termios speed constant */
+typedef struct rate_t
+{
+  uint32_t baud;
+  speed_t  speed;
+} rate_t;
+
+/* Frame waiting for its time to leave the node */
+typedef struct outFrame_t
+{
+  uint64_t dueUs; /* Once the whole frame went through the UART */
+  uint8_t  typ;
+  uint8_t  cmd;
+  uint16_t len;
+  uint8_t  pld[ CMDS_FRAME_PAYLOAD_MAX_LEN ];
+} outFrame_t;
+
+/* Emulated KiNOS device */
+typedef struct node_t
+{
+  cmds_t  cmds;
+  int     slave; /* Kept open so that the port never hangs up */
+  uint8_t idx;
+
+  /* UART, its rate (0 for no limit) and when every direction gets free */
+  uint32_t   baud;
+  uint32_t   prevBaud;
+  uint64_t   graceUs; /* Back to prevBaud then, 0 once a frame arrived */
+  uint64_t   rxFreeUs;
+  uint64_t   txFreeUs;
+  uint64_t   rspUs; /* Time the response to the current command is ready */
+  outFrame_t out[ QUEUE_LEN ];
+  uint32_t   outHead;
+  uint32_t   outTail;
+
+  /* Thread interface */
+  uint8_t  status[ 2 ];
+  uint8_t  role;
+  _Bool    leader;
+  uint8_t  channel;
+  uint16_t panId;
+  uint16_t rloc16;
+  uint8_t  mlPrefix[ 8 ];
+  uint64_t attachUs; /* Next attach try, 0 if none */
+  uint64_t bootUs;   /* End of the boot, 0 if running */
+  uint64_t upUs;     /* Start of the uptime */
+  uint8_t  settings[ CMDS_SETTINGS ][ SETTING_MAX_LEN ];
+  uint8_t  settingLen[ CMDS_SETTINGS ];
+
+  /* Open UDP sockets by local port, 0 if free */
+  uint16_t sockets[ SOCKETS_MAX ];
+  uint16_t nextPort;
+  uint16_t pingSeq;
+
+  /* Firmware image being received, blocks of fwuBlockSz if not 0 */
+  uint8_t  fwuMap[ FWU_BLOCKS_MAX / 8 ];
+  uint16_t fwuBlockSz;
+  uint32_t fwuEnd; /* Highest block id taken, plus one */
+  uint32_t fwuBlocks;
+  uint8_t  swMinor;
+
+  stats_t stats;
+} node_t;
+
+/****************************************************************************
+**                                                                         **
+**                      PROTOTYPES OF LOCAL FUNCTIONS                      **
+**                                                                         **
+****************************************************************************/
+
+static void usage( void );
+
+static void onSignal( int sig );
+
+static _Bool nodeOpen( node_t *node, uint8_t idx );
+
+static void nodeBoot( node_t *node );
+
+static void nodeClear( node_t *node );
+
+static void nodeTimers( node_t *node, uint64_t now );
+
+static void nodeAttach( node_t *node, uint64_t now );
+
+static void nodeAddr( node_t *node, uint8_t kind, uint8_t *addr );
+
+static _Bool nodeOwns( node_t *node, const uint8_t *addr );
+
+static _Bool sameNet( node_t *a, node_t *b );
+
+static void frameIn( node_t *node, uint64_t now );
+
+static _Bool frameCmd( node_t *node, uint8_t fc, uint8_t cmd, uint8_t *pld,
+                       uint16_t len );
+
+static void frameOut( node_t *node, uint8_t typ, uint8_t cmd,
+                      const uint8_t *pld, uint16_t len, uint64_t wantUs );
+
+static void flushOut( node_t *node, uint64_t now );
+
+static uint64_t lineUs( node_t *node, uint16_t pldLen );
+
+static _Bool sameBaud( node_t *node );
+
+static void respond( node_t *node, uint8_t fc, uint8_t cmd,
+                     const uint8_t *pld, uint16_t len );
+
+static uint8_t cmdSocket( node_t *node, uint8_t fc, uint8_t *pld,
+                          uint16_t len );
+
+static uint8_t cmdSend( node_t *node, uint8_t *pld, uint16_t len );
+
+static uint8_t cmdPing( node_t *node, uint8_t *pld, uint16_t len );
+
+static uint8_t cmdFwu( node_t *node, uint8_t *pld, uint16_t len );
+
+static void cmdStats( node_t *node, uint8_t fc );
+
+static _Bool lost( void );
+
+/****************************************************************************
+**                                                                         **
+**                           EXPORTED VARIABLES                            **
+**                                                                         **
+****************************************************************************/
+
+/****************************************************************************
+**                                                                         **
+**                            GLOBAL VARIABLES                             **
+**                                                                         **
+****************************************************************************/
+
+static node_t   nodes[ NODES_MAX ];
+static uint8_t  nodeCnt = NODES_DEFAULT;
+static uint32_t latencyUs = LATENCY_DEFAULT_US;
+static uint32_t initBaud  = UART_BAUD_DEFAULT;
+static uint32_t maxBaud   = 3000000;
+static uint16_t fwuMaxBlock = CMDS_FRAME_PAYLOAD_MAX_LEN - 2;
+static uint8_t  lossPct;
+
+static volatile sig_atomic_t stop;
+
+/* Rates the host may set on its end, others are taken as the node's */
+static const rate_t rates[] = {
+    { 9600, B9600 },       { 19200, B19200 },     { 38400, B38400 },
+    { 57600, B57600 },     { 115200, B115200 },   { 230400, B230400 },
+#ifdef B460800
+    { 460800, B460800 },
+#endif
+#ifdef B921600
+    { 921600, B921600 },
+#endif
+#ifdef B1000000
+    { 1000000, B1000000 },
+#endif
+#ifdef B1500000
+    { 1500000, B1500000 },
+#endif
+#ifdef B2000000
+    { 2000000, B2000000 },
+#endif
+#ifdef B3000000
+    { 3000000, B3000000 },
+#endif
+};
+
+/****************************************************************************
+**                                                                         **
+**                           EXPORTED FUNCTIONS                            **
+**                                                                         **
+****************************************************************************/
+
+int main( int argc, char *argv[] )
+{
+  static const struct option opts[] = {
+    { "nodes", required_argument, NULL, 'n' },
+    { "latency", required_argument, NULL, 'l' },
+    { "baud", required_argument, NULL, 'b' },
+    { "max-baud", required_argument, NULL, 'm' },
+    { "loss", required_argument, NULL, 'p' },
+    { "block", required_argument, NULL, 'k' },
+    { NULL, 0, NULL, 0 } };
+  struct pollfd pfds[ NODES_MAX ];
+  uint64_t      now;
+  uint64_t      deadline;
+  node_t *      node;
+  uint8_t       i;
+  int16_t       result;
+  long          val;
+  int           opt;
+
+  while ( ( opt = getopt_long( argc, argv, "", opts, NULL ) ) != -1 )
+  {
+    val = strtol( optarg, NULL, 0 );
+    switch ( opt )
+    {
+    case 'n':
+      if ( ( val < 1 ) || ( val > NODES_MAX ) )
+        usage();
+      nodeCnt = val;
+      break;
+    case 'l':
+      if ( val < 0 )
+        usage();
+      latencyUs = val;
+      break;
+    case 'b':
+      if ( val < 0 )
+        usage();
+      initBaud = val;
+      break;
+    case 'm':
+      if ( val < 0 )
+        usage();
+      maxBaud = val;
+      break;
+    case 'p':
+      if ( ( val < 0 ) || ( val > 100 ) )
+        usage();
+      lossPct = val;
+      break;
+    case 'k':
+      if ( ( val < 1 ) || ( val > CMDS_FRAME_PAYLOAD_MAX_LEN - 2 ) )
+        usage();
+      fwuMaxBlock = val;
+      break;
+    default:
+      usage();
+    }
+  }
+  if ( optind != argc )
+    usage();
+
+  for ( i = 0; i < nodeCnt; i++ )
+  {
+    if ( !nodeOpen( &nodes[ i ], i ) )
+    {
+      printf( "Unable to open a pseudo terminal.\n" );
+      return EXIT_FAILURE;
+    }
+    printf( "node %u: %s\n", i, uart_ptyName( &nodes[ i ].cmds.uart ) );
+  }
+  fflush( stdout );
+
+  signal( SIGINT, onSignal );
+  signal( SIGTERM, onSignal );
+  srand( uart_nowUs() );
+
+  while ( !stop )
+  {
+    /* Send what is due and wait for commands up to the next event */
+    now      = uart_nowUs();
+    deadline = now + 1000000;
+    for ( i = 0; i < nodeCnt; i++ )
+    {
+      node = &nodes[ i ];
+      nodeTimers( node, now );
+      flushOut( node, now );
+      if ( ( node->outHead != node->outTail ) &&
+           ( node->out[ node->outHead % QUEUE_LEN ].dueUs < deadline ) )
+        deadline = node->out[ node->outHead % QUEUE_LEN ].dueUs;
+      if ( node->attachUs && ( node->attachUs < deadline ) )
+        deadline = node->attachUs;
+      if ( node->bootUs && ( node->bootUs < deadline ) )
+        deadline = node->bootUs;
+      if ( node->graceUs && ( node->graceUs < deadline ) )
+        deadline = node->graceUs;
+      pfds[ i ].fd     = node->cmds.uart.fd;
+      pfds[ i ].events = POLLIN;
+    }
+    if ( poll( pfds, nodeCnt,
+               ( deadline > now ) ? ( deadline - now + 999 ) / 1000 : 0 ) <=
+         0 )
+      continue;
+
+    /* Serve every command received, responses are queued with their time */
+    now = uart_nowUs();
+    for ( i = 0; i < nodeCnt; i++ )
+    {
+      if ( !( pfds[ i ].revents & POLLIN ) )
+        continue;
+      node = &nodes[ i ];
+      while ( ( result = cmds_recvNow( &node->cmds, NULL ) ) !=
+              COBS_RESULT_TIMEOUT )
+      {
+        /* Frames sent at another rate come out garbled */
+        if ( ( result > 0 ) && sameBaud( node ) )
+          frameIn( node, now );
+        else
+          node->stats.rxErrors++;
+      }
+    }
+  }
+
+  /* Summary */
+  printf( "\n%-5s %9s %9s %9s %9s %9s %9s %9s %9s\n", "NODE", "RX", "RX ERR",
+          "TX", "TX DROP", "UDP TX", "UDP RX", "UDP LOST", "FWU" );
+  for ( i = 0; i < nodeCnt; i++ )
+  {
+    stats_t *st = &nodes[ i ].stats;
+
+    printf( "%-5u %9u %9u %9u %9u %9u %9u %9u %9u\n", i, st->rxFrames,
+            st->rxErrors, st->txFrames, st->txDropped, st->udpTx, st->udpRx,
+            st->udpLost, st->fwuBlocks );
+    close( nodes[ i ].slave );
+    uart_close( &nodes[ i ].cmds.uart );
+  }
+  return EXIT_SUCCESS;
+}
+
+/****************************************************************************
+**                                                                         **
+**                             LOCAL FUNCTIONS                             **
+**                                                                         **
+****************************************************************************/
+
+static void usage( void )
+{
+  printf( "Usage:\n" );
+  printf( "emulator [--nodes N] [--latency US] [--baud RATE] [--max-baud RATE]"
+          " [--loss PCT]\n         [--block BYTES]\n" );
+  printf( "  --nodes     Devices emulated, 1 to %u (default %u)\n", NODES_MAX,
+          NODES_DEFAULT );
+  printf( "  --latency   Time to process a command, and for a packet to "
+          "reach another\n              node, in microseconds (default %u)\n",
+          LATENCY_DEFAULT_US );
+  printf( "  --baud      UART rate after boot, 0 for no limit (default %u)\n",
+          UART_BAUD_DEFAULT );
+  printf( "  --max-baud  Fastest rate the devices switch to (default "
+          "3000000)\n" );
+  printf( "  --loss      Packets and firmware blocks lost, in percent "
+          "(default 0)\n" );
+  printf( "  --block     Largest firmware block taken (default %u)\n",
+          CMDS_FRAME_PAYLOAD_MAX_LEN - 2 );
+  exit( EXIT_FAILURE );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+static void onSignal( int sig )
+{
+  ( void ) sig;
+  stop = 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Open the pseudo terminal of a node and boot it.
+ *
+ * @return         0: Unable to open the pseudo terminal.
+ *                 1: Node running.
+ */
+static _Bool nodeOpen( node_t *node, uint8_t idx )
+{
+  memset( node, 0, sizeof( node_t ) );
+  node->idx = idx;
+  if ( !uart_init( &node->cmds.uart, "pty:", initBaud, 0, 0 ) )
+    return 0;
+
+  /* Nobody may read the output for a while, which must not block nor wait */
+  node->slave = open( uart_ptyName( &node->cmds.uart ), O_RDWR | O_NOCTTY );
+  fcntl( node->cmds.uart.fd, F_SETFL,
+         fcntl( node->cmds.uart.fd, F_GETFL ) | O_NONBLOCK );
+
+  nodeBoot( node );
+  return 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Start the node afresh, with a new firmware if an image was received.
+ *        The configuration is kept.
+ */
+static void nodeBoot( node_t *node )
+{
+  /* An image without gaps is taken as whole */
+  if ( node->fwuBlocks && ( node->fwuBlocks == node->fwuEnd ) )
+    node->swMinor++;
+  node->fwuBlockSz = 0;
+  node->fwuEnd     = 0;
+  node->fwuBlocks  = 0;
+
+  node->upUs     = uart_nowUs();
+  node->baud     = initBaud;
+  node->graceUs  = 0;
+  node->attachUs = 0;
+  node->leader   = 0;
+  node->rloc16   = 0xFFFE;
+  memset( node->sockets, 0, sizeof( node->sockets ) );
+  node->status[ 0 ] = CMDS_STATUS_NONE;
+  node->status[ 1 ] = node->channel ? CMDS_STATUS_NONE_CONFIG
+                                    : CMDS_STATUS_NONE_NOT_CONFIG;
+  if ( !node->channel )
+    nodeClear( node );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Leave the network and forget the configuration. A firmware image
+ *        being received is kept.
+ */
+static void nodeClear( node_t *node )
+{
+  static const uint8_t prefix[] = { ML_PREFIX_DEFAULT };
+
+  memset( node->settings, 0, sizeof( node->settings ) );
+  memset( node->settingLen, 0, sizeof( node->settingLen ) );
+  memset( node->sockets, 0, sizeof( node->sockets ) );
+  memcpy( node->mlPrefix, prefix, sizeof( prefix ) );
+  node->role        = CMDS_ROLE_ROUTER;
+  node->leader      = 0;
+  node->channel     = 0;
+  node->panId       = 0xFFFF;
+  node->rloc16      = 0xFFFE;
+  node->attachUs    = 0;
+  node->nextPort    = EPHEMERAL_PORT;
+  node->status[ 0 ] = CMDS_STATUS_NONE;
+  node->status[ 1 ] = CMDS_STATUS_NONE_NOT_CONFIG;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Run the timed transitions of a node: the end of its boot, attach
+ *        tries and the fallback of an unconfirmed baud rate.
+ */
+static void nodeTimers( node_t *node, uint64_t now )
+{
+  if ( node->bootUs && ( node->bootUs <= now ) )
+  {
+    node->bootUs = 0;
+    nodeBoot( node );
+  }
+  if ( node->attachUs && ( node->attachUs <= now ) )
+    nodeAttach( node, now );
+  if ( node->graceUs && ( node->graceUs <= now ) )
+  {
+    node->graceUs = 0;
+    node->baud    = node->prevBaud;
+  }
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Try to attach to a network with the same channel, PAN ID and mesh
+ *        local prefix. Routers form it if nobody else did, end devices wait
+ *        for a parent.
+ */
+static void nodeAttach( node_t *node, uint64_t now )
+{
+  node_t *parent = NULL;
+  uint8_t i;
+
+  for ( i = 0; ( i < nodeCnt ) && !parent; i++ )
+  {
+    if ( ( &nodes[ i ] != node ) && sameNet( node, &nodes[ i ] ) &&
+         ( nodes[ i ].status[ 0 ] == CMDS_STATUS_JOINED ) &&
+         ( nodes[ i ].role < CMDS_ROLE_FED ||
+           nodes[ i ].role == CMDS_ROLE_LEADER ) )
+      parent = &nodes[ i ];
+  }
+
+  if ( ( node->role >= CMDS_ROLE_FED ) && ( node->role <= CMDS_ROLE_SED ) )
+  {
+    if ( !parent )
+    {
+      node->attachUs = now + ATTACH_US;
+      return;
+    }
+    node->rloc16 = parent->rloc16 | ( node->idx + 1 );
+  }
+  else
+  {
+    node->rloc16 = node->idx << 10;
+    node->leader = !parent;
+  }
+  node->attachUs    = 0;
+  node->status[ 0 ] = CMDS_STATUS_JOINED;
+  node->status[ 1 ] = 0;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Get an address of the node, its interface identifiers are derived
+ *        from the RLOC16 and the EUI-64 as in Thread.
+ */
+static void nodeAddr( node_t *node, uint8_t kind, uint8_t *addr )
+{
+  uint64_t iid = htobe64( EUI64_BASE + node->idx );
+
+  memset( addr, 0, 16 );
+  if ( kind == ADDR_LINK_LOCAL )
+  {
+    addr[ 0 ] = 0xFE;
+    addr[ 1 ] = 0x80;
+  }
+  else
+    memcpy( addr, node->mlPrefix, 8 );
+
+  if ( kind == ADDR_RLOC )
+  {
+    addr[ 11 ] = 0xFF;
+    addr[ 12 ] = 0xFE;
+    addr[ 14 ] = node->rloc16 >> 8;
+    addr[ 15 ] = node->rloc16 & 0xFF;
+  }
+  else
+  {
+    memcpy( addr + 8, &iid, 8 );
+    addr[ 8 ] ^= 0x02;
+  }
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Tell whether a packet to an address reaches the node, multicast
+ *        ones reach every node.
+ */
+static _Bool nodeOwns( node_t *node, const uint8_t *addr )
+{
+  uint8_t own[ 16 ];
+  uint8_t kind;
+
+  if ( node->status[ 0 ] != CMDS_STATUS_JOINED )
+    return 0;
+  if ( addr[ 0 ] == 0xFF )
+    return 1;
+  for ( kind = ADDR_RLOC; kind <= ADDR_LINK_LOCAL; kind++ )
+  {
+    nodeAddr( node, kind, own );
+    if ( !memcmp( own, addr, 16 ) )
+      return 1;
+  }
+  return 0;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+static _Bool sameNet( node_t *a, node_t *b )
+{
+  return ( a->channel == b->channel ) && ( a->panId == b->panId ) &&
+         !memcmp( a->mlPrefix, b->mlPrefix, 8 );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Serve the command in the receive buffer. It is taken once it went
+ *        through the UART, and answered after the latency.
+ */
+static void frameIn( node_t *node, uint64_t now )
+{
+  cmds_frame_t *frame = &node->cmds.rxBuf.frame_s;
+  uint16_t      len   = be16toh( frame->len );
+
+  /* Nothing is heard while booting */
+  if ( node->bootUs || ( ( frame->typ & 0xF0 ) != CMDS_FTCMD ) )
+    return;
+  node->stats.rxFrames++;
+  node->graceUs = 0;
+
+  if ( node->rxFreeUs < now )
+    node->rxFreeUs = now;
+  node->rxFreeUs += lineUs( node, len );
+  node->rspUs = node->rxFreeUs + latencyUs;
+
+  if ( !frameCmd( node, frame->typ & 0x0F, frame->cmd, frame->pld, len ) )
+    respond( node, CMDS_FCRSP_BADCMD, frame->cmd, NULL, 0 );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Execute a command and answer it.
+ *
+ * @return         0: Unknown command.
+ *                 1: Command answered.
+ */
+static _Bool frameCmd( node_t *node, uint8_t fc, uint8_t cmd, uint8_t *pld,
+                       uint16_t len )
+{
+  uint8_t  val[ 32 ];
+  uint8_t  rsp = CMDS_FCRSP_OK;
+  uint64_t eui64;
+  uint32_t word;
+  uint16_t half;
+
+  /* Settings taken straight, any of them makes the node configured */
+  if ( ( fc == CMDS_FCCMD_WRITE ) &&
+       ( node->status[ 0 ] == CMDS_STATUS_NONE ) &&
+       ( ( cmd == CMDS_CMD_ROLE ) || ( cmd == CMDS_CMD_CHANNEL ) ||
+         ( cmd == CMDS_CMD_PAN_ID ) || ( cmd == CMDS_CMD_MESH_LOCAL_PREFIX ) ||
+         ( cmd == CMDS_CMD_NETWORK_NAME ) || ( cmd == CMDS_CMD_MASTER_KEY ) ) )
+    node->status[ 1 ] = CMDS_STATUS_NONE_CONFIG;
+
+  switch ( cmd )
+  {
+  case CMDS_CMD_CLEAR:
+    nodeClear( node );
+    break;
+
+  case CMDS_CMD_RESET:
+    node->bootUs = node->rspUs + BOOT_US;
+    break;
+
+  case CMDS_CMD_UPTIME:
+    word = htobe32( ( uart_nowUs() - node->upUs ) / 1000000 );
+    respond( node, CMDS_FCRSP_VALUE, cmd, ( uint8_t * ) &word, 4 );
+    return 1;
+
+  case CMDS_CMD_STATUS:
+    respond( node, CMDS_FCRSP_VALUE, cmd, node->status, 2 );
+    return 1;
+
+  case CMDS_CMD_IFUP:
+    if ( !node->channel )
+      rsp = CMDS_FCRSP_NOTALLOW;
+    else if ( node->status[ 0 ] == CMDS_STATUS_NONE )
+    {
+      node->status[ 0 ] = CMDS_STATUS_ATTACHING;
+      node->status[ 1 ] = 0;
+      node->attachUs    = node->rspUs + ATTACH_US;
+    }
+    break;
+
+  case CMDS_CMD_IFDOWN:
+    node->status[ 0 ] = CMDS_STATUS_NONE;
+    node->status[ 1 ] = CMDS_STATUS_NONE_CONFIG;
+    node->attachUs    = 0;
+    node->leader      = 0;
+    node->rloc16      = 0xFFFE;
+    break;
+
+  case CMDS_CMD_SOFTWARE_VERSION:
+    len = snprintf( ( char * ) val, sizeof( val ), SW_VERSION, node->swMinor );
+    respond( node, CMDS_FCRSP_VALUE, cmd, val, len + 1 );
+    return 1;
+
+  case CMDS_CMD_HARDWARE_VERSION:
+    respond( node, CMDS_FCRSP_VALUE, cmd, ( uint8_t * ) HW_VERSION,
+             sizeof( HW_VERSION ) );
+    return 1;
+
+  case CMDS_CMD_SERIAL_NUMBER:
+    len = snprintf( ( char * ) val, sizeof( val ), "EMU%04u", node->idx );
+    respond( node, CMDS_FCRSP_VALUE, cmd, val, len + 1 );
+    return 1;
+
+  case CMDS_CMD_EUI_64_ADDRESS:
+  case CMDS_CMD_EXTENDED_MAC_ADDRESS:
+    eui64 = htobe64( EUI64_BASE + node->idx );
+    respond( node, CMDS_FCRSP_VALUE, cmd, ( uint8_t * ) &eui64, 8 );
+    return 1;
+
+  case CMDS_CMD_SHORT_MAC_ADDRESS:
+    half = htobe16( node->rloc16 );
+    respond( node, CMDS_FCRSP_VALUE, cmd, ( uint8_t * ) &half, 2 );
+    return 1;
+
+  case CMDS_CMD_ROLE:
+    if ( fc == CMDS_FCCMD_READ )
+    {
+      val[ 0 ] = node->leader ? CMDS_ROLE_LEADER : node->role;
+      respond( node, CMDS_FCRSP_VALUE, cmd, val, 1 );
+      return 1;
+    }
+    if ( ( len != 1 ) || ( pld[ 0 ] > CMDS_ROLE_LEADER ) )
+      rsp = CMDS_FCRSP_BADPARAM;
+    else
+      node->role = pld[ 0 ];
+    break;
+
+  case CMDS_CMD_CHANNEL:
+    if ( fc == CMDS_FCCMD_READ )
+    {
+      respond( node, CMDS_FCRSP_VALUE, cmd, &node->channel, 1 );
+      return 1;
+    }
+    if ( ( len != 1 ) || ( pld[ 0 ] < CMDS_CHANNEL_11 ) ||
+         ( pld[ 0 ] > CMDS_CHANNEL_26 ) )
+      rsp = CMDS_FCRSP_BADPARAM;
+    else
+      node->channel = pld[ 0 ];
+    break;
+
+  case CMDS_CMD_PAN_ID:
+    if ( fc == CMDS_FCCMD_READ )
+    {
+      half = htobe16( node->panId );
+      respond( node, CMDS_FCRSP_VALUE, cmd, ( uint8_t * ) &half, 2 );
+      return 1;
+    }
+    if ( len != 2 )
+      rsp = CMDS_FCRSP_BADPARAM;
+    else
+      node->panId = ( pld[ 0 ] << 8 ) | pld[ 1 ];
+    break;
+
+  case CMDS_CMD_MESH_LOCAL_PREFIX:
+    if ( fc == CMDS_FCCMD_READ )
+    {
+      respond( node, CMDS_FCRSP_VALUE, cmd, node->mlPrefix, 8 );
+      return 1;
+    }
+    if ( len != 8 )
+      rsp = CMDS_FCRSP_BADPARAM;
+    else
+      memcpy( node->mlPrefix, pld, 8 );
+    break;
+
+  case CMDS_CMD_SOCKET_OPEN_CLOSE:
+    if ( ( rsp = cmdSocket( node, fc, pld, len ) ) == CMDS_FCRSP_VALUE )
+      return 1;
+    break;
+
+  case CMDS_CMD_SOCKET_SEND:
+    rsp = cmdSend( node, pld, len );
+    break;
+
+  case CMDS_CMD_PING:
+    rsp = cmdPing( node, pld, len );
+    break;
+
+  case CMDS_CMD_NAMED_SOCKET_SEND:
+  case CMDS_CMD_NAMED_PING:
+    /* No name resolution in the emulated network */
+    rsp = CMDS_FCRSP_NOTALLOW;
+    break;
+
+  case CMDS_CMD_FIRMWARE_UPDATE:
+    /* Lost blocks get no response at all */
+    if ( lost() )
+      return 1;
+    if ( ( rsp = cmdFwu( node, pld, len ) ) == CMDS_FCRSP_VALUE )
+    {
+      respond( node, rsp, cmd, pld, 2 );
+      return 1;
+    }
+    break;
+
+  case CMDS_CMD_STATISTICS:
+    cmdStats( node, fc );
+    return 1;
+
+  default:
+#if KBI_CMD_BAUD >= 0
+    if ( cmd == ( uint8_t ) KBI_CMD_BAUD )
+    {
+      if ( ( fc != CMDS_FCCMD_WRITE ) || ( len != 4 ) )
+        return 0;
+      word = ( pld[ 0 ] << 24 ) | ( pld[ 1 ] << 16 ) | ( pld[ 2 ] << 8 ) |
+             pld[ 3 ];
+      if ( !word || ( word > maxBaud ) )
+      {
+        respond( node, CMDS_FCRSP_BADPARAM, cmd, NULL, 0 );
+        return 1;
+      }
+
+      /* Answered at the current rate, the new one is used right after */
+      respond( node, CMDS_FCRSP_OK, cmd, NULL, 0 );
+      node->prevBaud = node->baud;
+      node->baud     = word;
+      node->graceUs  = node->txFreeUs + ( uint64_t ) KBI_BAUD_GRACE_MS * 1000;
+      return 1;
+    }
+#endif
+    if ( cmd >= CMDS_SETTINGS )
+      return 0;
+
+    /* Other settings are just kept to be read back */
+    if ( fc == CMDS_FCCMD_READ )
+    {
+      respond( node, CMDS_FCRSP_VALUE, cmd, node->settings[ cmd ],
+               node->settingLen[ cmd ] );
+      return 1;
+    }
+    if ( len > SETTING_MAX_LEN )
+      len = SETTING_MAX_LEN;
+    node->settingLen[ cmd ] = ( fc == CMDS_FCCMD_WRITE ) ? len : 0;
+    memcpy( node->settings[ cmd ], pld, node->settingLen[ cmd ] );
+    break;
+  }
+
+  respond( node, rsp, cmd, NULL, 0 );
+  return 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Queue a frame to leave the node once the UART gets to it, not
+ *        before wantUs.
+ */
+static void frameOut( node_t *node, uint8_t typ, uint8_t cmd,
+                      const uint8_t *pld, uint16_t len, uint64_t wantUs )
+{
+  outFrame_t *frame;
+
+  if ( node->outTail - node->outHead == QUEUE_LEN )
+  {
+    node->stats.txDropped++;
+    return;
+  }
+
+  if ( node->txFreeUs < wantUs )
+    node->txFreeUs = wantUs;
+  node->txFreeUs += lineUs( node, len );
+
+  frame        = &node->out[ node->outTail++ % QUEUE_LEN ];
+  frame->dueUs = node->txFreeUs;
+  frame->typ   = typ;
+  frame->cmd   = cmd;
+  frame->len   = len;
+  memcpy( frame->pld, pld, len );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Send the queued frames whose time came, in order.
+ */
+static void flushOut( node_t *node, uint64_t now )
+{
+  outFrame_t *frame;
+
+  while ( node->outHead != node->outTail )
+  {
+    frame = &node->out[ node->outHead % QUEUE_LEN ];
+    if ( frame->dueUs > now )
+      break;
+    cmds_send( &node->cmds, frame->typ, frame->cmd, frame->pld, frame->len );
+    node->stats.txFrames++;
+    node->outHead++;
+  }
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Get the time a frame takes on the UART at the node's rate.
+ *
+ * @return         Microseconds.
+ */
+static uint64_t lineUs( node_t *node, uint16_t pldLen )
+{
+  if ( !node->baud )
+    return 0;
+  return ( uint64_t ) cobs_encodeMax( CMDS_FRAME_HEADER_LEN + pldLen ) *
+         UART_BITS * 1000000 / node->baud;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief See if the host set its end of the pseudo terminal to the node's
+ *        rate.
+ *
+ * @return         0: Another rate.
+ *                 1: Same rate, no limit or a rate not in rates[].
+ */
+static _Bool sameBaud( node_t *node )
+{
+  struct termios options;
+  speed_t        speed;
+  uint8_t        i;
+
+  if ( !node->baud || ( tcgetattr( node->slave, &options ) != 0 ) )
+    return 1;
+  speed = cfgetospeed( &options );
+  for ( i = 0; i < sizeof( rates ) / sizeof( rates[ 0 ] ); i++ )
+  {
+    if ( rates[ i ].speed == speed )
+      return ( rates[ i ].baud == node->baud );
+  }
+  return 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+static void respond( node_t *node, uint8_t fc, uint8_t cmd,
+                     const uint8_t *pld, uint16_t len )
+{
+  frameOut( node, CMDS_FTRSP | fc, cmd, pld, len, node->rspUs );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Open (write) or close (delete) a socket, or list the open ones.
+ *
+ * @return         Response code, CMDS_FCRSP_VALUE if already answered.
+ */
+static uint8_t cmdSocket( node_t *node, uint8_t fc, uint8_t *pld,
+                          uint16_t len )
+{
+  uint16_t ports[ SOCKETS_MAX ];
+  uint16_t port = ( len >= 2 ) ? ( pld[ 0 ] << 8 ) | pld[ 1 ] : 0;
+  uint8_t  cnt  = 0;
+  uint8_t  i;
+  int8_t   slot = -1;
+
+  for ( i = 0; i < SOCKETS_MAX; i++ )
+  {
+    if ( node->sockets[ i ] )
+      ports[ cnt++ ] = htobe16( node->sockets[ i ] );
+    else if ( slot < 0 )
+      slot = i;
+  }
+  if ( fc == CMDS_FCCMD_READ )
+  {
+    respond( node, CMDS_FCRSP_VALUE, CMDS_CMD_SOCKET_OPEN_CLOSE,
+             ( uint8_t * ) ports, cnt * 2 );
+    return CMDS_FCRSP_VALUE;
+  }
+
+  for ( i = 0; i < SOCKETS_MAX; i++ )
+  {
+    if ( port && ( node->sockets[ i ] == port ) )
+      break;
+  }
+  if ( fc == CMDS_FCCMD_DELETE )
+  {
+    if ( i == SOCKETS_MAX )
+      return CMDS_FCRSP_BADPARAM;
+    node->sockets[ i ] = 0;
+    return CMDS_FCRSP_OK;
+  }
+
+  /* An open port is given back as is */
+  if ( i == SOCKETS_MAX )
+  {
+    if ( slot < 0 )
+      return CMDS_FCRSP_MEMERR;
+    if ( !port )
+    {
+      port = node->nextPort++;
+      if ( !node->nextPort )
+        node->nextPort = EPHEMERAL_PORT;
+    }
+    node->sockets[ slot ] = port;
+  }
+  port = htobe16( port );
+  respond( node, CMDS_FCRSP_VALUE, CMDS_CMD_SOCKET_OPEN_CLOSE,
+           ( uint8_t * ) &port, 2 );
+  return CMDS_FCRSP_VALUE;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Send a datagram from an open socket to every node owning the
+ *        destination address, each gets it from the same kind of address.
+ *
+ * @return         Response code.
+ */
+static uint8_t cmdSend( node_t *node, uint8_t *pld, uint16_t len )
+{
+  uint8_t  ntf[ CMDS_FRAME_PAYLOAD_MAX_LEN ];
+  uint8_t *dst = pld + 4;
+  uint64_t arriveUs;
+  node_t * peer;
+  uint16_t port    = ( len >= 2 ) ? ( pld[ 0 ] << 8 ) | pld[ 1 ] : 0;
+  uint8_t  kind    = ADDR_MLEID;
+  uint8_t  reached = 0;
+  uint8_t  i;
+  uint8_t  j;
+
+  if ( len < 20 )
+    return CMDS_FCRSP_BADPARAM;
+  for ( i = 0; ( i < SOCKETS_MAX ) && ( node->sockets[ i ] != port ); i++ )
+    ;
+  if ( !port || ( i == SOCKETS_MAX ) )
+    return CMDS_FCRSP_BADPARAM;
+  if ( node->status[ 0 ] != CMDS_STATUS_JOINED )
+    return CMDS_FCRSP_NOTALLOW;
+  node->stats.udpTx++;
+
+  /* Notification: destination port, source port, source address, data */
+  if ( ( dst[ 0 ] == 0xFE ) && ( dst[ 1 ] == 0x80 ) )
+    kind = ADDR_LINK_LOCAL;
+  else if ( ( dst[ 11 ] == 0xFF ) && ( dst[ 12 ] == 0xFE ) && !dst[ 13 ] )
+    kind = ADDR_RLOC;
+  memcpy( ntf, pld + 2, 2 );
+  memcpy( ntf + 2, pld, 2 );
+  nodeAddr( node, kind, ntf + 4 );
+  memcpy( ntf + 20, pld + 20, len - 20 );
+  arriveUs = node->rspUs + latencyUs;
+
+  for ( i = 0; i < nodeCnt; i++ )
+  {
+    peer = &nodes[ i ];
+    if ( !sameNet( node, peer ) || !nodeOwns( peer, dst ) ||
+         ( ( peer == node ) && ( dst[ 0 ] == 0xFF ) ) )
+      continue;
+    reached++;
+    port = ( pld[ 2 ] << 8 ) | pld[ 3 ];
+    for ( j = 0; ( j < SOCKETS_MAX ) && ( peer->sockets[ j ] != port ); j++ )
+      ;
+    if ( lost() || ( j == SOCKETS_MAX ) )
+      peer->stats.udpLost++;
+    else
+    {
+      peer->stats.udpRx++;
+      frameOut( peer, CMDS_FTNTF | CMDS_FCNTF_SOCKRECV, CMDS_CMD_SOCKET_SEND,
+                ntf, len, arriveUs );
+    }
+  }
+
+  /* Nobody owns a unicast destination */
+  if ( !reached && ( dst[ 0 ] != 0xFF ) )
+    frameOut( node, CMDS_FTNTF | CMDS_FCNTF_DSTUNREACH, CMDS_CMD_SOCKET_SEND,
+              dst, 16, arriveUs + latencyUs );
+  return CMDS_FCRSP_OK;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Ping an address, the reply comes from the first node owning it.
+ *
+ * @return         Response code.
+ */
+static uint8_t cmdPing( node_t *node, uint8_t *pld, uint16_t len )
+{
+  uint8_t  ntf[ 22 ];
+  uint16_t seq = htobe16( ++node->pingSeq );
+  uint8_t  i;
+
+  if ( len < 16 )
+    return CMDS_FCRSP_BADPARAM;
+  if ( node->status[ 0 ] != CMDS_STATUS_JOINED )
+    return CMDS_FCRSP_NOTALLOW;
+
+  /* Reply: address, sequence, size and identifier */
+  memcpy( ntf, pld, 16 );
+  memcpy( ntf + 16, &seq, 2 );
+  ntf[ 18 ] = ( len >= 18 ) ? pld[ 16 ] : 0;
+  ntf[ 19 ] = ( len >= 18 ) ? pld[ 17 ] : 0;
+  ntf[ 20 ] = 0;
+  ntf[ 21 ] = node->idx;
+  for ( i = 0; i < nodeCnt; i++ )
+  {
+    if ( sameNet( node, &nodes[ i ] ) && nodeOwns( &nodes[ i ], pld ) )
+    {
+      if ( !lost() )
+        frameOut( node, CMDS_FTNTF | CMDS_FCNTF_PINGREPLY, CMDS_CMD_PING, ntf,
+                  sizeof( ntf ), node->rspUs + 2 * latencyUs );
+      break;
+    }
+  }
+  return CMDS_FCRSP_OK;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Take a firmware block. Block 0 starts an image and sets the block
+ *        size, no block may be longer, unless it is a duplicate of the one
+ *        that started the image in progress. Blocks may come in any order and
+ *        more than once.
+ *
+ * @return         Response code, CMDS_FCRSP_VALUE to echo the block id.
+ */
+static uint8_t cmdFwu( node_t *node, uint8_t *pld, uint16_t len )
+{
+  uint32_t id;
+
+  if ( ( len < 3 ) || ( len - 2 > fwuMaxBlock ) )
+    return CMDS_FCRSP_BADPARAM;
+  id = ( pld[ 0 ] << 8 ) | pld[ 1 ];
+  len -= 2;
+
+  if ( !id && ( len != node->fwuBlockSz ) )
+  {
+    memset( node->fwuMap, 0, sizeof( node->fwuMap ) );
+    node->fwuBlockSz = len;
+    node->fwuEnd     = 0;
+    node->fwuBlocks  = 0;
+  }
+
+  /* Without block 0 since the boot there is no image to go on with */
+  if ( !node->fwuBlockSz || ( len > node->fwuBlockSz ) ||
+       ( id >= FWU_BLOCKS_MAX ) )
+    return CMDS_FCRSP_FWUERR;
+  if ( id >= node->fwuEnd )
+    node->fwuEnd = id + 1;
+
+  if ( !( node->fwuMap[ id / 8 ] & ( 1 << ( id % 8 ) ) ) )
+  {
+    node->fwuMap[ id / 8 ] |= 1 << ( id % 8 );
+    node->fwuBlocks++;
+  }
+  node->stats.fwuBlocks++;
+  return CMDS_FCRSP_VALUE;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Read the statistics, or reset them when deleted.
+ */
+static void cmdStats( node_t *node, uint8_t fc )
+{
+  uint32_t words[ sizeof( stats_t ) / 4 ];
+  uint8_t  i;
+
+  if ( fc == CMDS_FCCMD_DELETE )
+  {
+    memset( &node->stats, 0, sizeof( stats_t ) );
+    respond( node, CMDS_FCRSP_OK, CMDS_CMD_STATISTICS, NULL, 0 );
+    return;
+  }
+  memcpy( words, &node->stats, sizeof( stats_t ) );
+  for ( i = 0; i < sizeof( stats_t ) / 4; i++ )
+    words[ i ] = htobe32( words[ i ] );
+  respond( node, CMDS_FCRSP_VALUE, CMDS_CMD_STATISTICS, ( uint8_t * ) words,
+           sizeof( words ) );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+static _Bool lost( void ) { return lossPct && ( rand() % 100 < lossPct ); }
+
+/****************************************************************************
+**                                                                         **
+**                                   EOF                                   **
+**                                                                         **
+****************************************************************************/
@@ -12,9 +12,17 @@
 ****************************************************************************/
 
 #include "kbi.h"
+#include <errno.h>
+#include <getopt.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 
 /****************************************************************************
@@ -23,10 +31,47 @@
 **                                                                         **
 ****************************************************************************/
 
-#define BLOCK_SIZE 64
 #define DFU_SUFFIX_SIZE 16
+
+/* Block size, the largest is tried first and halved while the device rejects
+ * it, down to the original one */
+#define BLOCK_SIZE 64
+#define BLOCK_SIZE_MAX ( CMDS_FRAME_PAYLOAD_MAX_LEN - 2 )
+
+/* Tries of every block, each waiting a retransmission timeout */
 #define BLOCK_RETRIES 5
-#define BLOCK_TIMEOUT 10
+
+/* Blocks in flight at once, WINDOW_MAX must be a power of two */
+#define WINDOW_DEFAULT 4
+#define WINDOW_MAX 32
+
+/* Retransmission timeout bounds and initial value, in microseconds */
+#define RTO_MIN_US 100000
+#define RTO_MAX_US 10000000
+#define RTO_INIT_US 1000000
+
+/* Interval between progress reports, in microseconds */
+#define PROGRESS_US 200000
+
+/* Devices updated at once */
+#define NODES_MAX 64
+
+/* Time for a device to boot the new firmware, in seconds */
+#define BOOT_TOUT 15
+
+/* Journal entries kept, one per device */
+#define JOURNAL_MAX 256
+
+/* Difference allowed between boot times of a device taken from its uptime,
+ * in seconds */
+#define BOOT_SLACK 2
+
+/* Node states */
+#define NODE_FAILED 0
+#define NODE_SKIPPED 1
+#define NODE_FLASHING 2
+#define NODE_FLASHED 3
+#define NODE_UPDATED 4
 
 /****************************************************************************
 **                                                                         **
@@ -34,6 +79,65 @@
 **                                                                         **
 ****************************************************************************/
 
+/* Block in flight, kept in the slot of its id modulo WINDOW_MAX */
+typedef struct fwuSlot_t
+{
+  uint64_t sentUs; /* Time of the last try */
+  uint8_t  tries;  /* If 0, acknowledged */
+} fwuSlot_t;
+
+/* Firmware transfer to a device */
+typedef struct fwu_t
+{
+  kbi_dev_t *    dev;
+  const uint8_t *img;
+  uint32_t       imgLen;
+  uint16_t       blockSz;
+  uint32_t       blocks;
+  _Bool          sized; /* The device acknowledged a block of blockSz */
+  uint8_t        stale; /* Rejects still due to tries of a bigger size */
+
+  /* Blocks from base on are unacknowledged, and sent up to next */
+  uint32_t  base;
+  uint32_t  next;
+  uint32_t  from; /* First block of this run, if resumed */
+  uint8_t   window;
+  fwuSlot_t slots[ WINDOW_MAX ];
+
+  /* Retransmission timer, RFC 6298 estimators from unambiguous samples */
+  uint32_t srttUs;
+  uint32_t rttvarUs;
+  uint32_t rtoUs;
+
+  /* Statistics */
+  uint64_t startUs;
+  uint64_t endUs;
+  uint32_t resent;
+} fwu_t;
+
+/* Journal entry, the progress of the transfer to a device */
+typedef struct jrnl_t
+{
+  uint64_t eui64;
+  uint64_t hash; /* Of the image */
+  int64_t  boot; /* Wall clock time the device booted */
+  uint16_t blockSz;
+  uint32_t base; /* Blocks acknowledged, 0 if none or done */
+} jrnl_t;
+
+/* Device of the fleet being updated */
+typedef struct node_t
+{
+  const char *port;
+  kbi_dev_t   dev;
+  fwu_t       fwu;
+  jrnl_t *    jrnl;     /* NULL if not journaled */
+  uint32_t    initBaud; /* Link rate before the transfer, 0 if not started */
+  uint8_t     state;    /* NODE_* */
+  const char *error;
+  char        version[ 64 ];
+} node_t;
+
 /****************************************************************************
 **                                                                         **
 **                      PROTOTYPES OF LOCAL FUNCTIONS                      **
@@ -44,7 +148,49 @@ static void progExit( uint8_t code, char *text );
 
 static void usage( void );
 
-static int8_t send_block( uint8_t size );
+static const uint8_t *mapImage( const char *path, uint32_t *len );
+
+static void targetVersion( const char *path, char *ver, size_t size );
+
+static _Bool readVersion( node_t *node );
+
+static void nodeOpen( node_t *node, const char *target );
+
+static uint32_t nodeResume( node_t *node );
+
+static void fleetRun( node_t *nodes, uint8_t cnt );
+
+static void fleetReport( node_t *nodes, uint8_t cnt, _Bool first );
+
+static void fleetReboot( node_t *nodes, uint8_t cnt, const char *target );
+
+static void fleetSave( node_t *nodes, uint8_t cnt );
+
+static uint64_t imageHash( const uint8_t *img, uint32_t len );
+
+static _Bool jrnlLoad( const char *path );
+
+static void jrnlSave( const char *path );
+
+static jrnl_t *jrnlFind( uint64_t eui64 );
+
+static void fwuInit( fwu_t *fwu, kbi_dev_t *dev, const uint8_t *img,
+                     uint32_t imgLen, uint16_t blockSz, uint8_t window,
+                     uint32_t from );
+
+static void fwuFill( fwu_t *fwu, uint64_t now );
+
+static int8_t fwuFrame( fwu_t *fwu, uint64_t now );
+
+static _Bool fwuExpire( fwu_t *fwu, uint64_t now );
+
+static uint64_t fwuDeadline( fwu_t *fwu );
+
+static void fwuSend( fwu_t *fwu, uint32_t id, uint64_t now );
+
+static void fwuRtt( fwu_t *fwu, uint32_t sampleUs );
+
+static void fwuLine( fwu_t *fwu, uint64_t now );
 
 /****************************************************************************
 **                                                                         **
@@ -58,11 +204,18 @@ static int8_t send_block( uint8_t size );
 **                                                                         **
 ****************************************************************************/
 
-struct __attribute__( ( __packed__ ) )
-{
-  uint16_t id;
-  uint8_t  block[ BLOCK_SIZE ];
-} pld;
+/* Shared by all the transfers */
+static const uint8_t *img;
+static uint32_t       imgLen;
+static uint16_t       blockSz = BLOCK_SIZE;
+static uint8_t        window  = WINDOW_DEFAULT;
+static uint64_t       imgHash;
+static uint32_t       linkBaud; /* During the transfer, 0 to keep it */
+
+/* Progress of interrupted transfers, when resuming them */
+static const char *jrnlPath;
+static jrnl_t      jrnl[ JOURNAL_MAX ];
+static uint16_t    jrnlCnt;
 
 /****************************************************************************
 **                                                                         **
@@ -70,96 +223,142 @@ struct __attribute__( ( __packed__ ) )
 **                                                                         **
 ****************************************************************************/
 
-int8_t main( uint8_t argc, char *argv[] )
+int main( int argc, char *argv[] )
 {
-  uint8_t  cond;
-  FILE *   fptr;
-  uint32_t fsz;
-  uint32_t pos = 0;
-  uint8_t  block[ BLOCK_SIZE ];
-  uint8_t  blockSz;
-  time_t   end;
-
-  /* Hide the cursor */
-  printf( "\e[?25l" );
+  static const struct option opts[] = {
+    { "port", required_argument, NULL, 'p' },
+    { "file", required_argument, NULL, 'f' },
+    { "window", required_argument, NULL, 'w' },
+    { "block", required_argument, NULL, 'b' },
+    { "target", required_argument, NULL, 't' },
+    { "resume", required_argument, NULL, 'r' },
+    { "baud", required_argument, NULL, 'l' },
+    { NULL, 0, NULL, 0 } };
+  static node_t nodes[ NODES_MAX ];
+  char *        file   = NULL;
+  char          target[ 32 ] = "";
+  glob_t        ports;
+  uint8_t       cnt;
+  uint8_t       failed = 0;
+  uint8_t       i;
+  long          val;
+  int           opt;
 
-  /* Check input parameters */
-  cond = argc != 5;
-  cond |= strcmp( argv[ 1 ], "--port" ) != 0;
-  cond |= strcmp( argv[ 3 ], "--file" ) != 0;
-  if ( cond )
+  /* Check input parameters, ports are globbed, kept as given if no match */
+  memset( &ports, 0, sizeof( ports ) );
+  while ( ( opt = getopt_long( argc, argv, "", opts, NULL ) ) != -1 )
   {
-    usage();
-    progExit( EXIT_FAILURE, "" );
+    switch ( opt )
+    {
+    case 'p':
+      glob( optarg, GLOB_NOCHECK | ( ports.gl_pathc ? GLOB_APPEND : 0 ), NULL,
+            &ports );
+      break;
+    case 'f':
+      file = optarg;
+      break;
+    case 'w':
+      val = strtol( optarg, NULL, 0 );
+      if ( ( val < 1 ) || ( val > WINDOW_MAX ) )
+        usage();
+      window = val;
+      break;
+    case 'b':
+      val = strtol( optarg, NULL, 0 );
+      if ( ( val < BLOCK_SIZE ) || ( val > BLOCK_SIZE_MAX ) )
+        usage();
+      blockSz = val;
+      break;
+    case 't':
+      snprintf( target, sizeof( target ), "%s", optarg );
+      break;
+    case 'r':
+      jrnlPath = optarg;
+      break;
+    case 'l':
+      if ( !( linkBaud = strtoul( optarg, NULL, 0 ) ) )
+        usage();
+      break;
+    default:
+      usage();
+    }
   }
+  if ( !ports.gl_pathc || !file || ( optind != argc ) )
+    usage();
+  if ( ports.gl_pathc > NODES_MAX )
+    progExit( EXIT_FAILURE, "Too many ports." );
+  cnt = ports.gl_pathc;
 
-  /* Open device */
-  if ( !kbi_init( argv[ 2 ] ) )
-    progExit( EXIT_FAILURE, "Unable to init module." );
-  else
-    printf( "\nModule in port %s initialized correctly.\n", argv[ 2 ] );
-
-  /* Detect KBI version */
-  if ( kbi_cmd( CMDS_FCCMD_READ, CMDS_CMD_SOFTWARE_VERSION, NULL, 0 ) )
-    printf( "\nInitial device version:\n%s\n", cmds_rx_buf.frame_s.pld );
-  else
-    progExit( EXIT_FAILURE, "Unable to get device's version." );
-
-  /* Open DFU file */
-  if ( !( fptr = fopen( argv[ 4 ], "r" ) ) )
+  /* Map the DFU file once, blocks in flight are resent from memory */
+  if ( !( img = mapImage( file, &imgLen ) ) )
     progExit( EXIT_FAILURE, "Unable to open DFU file." );
+  if ( !target[ 0 ] )
+    targetVersion( file, target, sizeof( target ) );
+  if ( jrnlPath && !jrnlLoad( jrnlPath ) )
+    progExit( EXIT_FAILURE, "Unable to read the journal file." );
+  imgHash = imageHash( img, imgLen );
 
-  /* Make sure the Thread interface is down (for faster upgrade) */
-  if ( !kbi_cmd( CMDS_FCCMD_WRITE, CMDS_CMD_CLEAR, NULL, 0 ) )
-    progExit( EXIT_FAILURE, "Unable to clear the device status." );
-
-  /* Find the file's size */
-  fseek( fptr, 0L, SEEK_END );
-  fsz = ftell( fptr ) - DFU_SUFFIX_SIZE;
-  fseek( fptr, 0L, SEEK_SET );
+  /* Hide the cursor */
+  printf( "\e[?25l" );
 
-  /* Send blocks */
-  printf( "\nFlashing %u bytes...     ", fsz );
-  while ( fsz - pos > 0 )
+  /* Open the devices, skipping the ones already running the target */
+  printf( "\nInitial device versions:\n" );
+  for ( i = 0; i < cnt; i++ )
   {
-    /* Show progress */
-    printf( "\b\b\b\b%2u %%", 100 * pos / fsz );
-    fflush( stdout );
-
-    /* Set current block size */
-    if ( ( fsz - pos ) >= BLOCK_SIZE )
-      blockSz = BLOCK_SIZE;
-    else
-      blockSz = ( fsz - pos ) % BLOCK_SIZE;
-
-    /* Read from file and send to KiNOS */
-    fread( pld.block, 1, blockSz, fptr );
-    pos += blockSz;
-    if ( !send_block( blockSz ) )
-      progExit( EXIT_FAILURE, "\nFWU error." );
+    nodes[ i ].port = ports.gl_pathv[ i ];
+    nodeOpen( &nodes[ i ], target );
   }
-  printf( "\b\b\b\bDone.\n" );
 
-  /* Reset device to apply new firmware */
-  if ( !kbi_cmd( CMDS_FCCMD_WRITE, CMDS_CMD_RESET, NULL, 0 ) )
-    progExit( EXIT_FAILURE, "Unable to reset the device." );
-  sleep( 1 );
+  /* Send blocks to all the devices at once */
+  printf( "\nFlashing %u bytes, up to %u blocks of %u bytes in flight...\n",
+          imgLen, window, blockSz );
+  fleetRun( nodes, cnt );
 
-  /* Wait until the device boots up */
-  printf( "Waiting for new firmware...\n" );
-  end = time( NULL ) + 15;
-  while ( time( NULL ) < end )
+  /* Drop back to the initial baud rate */
+  for ( i = 0; i < cnt; i++ )
   {
-    if ( kbi_cmd( CMDS_FCCMD_READ, CMDS_CMD_SOFTWARE_VERSION, NULL, 0 ) )
+    if ( nodes[ i ].initBaud &&
+         ( nodes[ i ].dev.baud != nodes[ i ].initBaud ) &&
+         !kbi_setBaud( &nodes[ i ].dev, nodes[ i ].initBaud ) &&
+         ( nodes[ i ].state == NODE_FLASHED ) )
     {
-      printf( "\nFinal device version:\n%s\n", cmds_rx_buf.frame_s.pld );
-      break;
+      nodes[ i ].state = NODE_FAILED;
+      nodes[ i ].error = "Unable to restore the baud rate.";
     }
   }
 
+  /* Reset devices to apply new firmware, and wait until they boot up */
+  printf( "\nWaiting for new firmware...\n" );
+  fleetReboot( nodes, cnt, target );
+
+  /* Summary */
+  printf( "\n%-24s %-8s %9s %7s %9s %7s  %s\n", "PORT", "RESULT", "BYTES",
+          "SECS", "KIB/S", "RESENT", "FINAL VERSION" );
+  for ( i = 0; i < cnt; i++ )
+  {
+    fwu_t *  fwu  = &nodes[ i ].fwu;
+    double   secs = ( fwu->endUs - fwu->startUs ) / 1e6;
+    uint32_t done = fwu->base * fwu->blockSz;
+    uint32_t sent = ( fwu->base - fwu->from ) * fwu->blockSz;
+
+    if ( done > imgLen )
+      done = imgLen;
+    if ( sent > done )
+      sent = done;
+    printf( "%-24s %-8s %9u %7.1f %9.1f %7u  %s\n", nodes[ i ].port,
+            ( nodes[ i ].state == NODE_UPDATED )   ? "updated"
+            : ( nodes[ i ].state == NODE_SKIPPED ) ? "skipped"
+                                                   : "FAILED",
+            done, secs, ( secs > 0 ) ? sent / secs / 1024 : 0, fwu->resent,
+            nodes[ i ].error ? nodes[ i ].error : nodes[ i ].version );
+    failed |= ( nodes[ i ].state == NODE_FAILED );
+    kbi_finish( &nodes[ i ].dev );
+  }
+
   /* End program */
-  kbi_finish();
-  progExit( EXIT_SUCCESS, "\nDone." );
+  munmap( ( void * ) img, imgLen + DFU_SUFFIX_SIZE );
+  globfree( &ports );
+  progExit( failed ? EXIT_FAILURE : EXIT_SUCCESS, "\nDone." );
 }
 
 /****************************************************************************
@@ -180,57 +379,739 @@ static void progExit( uint8_t code, char *text )
 static void usage( void )
 {
   printf( "Usage:\n" );
-  printf( "fwupdate --port PORT --file DFU_FILE\n" );
+  printf( "fwupdate --port PORT [--port PORT...] --file DFU_FILE "
+          "[--window BLOCKS] [--block BYTES] [--target VERSION] "
+          "[--resume JOURNAL] [--baud RATE]\n" );
+  printf( "  --port    Device to update, a glob such as '/dev/ttyACM*' adds "
+          "all the matching ones\n" );
+  printf( "  --window  Blocks in flight, 1 to %u (default %u)\n", WINDOW_MAX,
+          WINDOW_DEFAULT );
+  printf( "  --block   Largest block size to try, %u to %u (default %u)\n",
+          BLOCK_SIZE, BLOCK_SIZE_MAX, BLOCK_SIZE );
+  printf( "  --target  Version in the DFU file, devices running it are "
+          "skipped\n            (default taken from the file name)\n" );
+  printf( "  --resume  Journal file keeping the progress of every device, "
+          "interrupted\n            transfers go on from the last block "
+          "acknowledged\n" );
+  printf( "  --baud    Link rate during the transfer, if the device can "
+          "switch to it\n" );
   progExit( EXIT_FAILURE, "" );
 }
 
 /***************************************************************************/
 /***************************************************************************/
-static int8_t send_block( uint8_t size )
+/**
+ * @brief Map the firmware image of a DFU file read only, without its suffix,
+ *        to be shared by all the transfers.
+ *
+ * @param[out]     len:   Length of the image.
+ *
+ * @return         Image, NULL on error.
+ */
+static const uint8_t *mapImage( const char *path, uint32_t *len )
 {
-  static uint16_t id = 0;
-  uint16_t *      rspId;
-  uint8_t         retry;
-  uint8_t         fc;
-  time_t          end;
+  struct stat st;
+  void *      map = MAP_FAILED;
+  int         fd;
+
+  if ( ( fd = open( path, O_RDONLY ) ) == -1 )
+    return NULL;
+  if ( !fstat( fd, &st ) && ( st.st_size > DFU_SUFFIX_SIZE ) )
+    map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd );
+  if ( map == MAP_FAILED )
+    return NULL;
+
+  /* Blocks are read in order */
+  madvise( map, st.st_size, MADV_SEQUENTIAL );
+  *len = st.st_size - DFU_SUFFIX_SIZE;
+  return map;
+}
 
-  for ( retry = 0; retry < BLOCK_RETRIES; retry++ )
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Take the firmware version from an official DFU file name, such as
+ *        KiNOS-GEN-KTWM102-1.3.7402.73020.dfu.
+ *
+ * @param[out]     ver:   Version, empty if the name has none.
+ */
+static void targetVersion( const char *path, char *ver, size_t size )
+{
+  char  name[ 256 ];
+  char *base;
+  char *dot;
+
+  snprintf( name, sizeof( name ), "%s", path );
+  base = basename( name );
+  if ( ( dot = strrchr( base, '.' ) ) && !strcmp( dot, ".dfu" ) )
+    *dot = '\0';
+  if ( ( base = strrchr( base, '-' ) ) && strchr( base, '.' ) )
+    snprintf( ver, size, "%s", base + 1 );
+  else
+    ver[ 0 ] = '\0';
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Read the software version of a device into its node.
+ *
+ * @return         0: No response.
+ *                 1: Version read.
+ */
+static _Bool readVersion( node_t *node )
+{
+  cmds_buffer_t *rx = &node->dev.cmds.rxBuf;
+
+  if ( !kbi_cmd( &node->dev, CMDS_FCCMD_READ, CMDS_CMD_SOFTWARE_VERSION, NULL,
+                 0 ) )
+    return 0;
+  snprintf( node->version, sizeof( node->version ), "%.*s",
+            ( int ) be16toh( rx->frame_s.len ), rx->frame_s.pld );
+  return 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Open a device and get it ready for the transfer, unless it already
+ *        runs the target version.
+ */
+static void nodeOpen( node_t *node, const char *target )
+{
+  uint32_t from;
+
+  node->state = NODE_FAILED;
+  if ( !kbi_init( &node->dev, ( char * ) node->port ) )
   {
-    /* Send block */
-    pld.id = htobe16( id );
-    cmds_send( CMDS_FTCMD | CMDS_FCCMD_WRITE, CMDS_CMD_FIRMWARE_UPDATE,
-               ( uint8_t * ) &pld, size + 2 );
+    node->error = "Unable to init module.";
+    return;
+  }
+
+  /* Detect KBI version */
+  if ( !readVersion( node ) )
+  {
+    node->error = "Unable to get device's version.";
+    return;
+  }
+  printf( "%-24s %s\n", node->port, node->version );
+  if ( target[ 0 ] && strstr( node->version, target ) )
+  {
+    node->state = NODE_SKIPPED;
+    return;
+  }
 
-    /* Wait up to BLOCK_TIMEOUT for a block response */
-    end = time( NULL ) + BLOCK_TIMEOUT;
-    while ( time( NULL ) < end )
+  /* Go on with an interrupted transfer, the device was cleared for it */
+  if ( jrnlPath && ( from = nodeResume( node ) ) )
+  {
+    fwuInit( &node->fwu, &node->dev, img, imgLen, node->jrnl->blockSz,
+             window, from );
+    printf( "%-24s resuming at byte %u\n", node->port,
+            from * node->jrnl->blockSz );
+  }
+  else
+  {
+    /* Make sure the Thread interface is down (for faster upgrade) */
+    if ( !kbi_cmd( &node->dev, CMDS_FCCMD_WRITE, CMDS_CMD_CLEAR, NULL, 0 ) )
     {
-      if ( cmds_recv( NULL ) > 0 )
+      node->error = "Unable to clear the device status.";
+      return;
+    }
+    fwuInit( &node->fwu, &node->dev, img, imgLen, blockSz, window, 0 );
+  }
+  node->state = NODE_FLASHING;
+
+  /* Faster link for the transfer, checked before any block is sent */
+  node->initBaud = node->dev.baud;
+  if ( linkBaud && !kbi_setBaud( &node->dev, linkBaud ) )
+    printf( "%-24s staying at %u baud\n", node->port, node->dev.baud );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Find the journal entry of a device, by its EUI-64, and tell whether
+ *        its transfer can go on. The device keeps the blocks received until
+ *        it boots again, which its uptime tells.
+ *
+ * @return         First block to send, 0 to start over.
+ */
+static uint32_t nodeResume( node_t *node )
+{
+  cmds_buffer_t *rx = &node->dev.cmds.rxBuf;
+  jrnl_t *       entry;
+  uint64_t       eui64;
+  uint32_t       uptime;
+  int64_t        boot;
+  uint32_t       from = 0;
+
+  if ( !kbi_cmd( &node->dev, CMDS_FCCMD_READ, CMDS_CMD_EUI_64_ADDRESS, NULL,
+                 0 ) ||
+       ( be16toh( rx->frame_s.len ) != 8 ) )
+    return 0;
+  memcpy( &eui64, rx->frame_s.pld, 8 );
+  if ( !kbi_cmd( &node->dev, CMDS_FCCMD_READ, CMDS_CMD_UPTIME, NULL, 0 ) ||
+       ( be16toh( rx->frame_s.len ) != 4 ) )
+    return 0;
+  memcpy( &uptime, rx->frame_s.pld, 4 );
+  boot = time( NULL ) - be32toh( uptime );
+
+  if ( !( entry = jrnlFind( be64toh( eui64 ) ) ) )
+    return 0;
+  if ( ( entry->hash == imgHash ) && ( entry->base > 0 ) &&
+       ( entry->boot >= boot - BOOT_SLACK ) &&
+       ( entry->boot <= boot + BOOT_SLACK ) &&
+       ( entry->base < ( imgLen + entry->blockSz - 1 ) / entry->blockSz ) )
+    from = entry->base;
+
+  node->jrnl  = entry;
+  entry->hash = imgHash;
+  entry->boot = boot;
+  entry->base = from;
+  return from;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Send the image to all the devices flashing from a single event loop,
+ *        waiting for any of them up to the first retransmission due.
+ */
+static void fleetRun( node_t *nodes, uint8_t cnt )
+{
+  struct pollfd pfds[ NODES_MAX ];
+  node_t *      node;
+  uint64_t      now      = uart_nowUs();
+  uint64_t      reportUs = now + PROGRESS_US;
+  uint64_t      deadline;
+  uint8_t       active;
+  uint8_t       i;
+  int16_t       result;
+
+  for ( i = 0; i < cnt; i++ )
+    nodes[ i ].fwu.startUs = nodes[ i ].fwu.endUs = now;
+  fleetReport( nodes, cnt, 1 );
+
+  for ( ;; )
+  {
+    /* Fill the windows and find the first retransmission due */
+    deadline = reportUs;
+    for ( i = 0, active = 0; i < cnt; i++ )
+    {
+      node = &nodes[ i ];
+      if ( node->state != NODE_FLASHING )
+        continue;
+      fwuFill( &node->fwu, now );
+      if ( fwuDeadline( &node->fwu ) < deadline )
+        deadline = fwuDeadline( &node->fwu );
+      pfds[ active ].fd       = kbi_fd( &node->dev );
+      pfds[ active++ ].events = POLLIN;
+    }
+    if ( !active )
+      break;
+
+    poll( pfds, active,
+          ( deadline > now ) ? ( deadline - now + 999 ) / 1000 : 0 );
+
+    /* Handle whatever every device sent, then its retransmissions */
+    now = uart_nowUs();
+    for ( i = 0; i < cnt; i++ )
+    {
+      node = &nodes[ i ];
+      if ( node->state != NODE_FLASHING )
+        continue;
+      while ( ( result = cmds_recvNow( &node->dev.cmds, NULL ) ) !=
+              COBS_RESULT_TIMEOUT )
       {
-        fc = ( cmds_rx_buf.frame_s.typ & 0x0F );
-        /* Response with value received */
-        if ( fc == CMDS_FCRSP_VALUE )
+        if ( ( result <= 0 ) || ( fwuFrame( &node->fwu, now ) >= 0 ) )
+          continue;
+
+        /* The device may not take a resumed transfer, start it over from a
+           cleared status as nodeOpen() does */
+        if ( node->fwu.from )
         {
-          /* All good if received ID matches the sent one */
-          rspId = ( uint16_t * ) cmds_rx_buf.frame_s.pld;
-          if ( be16toh( *rspId ) == id )
+          if ( !kbi_cmd( &node->dev, CMDS_FCCMD_WRITE, CMDS_CMD_CLEAR, NULL,
+                         0 ) )
           {
-            id++;
-            return 1;
+            node->state = NODE_FAILED;
+            node->error = "Unable to clear the device status.";
+            break;
           }
+          now = uart_nowUs();
+          fwuInit( &node->fwu, &node->dev, img, imgLen, blockSz, window, 0 );
+          node->fwu.startUs = now;
+          continue;
         }
-        /* FW update error received, don't continue */
-        else if ( fc == CMDS_FCRSP_FWUERR )
-        {
-          return 0;
-        }
+        node->state = NODE_FAILED;
+        node->error = "FWU error.";
+        break;
+      }
+      if ( node->state != NODE_FLASHING )
+        ;
+      else if ( !fwuExpire( &node->fwu, now ) )
+      {
+        node->state = NODE_FAILED;
+        node->error = "FWU error, block out of retries.";
       }
+      else if ( node->fwu.base == node->fwu.blocks )
+        node->state = NODE_FLASHED;
+      if ( node->state != NODE_FLASHING )
+        node->fwu.endUs = now;
+    }
+
+    if ( now >= reportUs )
+    {
+      fleetReport( nodes, cnt, 0 );
+      fleetSave( nodes, cnt );
+      reportUs = now + PROGRESS_US;
+    }
+  }
+  fleetReport( nodes, cnt, 0 );
+  fleetSave( nodes, cnt );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Show a progress line per device, rewritten in place.
+ *
+ * @param[in]      first:  1 to print the lines the first time.
+ */
+static void fleetReport( node_t *nodes, uint8_t cnt, _Bool first )
+{
+  uint64_t now = uart_nowUs();
+  uint8_t  i;
+
+  if ( !first )
+    printf( "\e[%uA", cnt );
+  for ( i = 0; i < cnt; i++ )
+  {
+    printf( "\r%-24s ", nodes[ i ].port );
+    switch ( nodes[ i ].state )
+    {
+    case NODE_SKIPPED:
+      printf( "already up to date" );
+      break;
+    case NODE_FLASHING:
+      fwuLine( &nodes[ i ].fwu, now );
+      break;
+    case NODE_FLASHED:
+      fwuLine( &nodes[ i ].fwu, nodes[ i ].fwu.endUs );
+      break;
+    default:
+      printf( "%s", nodes[ i ].error );
+      break;
     }
+    printf( "\e[K\n" );
+  }
+  fflush( stdout );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Reset the flashed devices and wait for them to boot up with the
+ *        target version, or any other than they had if it is not known.
+ */
+static void fleetReboot( node_t *nodes, uint8_t cnt, const char *target )
+{
+  char    prev[ sizeof( nodes->version ) ];
+  uint8_t i;
+
+  for ( i = 0; i < cnt; i++ )
+  {
+    if ( ( nodes[ i ].state == NODE_FLASHED ) &&
+         !kbi_cmd( &nodes[ i ].dev, CMDS_FCCMD_WRITE, CMDS_CMD_RESET, NULL,
+                   0 ) )
+    {
+      nodes[ i ].state = NODE_FAILED;
+      nodes[ i ].error = "Unable to reset the device.";
+    }
+  }
+  sleep( 1 );
+
+  /* All of them boot meanwhile, so the later ones answer right away */
+  for ( i = 0; i < cnt; i++ )
+  {
+    if ( nodes[ i ].state != NODE_FLASHED )
+      continue;
+    memcpy( prev, nodes[ i ].version, sizeof( prev ) );
+    nodes[ i ].state = NODE_FAILED;
+    if ( !kbi_waitFor( &nodes[ i ].dev, CMDS_CMD_SOFTWARE_VERSION, NULL, 0,
+                       BOOT_TOUT ) ||
+         !readVersion( &nodes[ i ] ) )
+      nodes[ i ].error = "No answer after reset.";
+    else if ( target[ 0 ] ? !strstr( nodes[ i ].version, target )
+                          : !strcmp( nodes[ i ].version, prev ) )
+      nodes[ i ].error = "Not running the new firmware after reset.";
+    else
+      nodes[ i ].state = NODE_UPDATED;
+  }
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Record the progress of the journaled devices, a finished transfer
+ *        leaves nothing to resume.
+ */
+static void fleetSave( node_t *nodes, uint8_t cnt )
+{
+  uint8_t i;
+
+  if ( !jrnlPath )
+    return;
+  for ( i = 0; i < cnt; i++ )
+  {
+    if ( !nodes[ i ].jrnl )
+      continue;
+    nodes[ i ].jrnl->blockSz = nodes[ i ].fwu.blockSz;
+    nodes[ i ].jrnl->base    = ( nodes[ i ].state == NODE_FLASHED )
+                                   ? 0
+                                   : nodes[ i ].fwu.base;
+  }
+  jrnlSave( jrnlPath );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Hash an image to tell it apart in the journal, 64 bit FNV-1a.
+ */
+static uint64_t imageHash( const uint8_t *img, uint32_t len )
+{
+  uint64_t hash = 0xCBF29CE484222325ull;
+
+  while ( len-- )
+    hash = ( hash ^ *img++ ) * 0x100000001B3ull;
+  return hash;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Read the journal, a line per device with its EUI-64, image hash,
+ *        boot time, block size and blocks acknowledged.
+ *
+ * @return         0: The journal can't be read.
+ *                 1: Journal read, or not created yet.
+ */
+static _Bool jrnlLoad( const char *path )
+{
+  char    line[ 128 ];
+  jrnl_t *entry;
+  FILE *  file;
+
+  if ( !( file = fopen( path, "r" ) ) )
+    return ( errno == ENOENT );
+  while ( ( jrnlCnt < JOURNAL_MAX ) && fgets( line, sizeof( line ), file ) )
+  {
+    entry = &jrnl[ jrnlCnt ];
+    if ( sscanf( line, "%" SCNx64 " %" SCNx64 " %" SCNd64 " %" SCNu16
+                       " %" SCNu32,
+                 &entry->eui64, &entry->hash, &entry->boot, &entry->blockSz,
+                 &entry->base ) == 5 &&
+         entry->blockSz )
+      jrnlCnt++;
+  }
+  fclose( file );
+  return 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Write the journal, replacing the previous one at once so that an
+ *        interruption meanwhile loses nothing.
+ */
+static void jrnlSave( const char *path )
+{
+  char     tmp[ PATH_MAX ];
+  FILE *   file;
+  uint16_t i;
+
+  snprintf( tmp, sizeof( tmp ), "%s.tmp", path );
+  if ( !( file = fopen( tmp, "w" ) ) )
+    return;
+  for ( i = 0; i < jrnlCnt; i++ )
+  {
+    if ( jrnl[ i ].base )
+      fprintf( file, "%016" PRIx64 " %016" PRIx64 " %" PRId64 " %u %u\n",
+               jrnl[ i ].eui64, jrnl[ i ].hash, jrnl[ i ].boot,
+               jrnl[ i ].blockSz, jrnl[ i ].base );
+  }
+  if ( ( fflush( file ) == 0 ) && ( fsync( fileno( file ) ) == 0 ) )
+  {
+    fclose( file );
+    rename( tmp, path );
+  }
+  else
+    fclose( file );
+}
 
-    /* Delay before next retry */
-    sleep( 5 );
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Get the journal entry of a device, adding it if missing.
+ *
+ * @return         Entry, NULL if the journal is full.
+ */
+static jrnl_t *jrnlFind( uint64_t eui64 )
+{
+  uint16_t i;
+
+  for ( i = 0; i < jrnlCnt; i++ )
+  {
+    if ( jrnl[ i ].eui64 == eui64 )
+      return &jrnl[ i ];
   }
-  return 0;
+  if ( jrnlCnt == JOURNAL_MAX )
+    return NULL;
+  memset( &jrnl[ jrnlCnt ], 0, sizeof( jrnl_t ) );
+  jrnl[ jrnlCnt ].eui64 = eui64;
+  return &jrnl[ jrnlCnt++ ];
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Prepare the transfer of an image, nothing is sent yet.
+ *
+ * @param[in]      from:  First block to send, the device already has the
+ *                        previous ones with the same block size.
+ */
+static void fwuInit( fwu_t *fwu, kbi_dev_t *dev, const uint8_t *img,
+                     uint32_t imgLen, uint16_t blockSz, uint8_t window,
+                     uint32_t from )
+{
+  memset( fwu, 0, sizeof( fwu_t ) );
+  fwu->dev     = dev;
+  fwu->img     = img;
+  fwu->imgLen  = imgLen;
+  fwu->blockSz = blockSz;
+  fwu->blocks  = ( imgLen + blockSz - 1 ) / blockSz;
+  fwu->sized   = ( from != 0 );
+  fwu->base    = from;
+  fwu->next    = from;
+  fwu->from    = from;
+  fwu->window  = window;
+  fwu->rtoUs   = RTO_INIT_US;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Send new blocks while the window allows, a single one until the
+ *        device acknowledges the first one, so that no block arrives before
+ *        the image is started.
+ */
+static void fwuFill( fwu_t *fwu, uint64_t now )
+{
+  uint32_t limit = fwu->base + ( fwu->sized ? fwu->window : 1 );
+
+  if ( limit > fwu->blocks )
+    limit = fwu->blocks;
+  while ( fwu->next < limit )
+  {
+    fwu->slots[ fwu->next % WINDOW_MAX ].tries = 0;
+    fwuSend( fwu, fwu->next++, now );
+  }
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Handle the frame in the receive buffer. Acknowledgements may come
+ *        in any order, or twice for a block sent again.
+ *
+ * @return        -1: Device error, the transfer can't go on.
+ *                 0: Frame ignored.
+ *                 1: Block acknowledged.
+ */
+static int8_t fwuFrame( fwu_t *fwu, uint64_t now )
+{
+  cmds_buffer_t *rx = &fwu->dev->cmds.rxBuf;
+  fwuSlot_t *    slot;
+  uint16_t       rspId;
+  uint32_t       id;
+
+  if ( rx->frame_s.typ == ( CMDS_FTRSP | CMDS_FCRSP_FWUERR ) )
+    return -1;
+
+  if ( ( rx->frame_s.cmd == CMDS_CMD_FIRMWARE_UPDATE ) &&
+       ( rx->frame_s.typ == ( CMDS_FTRSP | CMDS_FCRSP_BADPARAM ) ) )
+  {
+    /* Every try of the first block at a bigger size gets its own reject */
+    if ( fwu->stale )
+    {
+      fwu->stale--;
+      return 0;
+    }
+    if ( fwu->sized || ( fwu->blockSz <= BLOCK_SIZE ) )
+      return -1;
+
+    /* A rejected first block is sent again with half its size */
+    fwu->stale = fwu->slots[ 0 ].tries - 1;
+    if ( ( fwu->blockSz /= 2 ) < BLOCK_SIZE )
+      fwu->blockSz = BLOCK_SIZE;
+    fwu->blocks = ( fwu->imgLen + fwu->blockSz - 1 ) / fwu->blockSz;
+    fwu->next   = 0;
+    fwuFill( fwu, now );
+    return 0;
+  }
+
+  if ( ( rx->frame_s.typ != ( CMDS_FTRSP | CMDS_FCRSP_VALUE ) ) ||
+       ( rx->frame_s.cmd != CMDS_CMD_FIRMWARE_UPDATE ) ||
+       ( be16toh( rx->frame_s.len ) < 2 ) )
+    return 0;
+
+  /* Ids are 16 bits, find the block in flight they belong to */
+  memcpy( &rspId, rx->frame_s.pld, 2 );
+  id = fwu->base + ( uint16_t )( be16toh( rspId ) - fwu->base );
+  if ( id >= fwu->next )
+    return 0;
+  slot = &fwu->slots[ id % WINDOW_MAX ];
+  if ( !slot->tries )
+    return 0;
+
+  /* Only first tries tell the round trip time, see Karn's algorithm */
+  if ( slot->tries == 1 )
+    fwuRtt( fwu, now - slot->sentUs );
+  slot->tries = 0;
+  fwu->sized  = 1;
+
+  /* Slide the window over the acknowledged blocks */
+  while ( ( fwu->base < fwu->next ) &&
+          !fwu->slots[ fwu->base % WINDOW_MAX ].tries )
+    fwu->base++;
+  return 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Send again the blocks whose acknowledgement is overdue, backing the
+ *        retransmission timeout off.
+ *
+ * @return         0: A block ran out of tries.
+ *                 1: Transfer going on.
+ */
+static _Bool fwuExpire( fwu_t *fwu, uint64_t now )
+{
+  fwuSlot_t *slot;
+  _Bool      backoff = 0;
+  uint32_t   id;
+
+  for ( id = fwu->base; id < fwu->next; id++ )
+  {
+    slot = &fwu->slots[ id % WINDOW_MAX ];
+    if ( !slot->tries || ( slot->sentUs + fwu->rtoUs > now ) )
+      continue;
+    if ( slot->tries == BLOCK_RETRIES )
+      return 0;
+    fwuSend( fwu, id, now );
+    fwu->resent++;
+    backoff = 1;
+  }
+
+  if ( backoff && ( ( fwu->rtoUs *= 2 ) > RTO_MAX_US ) )
+    fwu->rtoUs = RTO_MAX_US;
+  return 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Get the time the oldest block in flight is to be sent again.
+ *
+ * @return        Monotonic time in microseconds.
+ */
+static uint64_t fwuDeadline( fwu_t *fwu )
+{
+  uint64_t deadline = UINT64_MAX;
+  uint32_t id;
+
+  for ( id = fwu->base; id < fwu->next; id++ )
+  {
+    if ( fwu->slots[ id % WINDOW_MAX ].tries &&
+         ( fwu->slots[ id % WINDOW_MAX ].sentUs < deadline ) )
+      deadline = fwu->slots[ id % WINDOW_MAX ].sentUs;
+  }
+  return ( deadline == UINT64_MAX ) ? 1 : deadline + fwu->rtoUs;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Send a try of a block, its payload gathered from the image.
+ */
+static void fwuSend( fwu_t *fwu, uint32_t id, uint64_t now )
+{
+  uint32_t     pos  = id * fwu->blockSz;
+  uint16_t     idBe = htobe16( id );
+  struct iovec iov[ 2 ];
+
+  iov[ 0 ].iov_base = &idBe;
+  iov[ 0 ].iov_len  = 2;
+  iov[ 1 ].iov_base = ( uint8_t * ) fwu->img + pos;
+  iov[ 1 ].iov_len  = ( fwu->imgLen - pos < fwu->blockSz ) ? fwu->imgLen - pos
+                                                          : fwu->blockSz;
+  cmds_sendv( &fwu->dev->cmds, CMDS_FTCMD | CMDS_FCCMD_WRITE,
+              CMDS_CMD_FIRMWARE_UPDATE, iov, 2 );
+  fwu->slots[ id % WINDOW_MAX ].sentUs = now;
+  fwu->slots[ id % WINDOW_MAX ].tries++;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Update the round trip time estimators with a sample and derive the
+ *        retransmission timeout from them, as in RFC 6298.
+ */
+static void fwuRtt( fwu_t *fwu, uint32_t sampleUs )
+{
+  uint32_t err;
+
+  if ( !fwu->srttUs )
+  {
+    fwu->srttUs   = sampleUs;
+    fwu->rttvarUs = sampleUs / 2;
+  }
+  else
+  {
+    err = ( fwu->srttUs > sampleUs ) ? fwu->srttUs - sampleUs
+                                     : sampleUs - fwu->srttUs;
+    fwu->rttvarUs = ( 3 * fwu->rttvarUs + err ) / 4;
+    fwu->srttUs   = ( 7 * fwu->srttUs + sampleUs ) / 8;
+  }
+
+  fwu->rtoUs = fwu->srttUs + 4 * fwu->rttvarUs;
+  if ( fwu->rtoUs < RTO_MIN_US )
+    fwu->rtoUs = RTO_MIN_US;
+  else if ( fwu->rtoUs > RTO_MAX_US )
+    fwu->rtoUs = RTO_MAX_US;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Print the progress, throughput and retransmissions of a transfer.
+ */
+static void fwuLine( fwu_t *fwu, uint64_t now )
+{
+  uint32_t done = fwu->base * fwu->blockSz;
+  uint32_t sent = ( fwu->base - fwu->from ) * fwu->blockSz;
+  double   secs = ( now - fwu->startUs ) / 1e6;
+
+  if ( done > fwu->imgLen )
+    done = fwu->imgLen;
+  if ( sent > done )
+    sent = done;
+  printf( "%3u %%  %7u/%u bytes  %6.1f KiB/s  rtt %4u ms  resent %u",
+          ( uint32_t )( 100ull * done / fwu->imgLen ), done, fwu->imgLen,
+          ( secs > 0 ) ? sent / secs / 1024 : 0, fwu->srttUs / 1000,
+          fwu->resent );
 }
 
 /****************************************************************************
@@ -249,17 +249,18 @@ typedef union cmds_buffer_t {
   uint8_t      frame_a[ CMDS_FRAME_HEADER_LEN + CMDS_FRAME_PAYLOAD_MAX_LEN ];
 } cmds_buffer_t;
 
-/* Notification callback function */
-typedef void ( *cmds_ntf_cb_t )( void );
-
-/****************************************************************************
-**                                                                         **
-**                           EXPORTED VARIABLES                            **
-**                                                                         **
-****************************************************************************/
+/* Command link to a device, one per port */
+typedef struct cmds_t
+{
+  uart_t        uart;
+  cobs_dec_t    cobs;
+  cmds_buffer_t txBuf;
+  cmds_buffer_t rxBuf;
+  uint16_t      txCnt; /* Frames sent, tells when txBuf was overwritten */
+} cmds_t;
 
-extern cmds_buffer_t cmds_tx_buf;
-extern cmds_buffer_t cmds_rx_buf;
+/* Notification callback function, the frame is in cmds->rxBuf */
+typedef void ( *cmds_ntf_cb_t )( cmds_t *cmds );
 
 /****************************************************************************
 **                                                                         **
@@ -270,17 +271,88 @@ extern cmds_buffer_t cmds_rx_buf;
 /**
  * @brief Build a KBI frame and send it encoded to UART.
  *
+ * @param[in]      cmds:  Command link.
  * @param[in]      typ:   Frame type field.
  * @param[in]      cmd:   Frame command field.
  * @param[in]      pld:   Pointer to an array to be used as frame payload.
  * @param[in]      pldLen:   Length of pld.
  *
  */
-void cmds_send( uint8_t typ, uint8_t cmd, uint8_t *pld, uint16_t pldLen );
+void cmds_send( cmds_t *cmds, uint8_t typ, uint8_t cmd, uint8_t *pld,
+                uint16_t pldLen );
+
+/**
+ * @brief Build a KBI frame from several payload segments, copied in order, and
+ * send it encoded to UART. Segments beyond CMDS_FRAME_PAYLOAD_MAX_LEN are
+ * truncated.
+ *
+ * @param[in]      cmds:    Command link.
+ * @param[in]      typ:     Frame type field.
+ * @param[in]      cmd:     Frame command field.
+ * @param[in]      iov:     Payload segments.
+ * @param[in]      iovCnt:  Number of segments in iov.
+ *
+ */
+void cmds_sendv( cmds_t *cmds, uint8_t typ, uint8_t cmd,
+                 const struct iovec *iov, uint8_t iovCnt );
+
+/**
+ * @brief Gather several payload segments, copied in order, into the payload
+ * area of the transmission frame to be sent with cmds_commitXor(). Segments
+ * beyond CMDS_FRAME_PAYLOAD_MAX_LEN are truncated.
+ *
+ * @param[in]      cmds:    Command link.
+ * @param[in]      iov:     Payload segments.
+ * @param[in]      iovCnt:  Number of segments in iov.
+ * @param[out]     pldCks:  XOR of the payload bytes.
+ *
+ * @return         Length of the payload gathered.
+ */
+uint16_t cmds_gather( cmds_t *cmds, const struct iovec *iov, uint8_t iovCnt,
+                      uint8_t *pldCks );
+
+/**
+ * @brief Get the payload area of the transmission frame, so a payload can be
+ * written in place and sent with cmds_commit() without being copied.
+ *
+ * @param[in]      cmds:  Command link.
+ *
+ * @return         Pointer to CMDS_FRAME_PAYLOAD_MAX_LEN bytes.
+ */
+uint8_t *cmds_reserve( cmds_t *cmds );
+
+/**
+ * @brief Send encoded to UART the KBI frame whose payload was written in the
+ * area got with cmds_reserve(). The payload stays there until another frame
+ * is sent, so it can be committed again to retry.
+ *
+ * @param[in]      cmds:    Command link.
+ * @param[in]      typ:     Frame type field.
+ * @param[in]      cmd:     Frame command field.
+ * @param[in]      pldLen:  Length of the payload written.
+ *
+ */
+void cmds_commit( cmds_t *cmds, uint8_t typ, uint8_t cmd, uint16_t pldLen );
+
+/**
+ * @brief Same as cmds_commit() with the XOR of the payload already known,
+ * such as when parts of it are prebuilt or it was XORed while written.
+ *
+ * @param[in]      cmds:    Command link.
+ * @param[in]      typ:     Frame type field.
+ * @param[in]      cmd:     Frame command field.
+ * @param[in]      pldLen:  Length of the payload written.
+ * @param[in]      pldCks:  XOR of the payload bytes.
+ *
+ */
+void cmds_commitXor( cmds_t *cmds, uint8_t typ, uint8_t cmd, uint16_t pldLen,
+                     uint8_t pldCks );
 
 /**
  * @brief Receive a KBI frame from the UART decoder function and verify it.
+ * The whole frame must arrive within the UART default timeout.
  *
+ * @param[in]      cmds:    Command link, the frame is left in cmds->rxBuf.
  * @param[in]      ntfCb:   Callback to be used when a KBI notification is
  *                          received.
  *
@@ -288,7 +360,56 @@ void cmds_send( uint8_t typ, uint8_t cmd, uint8_t *pld, uint16_t pldLen );
  *                 -2: Port timeout.
  *                 >0: Length of the received frame.
  */
-int16_t cmds_recv( cmds_ntf_cb_t ntfCb );
+int16_t cmds_recv( cmds_t *cmds, cmds_ntf_cb_t ntfCb );
+
+/**
+ * @brief Receive a KBI frame from the UART decoder function and verify it.
+ * The whole frame must arrive before an absolute deadline.
+ *
+ * @param[in]      cmds:       Command link, the frame is left in cmds->rxBuf.
+ * @param[in]      ntfCb:      Callback to be used when a KBI notification is
+ *                             received.
+ * @param[in]      deadlineUs: Monotonic time in microseconds, see
+ *                             uart_nowUs().
+ *
+ * @return         -1: Decode error/Other error.
+ *                 -2: Deadline expired.
+ *                 >0: Length of the received frame.
+ */
+int16_t cmds_recvUntil( cmds_t *cmds, cmds_ntf_cb_t ntfCb,
+                        uint64_t deadlineUs );
+
+/**
+ * @brief Receive a KBI frame of any type into a given buffer and verify it.
+ * The whole frame must arrive before an absolute deadline. The buffer may only
+ * change once a frame is received or dropped.
+ *
+ * @param[in]      cmds:       Command link.
+ * @param[out]     buf:        Buffer for the received frame.
+ * @param[in]      deadlineUs: Monotonic time in microseconds, see
+ *                             uart_nowUs().
+ *
+ * @return         -1: Decode error/Other error.
+ *                 -2: Deadline expired.
+ *                 >0: Length of the received frame.
+ */
+int16_t cmds_recvFrame( cmds_t *cmds, cmds_buffer_t *buf,
+                        uint64_t deadlineUs );
+
+/**
+ * @brief Receive a KBI frame from the data already available in the UART,
+ * without waiting. A frame received partially is kept in the decoder to be
+ * completed by the next calls.
+ *
+ * @param[in]      cmds:    Command link, the frame is left in cmds->rxBuf.
+ * @param[in]      ntfCb:   Callback to be used when a KBI notification is
+ *                          received.
+ *
+ * @return         -1: Decode error/Other error.
+ *                 -2: No whole frame available.
+ *                 >0: Length of the received frame.
+ */
+int16_t cmds_recvNow( cmds_t *cmds, cmds_ntf_cb_t ntfCb );
 
 #endif /* !__INCLUDE_CMDS_H */
 
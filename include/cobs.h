@@ -16,7 +16,8 @@
 **                                                                         **
 ****************************************************************************/
 
-#define COBS_SIZE_CODES_ARRAY 10
+/* Longest block of data bytes not followed by a zero (code 0xD0) */
+#define COBS_MAX_BLOCK 207
 
 #define COBS_RESULT_NONE 0
 #define COBS_RESULT_ERROR -1
@@ -28,11 +29,27 @@
 **                                                                         **
 ****************************************************************************/
 
-/* Encoded byte output function. */
-typedef void ( *cobs_byteOut_t )( uint8_t );
+/* Encoded byte output function, ctx is passed through from cobs_encode(). */
+typedef void ( *cobs_byteOut_t )( void *ctx, uint8_t );
 
-/* Encoded byte input function. */
-typedef uint8_t ( *cobs_byteIn_t )( uint8_t * );
+/* Encoded byte input function, ctx is passed through from cobs_decode(). */
+typedef uint8_t ( *cobs_byteIn_t )( void *ctx, uint8_t * );
+
+/* Decoder state, one per input stream. Zeroed before the first use. */
+typedef struct cobs_dec_t
+{
+  uint32_t totBytes;  /* Total number of bytes to receive. */
+  uint32_t proBytes;  /* Number of bytes received. */
+  uint32_t encBytes;  /* Number of encoded bytes of the current frame. */
+  uint32_t dropped;   /* Bytes discarded so far, free running. */
+  uint8_t  startMsg;  /* Inside a frame, else waiting for a delimiter. */
+  uint8_t  endMsg;    /* Frame decoded, what's left up to the delimiter is
+                         its last code. */
+  uint8_t  payload;   /* Length header received. */
+  uint8_t  dataBytes; /* Data bytes left in the current COBS block. */
+  uint8_t  zeroes;    /* Zeroes ending the current COBS block. */
+  uint8_t  xor;       /* XOR of the decoded bytes of the current frame. */
+} cobs_dec_t;
 
 /****************************************************************************
 **                                                                         **
@@ -46,24 +63,101 @@ typedef uint8_t ( *cobs_byteIn_t )( uint8_t * );
  * @param[in]      buff:   Pointer to the message to encode.
  * @param[in]      len:    Length of the message to encode.
  * @param[out]     output: Pointer to encoded byte output callback (UART tx)
+ * @param[in]      ctx:    Context passed to the output callback.
  *
  * @return         Length of the encoded message.
  */
-int16_t cobs_encode( uint8_t *buff, uint16_t len, cobs_byteOut_t output );
+int16_t cobs_encode( uint8_t *buff, uint16_t len, cobs_byteOut_t output,
+                     void *ctx );
+
+/**
+ * @brief Encode a message into a buffer in a single pass, start delimiter
+ * included.
+ *
+ * @param[in]      in:     Pointer to the message to encode.
+ * @param[in]      len:    Length of the message to encode.
+ * @param[out]     out:    Pointer to the encoded message.
+ * @param[in]      outCap: Size of out, at least cobs_encodeMax( len ).
+ *
+ * @return         -1: Not enough room in out.
+ *                 >0: Length of the encoded message.
+ */
+int32_t cobs_encodeBuf( const uint8_t *in, uint16_t len, uint8_t *out,
+                        uint32_t outCap );
+
+/**
+ * @brief Worst case length of an encoded message, start delimiter included.
+ *
+ * @param[in]      len:    Length of the message to encode.
+ *
+ * @return         Maximum length of the encoded message.
+ */
+uint32_t cobs_encodeMax( uint16_t len );
+
+/**
+ * @brief Copy bytes and XOR them together in the same pass, a machine word or
+ * a SIMD register at a time.
+ *
+ * @param[out]     dst:    Pointer to the copy, NULL to only XOR.
+ * @param[in]      src:    Pointer to the bytes.
+ * @param[in]      len:    Number of bytes.
+ *
+ * @return         XOR of all the bytes.
+ */
+uint8_t cobs_copyXor( uint8_t *dst, const uint8_t *src, uint32_t len );
+
+/**
+ * @brief Use the SIMD zero scanner and XOR the CPU supports, as done by
+ * default, or the portable ones instead, e.g: to check they give the same
+ * results. Not to be called while other threads use the codec.
+ *
+ * @param[in]      enable: 1 for the SIMD ones, 0 for the portable ones.
+ */
+void cobs_setSimd( _Bool enable );
+
+/**
+ * @brief Decode a span of received bytes, as many as available. Decoding stops
+ * right after the end of a frame or an error, so the rest of the span must be
+ * fed again to get the next frames.
+ *
+ * A frame is dropped as soon as an invalid code is found or its length header
+ * exceeds len. The following bytes are skipped up to the next delimiter, and
+ * all of them are accounted in dec->dropped.
+ *
+ * The XOR of the decoded bytes is accumulated while they are copied, and left
+ * in dec->xor once the frame is complete.
+ *
+ * @param[in,out]  dec:    Decoder state.
+ * @param[out]     buff:   Pointer to the decoded message, may change between
+ *                         frames.
+ * @param[in]      len:    Length limit of buff.
+ * @param[in]      in:     Pointer to the received bytes.
+ * @param[in]      inLen:  Number of received bytes.
+ * @param[out]     used:   Number of bytes processed from in.
+ *
+ * @return          0: Span processed, decode not finished.
+ *                 -1: Decode error, the frame is dropped.
+ *                 >0: Length of the decoded message.
+ */
+int16_t cobs_decFeed( cobs_dec_t *dec, uint8_t *buff, uint16_t len,
+                      const uint8_t *in, uint16_t inLen, uint16_t *used );
 
 /**
  * @brief Decode a UART message byte per byte.
  *
+ * @param[in,out]  dec:   Decoder state.
  * @param[out]     buff:  Pointer to the decoded message.
  * @param[in]      len:   Length limit of buff.
  * @param[in]      input: Pointer to encoded byte input callback (UART rx).
+ * @param[in]      ctx:   Context passed to the input callback.
  *
  * @return          0: Decode not finished.
  *                 -1: Decode error.
  *                 -2: Port timeout.
  *                 >0: Length of the decoded message.
  */
-int16_t cobs_decode( uint8_t *buff, uint16_t len, cobs_byteIn_t input );
+int16_t cobs_decode( cobs_dec_t *dec, uint8_t *buff, uint16_t len,
+                     cobs_byteIn_t input, void *ctx );
 
 #endif /* !__INCLUDE_COBS_H */
 
@@ -18,7 +18,10 @@
 #include <arpa/inet.h>
 #include <endian.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
@@ -30,8 +33,80 @@
 ****************************************************************************/
 
 #define KBI_PORT_TOUT_MS 1000
+
+/* UART baud rate, 0 to probe the device's one among KBI_PROBE_RATES */
+#ifndef KBI_UART_BAUD
+#define KBI_UART_BAUD UART_BAUD_DEFAULT
+#endif
+
+/* UART RTS/CTS hardware flow control */
+#ifndef KBI_UART_FLOWCTRL
+#define KBI_UART_FLOWCTRL 0
+#endif
+
+/* Baud rates to try when probing, fastest first */
+#ifndef KBI_PROBE_RATES
+#define KBI_PROBE_RATES                                                       \
+  3000000, 2000000, 1000000, 921600, 460800, 230400, 115200
+#endif
 #define KBI_CMD_RETRIES 3
-#define KBI_MAX_SOCKETS 1
+
+/*
+ * Vendor command switching the device's UART to the 32 bit big endian baud
+ * rate in its payload, -1 if the firmware has none. The device answers at
+ * the current rate, then switches, and goes back to the previous rate if no
+ * valid frame arrives at the new one within KBI_BAUD_GRACE_MS.
+ */
+#ifndef KBI_CMD_BAUD
+#define KBI_CMD_BAUD -1
+#endif
+#ifndef KBI_BAUD_GRACE_MS
+#define KBI_BAUD_GRACE_MS 1000
+#endif
+
+/* Timeout of every try of the uptime read checking a new baud rate */
+#define KBI_BAUD_PROBE_MS 200
+
+/* Sockets available after kbi_init(), see kbi_setMaxSockets() */
+#ifndef KBI_MAX_SOCKETS
+#define KBI_MAX_SOCKETS 16
+#endif
+
+/* Pipelined commands in flight at once */
+#ifndef KBI_PIPE_DEPTH
+#define KBI_PIPE_DEPTH 4
+#endif
+
+/* Spacing of the status polls, doubled from the minimum after every try */
+#ifndef KBI_POLL_MIN_MS
+#define KBI_POLL_MIN_MS 20
+#endif
+#ifndef KBI_POLL_MAX_MS
+#define KBI_POLL_MAX_MS 1000
+#endif
+
+/* Longest time for the device to be ready again after CLEAR or IFUP */
+#ifndef KBI_READY_TOUT_MS
+#define KBI_READY_TOUT_MS 10000
+#endif
+
+/* Log every notification, formatting its addresses, set to 0 to skip it */
+#ifndef KBI_NTF_LOG
+#define KBI_NTF_LOG 1
+#endif
+
+/* Socket peer kinds */
+#define KBI_PEER_ANY 0  /* Bound, traffic from any source */
+#define KBI_PEER_ADDR 1 /* Connected to an IPv6 address */
+#define KBI_PEER_NAME 2 /* Connected to a domain name */
+
+/* Frames in every receive thread queue, must be a power of two */
+#ifndef KBI_RX_QUEUE_LEN
+#define KBI_RX_QUEUE_LEN 8
+#endif
+
+/* Longest wait of the receive thread, to notice it must stop */
+#define KBI_RX_POLL_MS 100
 
 /****************************************************************************
 **                                                                         **
@@ -39,20 +114,105 @@
 **                                                                         **
 ****************************************************************************/
 
-/* Socket handler function. */
-typedef void ( *kbi_handler_t )( uint16_t locPort, uint16_t peerPort,
-                                 char *peerName, uint8_t *udpPld,
-                                 uint16_t udpPldLen );
+typedef struct kbi_dev_t kbi_dev_t;
+
+/* Socket handler function, peerAddr is the source address of the traffic */
+typedef void ( *kbi_handler_t )( kbi_dev_t *dev, uint16_t locPort,
+                                 uint16_t                 peerPort,
+                                 const struct in6_addr *  peerAddr,
+                                 uint8_t *udpPld, uint16_t udpPldLen );
+
+/* Socket send command payload header, built once per destination */
+typedef struct kbi_sendHdr_t
+{
+  uint8_t cmd; /* CMDS_CMD_SOCKET_SEND or CMDS_CMD_NAMED_SOCKET_SEND */
+  uint8_t len; /* Bytes used in data */
+  uint8_t cks; /* XOR of data */
+  uint8_t data[ 36 ];
+} kbi_sendHdr_t;
 
 /* Socket structure */
 typedef struct kbi_socket_t
 {
-  uint16_t      locPort; /* If 0, not used */
-  uint16_t      peerPort;
-  char          peerName[ 32 ]; /* If empty, bind, else, connect */
-  kbi_handler_t handler;
+  uint16_t        locPort; /* If 0, not used */
+  uint16_t        peerPort;
+  uint8_t         peer;           /* KBI_PEER_* */
+  struct in6_addr peerAddr;       /* If KBI_PEER_ADDR */
+  char            peerName[ 32 ]; /* If KBI_PEER_NAME */
+  kbi_sendHdr_t   dst;            /* To the peer, if not KBI_PEER_ANY */
+  kbi_handler_t   handler;
+  uint16_t        next; /* Next socket in its bucket or free, plus one */
 } kbi_socket_t;
 
+/* Pipelined command completion function, the response is available in
+ * dev->cmds.rxBuf when ok is set. */
+typedef void ( *kbi_done_t )( kbi_dev_t *dev, void *ctx, _Bool ok );
+
+/* Pipelined command, kept until its response arrives for the retries */
+typedef struct kbi_req_t
+{
+  kbi_done_t done;
+  void *     ctx;
+  uint64_t   deadlineUs;
+  uint32_t   seq; /* Sending order of the last try */
+  uint16_t   pldLen;
+  uint8_t    fc;
+  uint8_t    cmd;
+  uint8_t    retries; /* If 0, not in flight */
+  uint8_t    pld[ CMDS_FRAME_PAYLOAD_MAX_LEN ];
+} kbi_req_t;
+
+/* Single producer, single consumer queue of received frames */
+typedef struct kbi_queue_t
+{
+  cmds_buffer_t    frames[ KBI_RX_QUEUE_LEN ];
+  _Atomic uint32_t head; /* Next frame to pop, free running */
+  _Atomic uint32_t tail; /* Next frame to push, free running */
+
+  /* Only to sleep while the queue is empty, the frames are lock-free */
+  _Atomic _Bool   waiting;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+} kbi_queue_t;
+
+/* Receive thread, decodes frames as soon as they arrive */
+typedef struct kbi_rx_t
+{
+  _Atomic _Bool    run;
+  pthread_t        reader;
+  pthread_t        worker;
+  kbi_queue_t      rsp;     /* Responses, to the thread sending commands */
+  kbi_queue_t      ntf;     /* Notifications, to the worker thread */
+  cmds_buffer_t    spare;   /* Decoding buffer while ntf is full */
+  _Atomic uint32_t dropped; /* Frames dropped because of a full queue */
+} kbi_rx_t;
+
+/* KiNOS device context, one per connected device */
+struct kbi_dev_t
+{
+  cmds_t   cmds; /* Must be the first member */
+  uint32_t baud; /* Current baud rate of the link */
+
+  /* Open sockets chained in buckets by local port, the rest in a free list */
+  kbi_socket_t *sockets;
+  uint16_t *    sockHash; /* First socket of every bucket, plus one */
+  uint16_t      sockMax;
+  uint16_t      sockFree; /* First free socket, plus one, 0 if none */
+  uint8_t       sockHashBits;
+
+  /* Pipelined commands in sending order, from pipeHead on */
+  kbi_req_t pipe[ KBI_PIPE_DEPTH ];
+  uint8_t   pipeHead;
+  uint8_t   pipeCnt;
+  uint16_t  pipeErrors; /* Failed since the last kbi_pipeWait() */
+  uint32_t  pipeTxSeq;  /* Tries sent */
+  uint32_t  pipeRxSeq;  /* Try answered last */
+
+  kbi_rx_t rx;
+
+  void *user; /* Free for the application */
+};
+
 /****************************************************************************
 **                                                                         **
 **                           EXPORTED VARIABLES                            **
@@ -66,44 +226,255 @@ typedef struct kbi_socket_t
 ****************************************************************************/
 
 /**
- * @brief Open the serial port and initialize the sockets list.
+ * @brief Open the serial port and initialize the sockets table with
+ * KBI_MAX_SOCKETS sockets. The port is configured at KBI_UART_BAUD, or at the
+ * rate found by kbi_probeBaud() if it is set to 0.
  *
+ * @param[out]     dev:      Device context.
  * @param[in]      device:   Path of the system's serial device where the KiNOS
  * device is connected.
  *
- * @return         0: Unable to open the port.
+ * @return         0: Unable to open the port or out of memory.
  *                 1: Port opened successfully.
  */
-_Bool kbi_init( char *device );
+_Bool kbi_init( kbi_dev_t *dev, char *device );
 
 /**
- * @brief Close the serial port.
+ * @brief Find a baud rate the device answers at by trying every rate in
+ * KBI_PROBE_RATES with an uptime read. The port is left at the found rate.
  *
+ * @param[in]      dev:     Device context.
+ *
+ * @return         0: The device didn't answer at any rate.
+ *                >0: Working baud rate.
  */
-void kbi_finish( void );
+uint32_t kbi_probeBaud( kbi_dev_t *dev );
 
 /**
- * @brief Open the serial port and initialize the sockets list.
+ * @brief Switch the link to another baud rate, the device with KBI_CMD_BAUD
+ * and then the port, and check it with an uptime read. If the device doesn't
+ * answer at the new rate, the port goes back to the previous one once the
+ * device does. Not to be called while the receive thread runs.
  *
- * @param[in]      device:   Path of the system's serial device where the KiNOS
- * device is connected.
+ * @param[in]      dev:     Device context.
+ * @param[in]      baud:    New baud rate.
  *
- * @return         0: Unable to open the port.
- *                 1: Port opened successfully.
+ * @return         0: Link kept at the previous rate, dev->baud.
+ *                 1: Link switched and working at the new rate.
+ */
+_Bool kbi_setBaud( kbi_dev_t *dev, uint32_t baud );
+
+/**
+ * @brief Resize the sockets table, keeping the open sockets. Sockets are
+ * found by their local port in constant time, no matter how many are open.
+ *
+ * @param[in]      dev:     Device context.
+ * @param[in]      max:     Number of sockets, at least the open ones.
+ *
+ * @return         0: Out of memory or too many sockets open.
+ *                 1: Table resized.
+ */
+_Bool kbi_setMaxSockets( kbi_dev_t *dev, uint16_t max );
+
+/**
+ * @brief Close the serial port and release the sockets table.
+ *
+ * @param[in]      dev:     Device context.
+ *
+ */
+void kbi_finish( kbi_dev_t *dev );
+
+/**
+ * @brief Send a command and wait for its response, retrying up to
+ * KBI_CMD_RETRIES times. Every try waits up to KBI_PORT_TOUT_MS for the
+ * response, notifications received meanwhile are dispatched to kbi_ntf().
+ * After CMDS_CMD_CLEAR and CMDS_CMD_IFUP the status is polled until the device
+ * is no longer booting, rebooting, changing or clearing, up to
+ * KBI_READY_TOUT_MS, and the response to the command is restored afterwards.
+ *
+ * @param[in]      dev:     Device context.
+ * @param[in]      fc:      Command frame code.
+ * @param[in]      cmd:     Command code.
+ * @param[in]      pld:     Pointer to the command payload.
+ * @param[in]      pldLen:  Length of pld.
+ *
+ * @return         0: No response received.
+ *                 1: Response received, available in dev->cmds.rxBuf.
+ */
+_Bool kbi_cmd( kbi_dev_t *dev, uint8_t fc, uint8_t cmd, uint8_t *pld,
+               uint16_t pldLen );
+
+/**
+ * @brief Same as kbi_cmd() with a custom time to wait for every try.
+ *
+ * @param[in]      dev:     Device context.
+ * @param[in]      fc:      Command frame code.
+ * @param[in]      cmd:     Command code.
+ * @param[in]      pld:     Pointer to the command payload.
+ * @param[in]      pldLen:  Length of pld.
+ * @param[in]      toutMs:  Milliseconds to wait for the response on every try.
+ *
+ * @return         0: No response received.
+ *                 1: Response received, available in dev->cmds.rxBuf.
+ */
+_Bool kbi_cmdTout( kbi_dev_t *dev, uint8_t fc, uint8_t cmd, uint8_t *pld,
+                   uint16_t pldLen, uint16_t toutMs );
+
+/**
+ * @brief Same as kbi_cmdTout() with the payload gathered from several
+ * segments, copied straight into the transmission frame on every try.
+ *
+ * @param[in]      dev:     Device context.
+ * @param[in]      fc:      Command frame code.
+ * @param[in]      cmd:     Command code.
+ * @param[in]      iov:     Payload segments.
+ * @param[in]      iovCnt:  Number of segments in iov.
+ * @param[in]      toutMs:  Milliseconds to wait for the response on every try.
+ *
+ * @return         0: No response received.
+ *                 1: Response received, available in dev->cmds.rxBuf.
+ */
+_Bool kbi_cmdv( kbi_dev_t *dev, uint8_t fc, uint8_t cmd,
+                const struct iovec *iov, uint8_t iovCnt, uint16_t toutMs );
+
+/**
+ * @brief Send a command without waiting for its response, so up to
+ * KBI_PIPE_DEPTH commands are in flight at once. When the pipeline is full
+ * responses are received until a slot is free.
+ *
+ * The device answers in order, so a response is matched to the first command
+ * with the same code sent after the last answered one. Every command is
+ * retried up to KBI_CMD_RETRIES times, waiting KBI_PORT_TOUT_MS for the
+ * response each, and then completed. Commands the device stays busy with,
+ * CMDS_CMD_CLEAR and CMDS_CMD_IFUP, must use kbi_cmd().
+ *
+ * @param[in]      dev:     Device context.
+ * @param[in]      fc:      Command frame code.
+ * @param[in]      cmd:     Command code.
+ * @param[in]      pld:     Pointer to the command payload, copied.
+ * @param[in]      pldLen:  Length of pld, cut to CMDS_FRAME_PAYLOAD_MAX_LEN.
+ * @param[in]      done:    Completion callback, may be NULL. It can send
+ *                          further pipelined commands.
+ * @param[in]      ctx:     Context passed to the completion callback.
+ */
+void kbi_pipeCmd( kbi_dev_t *dev, uint8_t fc, uint8_t cmd, uint8_t *pld,
+                  uint16_t pldLen, kbi_done_t done, void *ctx );
+
+/**
+ * @brief Receive responses until every pipelined command is completed.
+ * kbi_cmd() does it as well before sending its command, keeping the failures
+ * counted for this call.
+ *
+ * @param[in]      dev:     Device context.
+ *
+ * @return         0: Some command failed since the last call.
+ *                 1: All commands got their responses.
+ */
+_Bool kbi_pipeWait( kbi_dev_t *dev );
+
+/**
+ * @brief Same as kbi_pipeCmd() but never waits, for use from an event loop.
+ *
+ * @param[in]      dev:     Device context.
+ * @param[in]      fc:      Command frame code.
+ * @param[in]      cmd:     Command code.
+ * @param[in]      pld:     Pointer to the command payload, copied.
+ * @param[in]      pldLen:  Length of pld, cut to CMDS_FRAME_PAYLOAD_MAX_LEN.
+ * @param[in]      done:    Completion callback, may be NULL.
+ * @param[in]      ctx:     Context passed to the completion callback.
+ *
+ * @return         0: Pipeline full, try again after kbi_process().
+ *                 1: Command sent.
  */
-_Bool kbi_cmd( uint8_t fc, uint8_t cmd, uint8_t *pld, uint16_t pldLen );
+_Bool kbi_cmdAsync( kbi_dev_t *dev, uint8_t fc, uint8_t cmd, uint8_t *pld,
+                    uint16_t pldLen, kbi_done_t done, void *ctx );
+
+/**
+ * @brief Get the descriptor to be polled for readability by an event loop,
+ * which then calls kbi_process().
+ *
+ * @param[in]      dev:     Device context.
+ *
+ * @return         File descriptor, -1 if the port is closed.
+ */
+int kbi_fd( kbi_dev_t *dev );
+
+/**
+ * @brief Handle all the frames available without waiting: responses are
+ * passed to the completion callbacks of their commands and notifications to
+ * kbi_ntf(). Then overdue commands are retried or completed as failed.
+ *
+ * @param[in]      dev:     Device context.
+ */
+void kbi_process( kbi_dev_t *dev );
+
+/**
+ * @brief Get the time until the next command retry is due, to be used as the
+ * event loop wait timeout. kbi_process() must be called once it expires.
+ *
+ * @param[in]      dev:     Device context.
+ *
+ * @return         -1: No command in flight.
+ *                >=0: Milliseconds to wait.
+ */
+int32_t kbi_nextTimeout( kbi_dev_t *dev );
+
+/**
+ * @brief Start a thread that keeps draining the port and decoding frames into
+ * two queues. Responses are taken from one by the calls waiting for them, and
+ * notifications from the other by a worker thread that runs kbi_ntf() and the
+ * socket handlers. Frames are dropped while their queue is full.
+ *
+ * Commands must then be sent from a single thread, either the application's or
+ * the worker from within the handlers. kbi_fd() and kbi_process() can't be
+ * used meanwhile, and transmit coalescing is disabled.
+ *
+ * @param[in]      dev:     Device context.
+ *
+ * @return         0: Unable to start the threads.
+ *                 1: Threads running.
+ */
+_Bool kbi_rxStart( kbi_dev_t *dev );
+
+/**
+ * @brief Stop the threads started by kbi_rxStart(), waiting up to
+ * KBI_RX_POLL_MS for them. Frames still queued are discarded. kbi_finish()
+ * does it as well.
+ *
+ * @param[in]      dev:     Device context.
+ */
+void kbi_rxStop( kbi_dev_t *dev );
+
+/**
+ * @brief Receive a single frame from the device within KBI_PORT_TOUT_MS,
+ * notifications are dispatched to kbi_ntf() and responses to pipelined
+ * commands to their completion callbacks.
+ *
+ * @param[in]      dev:     Device context.
+ *
+ * @return         -1: Decode error/Notification received.
+ *                 -2: Port timeout.
+ *                 >0: Length of the frame, available in dev->cmds.rxBuf.
+ */
+int16_t kbi_recv( kbi_dev_t *dev );
 
 /**
  * @brief Generate a log for every kind of KBI notification by analyzing the
  * commands receive buffer. In the case of UDP received notification, send the
  * traffic to a matching socket if found.
+ *
+ * @param[in]      dev:     Device context.
  */
-void kbi_ntf( void );
+void kbi_ntf( kbi_dev_t *dev );
 
 /**
- * @brief Keep sending a read command every second until the response payload
- * matches the requested one or timeout expires.
+ * @brief Keep sending a read command until the response payload matches the
+ * requested one or timeout expires. Tries are spaced KBI_POLL_MIN_MS at first,
+ * doubling up to KBI_POLL_MAX_MS, and bound by the monotonic clock. Polling
+ * CMDS_CMD_STATUS with no payload waits for a status other than booting,
+ * rebooting, changing or clearing.
  *
+ * @param[in]      dev:   Device context.
  * @param[in]      cmd:   Command to be sent together with the read type.
  * @param[in]      pld:   Pointer to the payload to be matched.
  * @param[in]      len:   Payload length to be compared.
@@ -112,31 +483,36 @@ void kbi_ntf( void );
  * @return         0: Timeout expired without a match.
  *                 1: Payload match found.
  */
-_Bool kbi_waitFor( uint8_t cmd, uint8_t *pld, uint16_t len, uint16_t tout );
+_Bool kbi_waitFor( kbi_dev_t *dev, uint8_t cmd, uint8_t *pld, uint16_t len,
+                   uint16_t tout );
 
 /**
  * @brief Open a KBI socket associated to a single remote peer. Socket is bound
  * to all node's addresses. Received traffic to the local port of this socket
  * with source address or port not matching the peer's ones will be discarded.
+ * An address is parsed once here, so traffic is matched in binary form.
  * Typically used by a client process.
  *
+ * @param[in]      dev:       Device context.
  * @param[in]      locPort:   Local port to be used or 0 to choose an ephemeral
  * one.
  * @param[in]      peerPort:  Peer port for traffic in this socket.
  * @param[in]      peerName:  Peer name, expressed as an IPv6 address or domain
- * name.
+ * name of up to 31 characters.
  * @param[out]     handler:   Callback used to process the matching traffic.
  *
- * @return         0: Unable to open socket.
+ * @return         0: Unable to open socket, or domain name too long.
  *                >0: Number of the successfully open socket's local port.
  */
-uint16_t kbi_socketConnect( uint16_t locPort, uint16_t peerPort, char *peerName,
+uint16_t kbi_socketConnect( kbi_dev_t *dev, uint16_t locPort,
+                            uint16_t peerPort, char *peerName,
                             kbi_handler_t handler );
 
 /**
  * @brief Open a KBI socket accepting traffic from any source. Socket is bound
  * to all node's addresses. Typically used by a server process.
  *
+ * @param[in]      dev:       Device context.
  * @param[in]      locPort:   Local port to be used or 0 to choose an ephemeral
  * one.
  * @param[out]     handler:   Callback used to process the matching traffic.
@@ -144,32 +520,77 @@ uint16_t kbi_socketConnect( uint16_t locPort, uint16_t peerPort, char *peerName,
  * @return         0: Unable to open socket.
  *                >0: Number of the successfully open socket's local port.
  */
-uint16_t kbi_socketBind( uint16_t locPort, kbi_handler_t handler );
+uint16_t kbi_socketBind( kbi_dev_t *dev, uint16_t locPort,
+                         kbi_handler_t handler );
 
 /**
  * @brief Try to send a UDP packet to a specified destination using an already
  * open socket.
  *
+ * @param[in]      dev:       Device context.
  * @param[in]      locPort:   Local port identifying an open socket.
  * @param[in]      peerPort:  Peer port (destination port).
  * @param[in]      peerName:  Peer name, expressed as an IPv6 address or domain
  * name. If kbi_socketConnect was used to open the socket this parameter can be
- * set to an empty string to force using the peerName and peerPort defined when
- * opening the socket.
+ * set to an empty string or NULL to force using the peerName and peerPort
+ * defined when opening the socket, whose send header is built beforehand.
+ * @param[in]      pld:      Pointer to the UDP payload.
+ * @param[in]      pldLen:   Length of the UDP payload.
+ *
+ * It waits for the device to take the packet, so it must not be used from the
+ * handlers run by kbi_process(), see kbi_socketSendAsync().
+ */
+void kbi_socketSend( kbi_dev_t *dev, uint16_t locPort, uint16_t peerPort,
+                     char *peerName, uint8_t *pld, uint16_t pldLen );
+
+/**
+ * @brief Same as kbi_socketSend() to a binary IPv6 address, such as the one
+ * given to the socket handlers.
+ *
+ * @param[in]      dev:       Device context.
+ * @param[in]      locPort:   Local port identifying an open socket.
+ * @param[in]      peerPort:  Peer port (destination port).
+ * @param[in]      peerAddr:  Peer address.
  * @param[in]      pld:      Pointer to the UDP payload.
  * @param[in]      pldLen:   Length of the UDP payload.
  *
  */
-void kbi_socketSend( uint16_t locPort, uint16_t peerPort, char *peerName,
-                     uint8_t *pld, uint16_t pldLen );
+void kbi_socketSendAddr( kbi_dev_t *dev, uint16_t locPort, uint16_t peerPort,
+                         const struct in6_addr *peerAddr, uint8_t *pld,
+                         uint16_t pldLen );
+
+/**
+ * @brief Send a UDP packet as a pipelined command, without waiting for the
+ * device to take it, for use from an event loop and its socket handlers. The
+ * send header and the payload are copied into the request, retried and
+ * completed as kbi_cmdAsync() commands.
+ *
+ * @param[in]      dev:       Device context.
+ * @param[in]      locPort:   Local port identifying an open socket.
+ * @param[in]      peerPort:  Peer port (destination port).
+ * @param[in]      peerAddr:  Peer address, NULL to use the peer given to
+ * kbi_socketConnect(), together with its port.
+ * @param[in]      pld:       Pointer to the UDP payload.
+ * @param[in]      pldLen:    Length of the UDP payload.
+ * @param[in]      done:      Completion callback, may be NULL.
+ * @param[in]      ctx:       Context passed to the completion callback.
+ *
+ * @return         0: Socket not open, no peer to send to, or pipeline full.
+ *                 1: Packet sent.
+ */
+_Bool kbi_socketSendAsync( kbi_dev_t *dev, uint16_t locPort,
+                           uint16_t peerPort, const struct in6_addr *peerAddr,
+                           uint8_t *pld, uint16_t pldLen, kbi_done_t done,
+                           void *ctx );
 
 /**
  * @brief Release an open socket.
  *
+ * @param[in]      dev:       Device context.
  * @param[in]      locPort:   Local port identifying an open socket.
  *
  */
-void kbi_socketClose( uint16_t locPort );
+void kbi_socketClose( kbi_dev_t *dev, uint16_t locPort );
 
 #endif /* __INCLUDE_KBI_H */
 
@@ -15,14 +15,25 @@
 **                                                                         **
 ****************************************************************************/
 
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/signal.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 /****************************************************************************
@@ -31,18 +42,87 @@
 **                                                                         **
 ****************************************************************************/
 
+/* Receive ring buffer size, must be a power of two */
+#ifndef UART_RX_RING_SIZE
+#define UART_RX_RING_SIZE 4096
+#endif
+
+/* Default KiNOS UART baud rate */
+#define UART_BAUD_DEFAULT 115200
+
+/* Transmit buffer size, enough for a couple of encoded KBI frames */
+#ifndef UART_TX_BUF_SIZE
+#define UART_TX_BUF_SIZE 4096
+#endif
+
 /****************************************************************************
 **                                                                         **
 **                         TYPEDEFS AND STRUCTURES                         **
 **                                                                         **
 ****************************************************************************/
 
+/* Transport backend used to reach the device */
+typedef struct uart_transport_t
+{
+  /* Device string prefix selecting this transport, NULL for the default */
+  const char *prefix;
+
+  /* Open the device, rfd is read and polled, wfd written (usually the same) */
+  _Bool ( *open )( const char *addr, int *rfd, int *wfd );
+
+  /* Set the line rate, NULL if the transport has no such concept */
+  uint8_t ( *setBaud )( int fd, uint32_t baud, _Bool flowCtrl );
+
+  ssize_t ( *read )( int fd, struct iovec *iov, int iovcnt );
+  ssize_t ( *write )( int fd, const void *buf, size_t len );
+  void ( *close )( int rfd, int wfd );
+} uart_transport_t;
+
+/* UART port context */
+typedef struct uart_t
+{
+  int                     fd;  /* Read and polled descriptor, -1 if closed */
+  int                     wfd; /* Written descriptor, usually the same */
+  const uart_transport_t *tr;
+
+  /* Receive ring buffer, indexes are free running and masked on access */
+  uint8_t  rxRing[ UART_RX_RING_SIZE ];
+  uint32_t rxHead;
+  uint32_t rxTail;
+
+  /* Transmit buffer, frameStart is the start of the frame being queued */
+  uint8_t  txBuf[ UART_TX_BUF_SIZE ];
+  uint16_t txLen;
+  uint16_t txFrameStart;
+  _Bool    txCoalesce;
+
+  /* Default receive timeout, also for sending, and current absolute deadline,
+   * if any */
+  uint16_t toutMs;
+  uint64_t deadlineUs;
+} uart_t;
+
 /****************************************************************************
 **                                                                         **
 **                           EXPORTED VARIABLES                            **
 **                                                                         **
 ****************************************************************************/
 
+/* Serial device path, e.g: /dev/ttyACM0 */
+extern const uart_transport_t uart_ttyTransport;
+
+/* "pty:", new pseudo terminal for a peer to attach to its uart_ptyName() */
+extern const uart_transport_t uart_ptyTransport;
+
+/* "tcp:HOST:PORT", serial to TCP bridge such as ser2net */
+extern const uart_transport_t uart_tcpTransport;
+
+/* "unix:PATH", serial bridge or emulator listening in a UNIX domain socket */
+extern const uart_transport_t uart_unixTransport;
+
+/* "loop:", in-memory loopback returning everything sent */
+extern const uart_transport_t uart_loopTransport;
+
 /****************************************************************************
 **                                                                         **
 **                           EXPORTED FUNCTIONS                            **
@@ -52,32 +132,187 @@
 /**
  * @brief Initialize/configure UART port.
  *
- * @param[in]     device: The path to the serial device (e.g: /dev/ttyS0)
+ * @param[out]    uart:       Port context.
+ * @param[in]     device:     The path to the serial device (e.g: /dev/ttyS0)
+ *                            or a transport prefixed address (e.g:
+ *                            tcp:localhost:2000, unix:/tmp/kinos, pty:,
+ *                            loop:).
+ * @param[in]     baud:       Baud rate, either a standard one or any custom
+ *                            rate supported by the serial driver.
+ * @param[in]     flowCtrl:   1 to enable RTS/CTS hardware flow control.
+ * @param[in]     portToutMs: Default receive timeout in milliseconds, also
+ *                            the longest wait for a full port to take a
+ *                            frame.
+ *
+ * @return        1 Success, 0 Fail.
+ */
+uint8_t uart_init( uart_t *uart, char *device, uint32_t baud, _Bool flowCtrl,
+                   uint16_t portToutMs );
+
+/**
+ * @brief Initialize/configure UART port through a specific transport.
+ *
+ * @param[out]    uart:       Port context.
+ * @param[in]     tr:         Transport backend, built-in or user provided.
+ * @param[in]     addr:       Transport specific address, without prefix.
+ * @param[in]     baud:       Baud rate, ignored by non serial transports.
+ * @param[in]     flowCtrl:   1 to enable RTS/CTS hardware flow control.
+ * @param[in]     portToutMs: Default receive timeout in milliseconds, also
+ *                            the longest wait for a full port to take a
+ *                            frame.
  *
  * @return        1 Success, 0 Fail.
  */
-uint8_t uart_init( char *device, uint16_t portToutMs );
+uint8_t uart_initTransport( uart_t *uart, const uart_transport_t *tr,
+                            char *addr, uint32_t baud, _Bool flowCtrl,
+                            uint16_t portToutMs );
+
+/**
+ * @brief Change the baud rate and flow control of the open UART port. Any
+ *        pending transmission is flushed and received data is discarded.
+ *
+ * @param[in]     uart:      Port context.
+ * @param[in]     baud:      Baud rate, either a standard one or any custom
+ *                           rate supported by the serial driver.
+ * @param[in]     flowCtrl:  1 to enable RTS/CTS hardware flow control.
+ *
+ * @return        1 Success, 0 Rate not supported or port not open.
+ */
+uint8_t uart_setBaud( uart_t *uart, uint32_t baud, _Bool flowCtrl );
 
 /**
- * @brief Send character by UART port.
+ * @brief Get the path of the pseudo terminal end to be used by the peer when
+ *        the port was open with the pty transport.
  *
+ * @param[in]     uart:  Port context.
+ *
+ * @return        Path of the slave device, NULL if not a pty transport.
+ */
+char *uart_ptyName( uart_t *uart );
+
+/**
+ * @brief Queue a character in the UART transmit buffer. Nothing is written to
+ *        the port until the frame is ended or the buffer gets full.
+ *
+ * @param[in]     uart:  Port context.
  * @param[in]     byte:  Byte to send.
  */
-void uart_sendChar( uint8_t byte );
+void uart_sendChar( uart_t *uart, uint8_t byte );
+
+/**
+ * @brief Get room for a number of characters at the end of the transmit
+ *        buffer, to be written in place. Previous frames are written to the
+ *        port if they leave no room.
+ *
+ * @param[in]     uart:  Port context.
+ * @param[in]     len:   Number of characters to reserve.
+ *
+ * @return        Pointer to the room, NULL if len exceeds UART_TX_BUF_SIZE.
+ */
+uint8_t *uart_sendReserve( uart_t *uart, uint16_t len );
+
+/**
+ * @brief Queue the characters written in the room got with
+ *        uart_sendReserve().
+ *
+ * @param[in]     uart:  Port context.
+ * @param[in]     len:   Number of characters written, up to the reserved.
+ */
+void uart_sendCommit( uart_t *uart, uint16_t len );
+
+/**
+ * @brief Mark the end of the frame being queued. The transmit buffer is
+ *        written to the port in a single call unless coalescing is enabled.
+ *
+ * @param[in]     uart:  Port context.
+ */
+void uart_frameEnd( uart_t *uart );
+
+/**
+ * @brief Write all the queued characters to the port in a single call.
+ *
+ * @param[in]     uart:  Port context.
+ */
+void uart_flush( uart_t *uart );
+
+/**
+ * @brief Enable or disable transmit coalescing. When enabled, ended frames
+ *        are kept in the transmit buffer and written together on the next
+ *        uart_flush(), receive attempt or full buffer. Disabling it flushes
+ *        any pending frame.
+ *
+ * @param[in]     uart:    Port context.
+ * @param[in]     enable:  1 to coalesce frames, 0 to write them one by one.
+ */
+void uart_setCoalesce( uart_t *uart, _Bool enable );
+
+/**
+ * @brief Get the default receive timeout set when opening the port.
+ *
+ * @param[in]     uart:  Port context.
+ *
+ * @return        Timeout in milliseconds.
+ */
+uint16_t uart_getTimeout( uart_t *uart );
+
+/**
+ * @brief Get the current time of the monotonic clock used for deadlines.
+ *
+ * @return        Time in microseconds.
+ */
+uint64_t uart_nowUs( void );
 
 /**
- * @brief Receive a character by UART port.
+ * @brief Set an absolute deadline for the following receive calls. Once it
+ *        expires they time out no matter how data is trickling in.
  *
+ * @param[in]     uart:        Port context.
+ * @param[in]     deadlineUs:  Monotonic time in microseconds, see
+ *                             uart_nowUs(). 0 to wait up to the default
+ *                             timeout for every new chunk of data instead.
+ *                             Once expired, data already available in the
+ *                             port is still received without waiting.
+ */
+void uart_setDeadline( uart_t *uart, uint64_t deadlineUs );
+
+/**
+ * @brief Receive a character by UART port. Characters are served from the
+ *        receive ring buffer, which is refilled with a single read of all the
+ *        data available in the port when empty.
+ *
+ * @param[in]     uart:  Port context.
  * @param[out]    byte:  Pointer to received character.
  *
  * @return        1 Success, 0 Timeout.
  */
-uint8_t uart_recvChar( uint8_t *byte );
+uint8_t uart_recvChar( uart_t *uart, uint8_t *byte );
+
+/**
+ * @brief Get the received characters in a single contiguous span, reading
+ *        the data available in the port when there are none. The characters
+ *        stay in the receive buffer until consumed with uart_consume().
+ *
+ * @param[in]     uart:  Port context.
+ * @param[out]    data:  Pointer to the first received character.
+ *
+ * @return        Number of characters in the span, 0 Timeout.
+ */
+uint16_t uart_recvSpan( uart_t *uart, const uint8_t **data );
+
+/**
+ * @brief Release characters obtained with uart_recvSpan().
+ *
+ * @param[in]     uart:  Port context.
+ * @param[in]     len:   Number of characters processed, up to the span size.
+ */
+void uart_consume( uart_t *uart, uint16_t len );
 
 /**
  * @brief Close the UART port.
+ *
+ * @param[in]     uart:  Port context.
  */
-void uart_close( void );
+void uart_close( uart_t *uart );
 
 #endif /* !__INCLUDE_UART_SERIAL_H */
 
@@ -29,15 +29,15 @@
 **                                                                         **
 ****************************************************************************/
 
+static void sendFrame( cmds_t *cmds, uint8_t typ, uint8_t cmd,
+                       uint16_t pldLen, uint8_t pldCks );
+
 /****************************************************************************
 **                                                                         **
 **                           EXPORTED VARIABLES                            **
 **                                                                         **
 ****************************************************************************/
 
-cmds_buffer_t cmds_tx_buf;
-cmds_buffer_t cmds_rx_buf;
-
 /****************************************************************************
 **                                                                         **
 **                            GLOBAL VARIABLES                             **
@@ -50,98 +50,156 @@ cmds_buffer_t cmds_rx_buf;
 **                                                                         **
 ****************************************************************************/
 
-void cmds_send( uint8_t typ, uint8_t cmd, uint8_t *pld, uint16_t pldLen )
+void cmds_send( cmds_t *cmds, uint8_t typ, uint8_t cmd, uint8_t *pld,
+                uint16_t pldLen )
 {
-  uint16_t frameLen = CMDS_FRAME_HEADER_LEN + pldLen;
-  uint16_t i;
-  uint8_t  cks = 0;
-  int16_t  result;
+  struct iovec iov = { pld, pldLen };
 
-  /* Build the transmission frame */
-  cmds_tx_buf.frame_s.len = htobe16( pldLen );
-  cmds_tx_buf.frame_s.typ = typ;
-  cmds_tx_buf.frame_s.cmd = cmd;
-  cmds_tx_buf.frame_s.cks = 0;
-  memcpy( cmds_tx_buf.frame_s.pld, pld, pldLen );
+  cmds_sendv( cmds, typ, cmd, &iov, 1 );
+}
 
-  /* Fill the checksum field */
-  for ( i = 0; i < frameLen; i++ )
-    cks ^= cmds_tx_buf.frame_a[ i ];
-  cmds_tx_buf.frame_s.cks = cks;
+/***************************************************************************/
+/***************************************************************************/
+void cmds_sendv( cmds_t *cmds, uint8_t typ, uint8_t cmd,
+                 const struct iovec *iov, uint8_t iovCnt )
+{
+  uint16_t pldLen;
+  uint8_t  cks;
 
-#ifdef DEBUG_CMDS
+  pldLen = cmds_gather( cmds, iov, iovCnt, &cks );
+  sendFrame( cmds, typ, cmd, pldLen, cks );
+}
 
-  /* Plain command frame output */
-  printf( "\nCMND_TX: |" );
-  for ( i = 0; i < frameLen; i++ )
+/***************************************************************************/
+/***************************************************************************/
+uint16_t cmds_gather( cmds_t *cmds, const struct iovec *iov, uint8_t iovCnt,
+                      uint8_t *pldCks )
+{
+  uint16_t pldLen = 0;
+  uint16_t segLen;
+  uint8_t  i;
+
+  /* Gather the segments, XORed while copied */
+  *pldCks = 0;
+  for ( i = 0; i < iovCnt; i++ )
   {
-    printf( " %02x ", cmds_tx_buf.frame_a[ i ] );
-    if ( i != ( frameLen - 1 ) )
-      printf( ":" );
+    segLen = CMDS_FRAME_PAYLOAD_MAX_LEN - pldLen;
+    if ( iov[ i ].iov_len < segLen )
+      segLen = iov[ i ].iov_len;
+    *pldCks ^= cobs_copyXor( cmds->txBuf.frame_s.pld + pldLen,
+                             iov[ i ].iov_base, segLen );
+    pldLen += segLen;
   }
-  printf( "|\n" );
+  return pldLen;
+}
 
-#endif /* DEBUG_CMDS */
+/***************************************************************************/
+/***************************************************************************/
+uint8_t *cmds_reserve( cmds_t *cmds ) { return cmds->txBuf.frame_s.pld; }
 
-  /* Encode frame and send to UART */
-  cobs_encode( cmds_tx_buf.frame_a, frameLen, uart_sendChar );
+/***************************************************************************/
+/***************************************************************************/
+void cmds_commit( cmds_t *cmds, uint8_t typ, uint8_t cmd, uint16_t pldLen )
+{
+  sendFrame( cmds, typ, cmd, pldLen,
+             cobs_copyXor( NULL, cmds->txBuf.frame_s.pld, pldLen ) );
 }
 
 /***************************************************************************/
 /***************************************************************************/
-int16_t cmds_recv( cmds_ntf_cb_t ntfCb )
+void cmds_commitXor( cmds_t *cmds, uint8_t typ, uint8_t cmd, uint16_t pldLen,
+                     uint8_t pldCks )
 {
-  uint16_t i;
-  uint8_t  cks = 0;
-  int16_t  result;
+  sendFrame( cmds, typ, cmd, pldLen, pldCks );
+}
 
-  /* Receive the response */
-  do
+/***************************************************************************/
+/***************************************************************************/
+int16_t cmds_recv( cmds_t *cmds, cmds_ntf_cb_t ntfCb )
+{
+  return cmds_recvUntil(
+    cmds, ntfCb, uart_nowUs() + uart_getTimeout( &cmds->uart ) * 1000 );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+int16_t cmds_recvUntil( cmds_t *cmds, cmds_ntf_cb_t ntfCb,
+                        uint64_t deadlineUs )
+{
+  int16_t result = cmds_recvFrame( cmds, &cmds->rxBuf, deadlineUs );
+
+  if ( ( result > 0 ) && ( ( cmds->rxBuf.frame_s.typ & 0xf0 ) == CMDS_FTNTF ) )
   {
-    result = cobs_decode( cmds_rx_buf.frame_a, sizeof( cmds_buffer_t ),
-                          uart_recvChar );
-  } while ( result == 0 );
+    /* Notification callback */
+    if ( ntfCb )
+      ntfCb( cmds );
+    return COBS_RESULT_ERROR;
+  }
 
-  /* Verify checksum */
-  if ( result > 0 )
+  return result;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+int16_t cmds_recvFrame( cmds_t *cmds, cmds_buffer_t *buf,
+                        uint64_t deadlineUs )
+{
+  const uint8_t *span;
+  uint16_t       spanLen;
+  uint16_t       used;
+  int16_t        result;
+#ifdef DEBUG_CMDS
+  uint16_t i;
+#endif
+
+  /* Decode whole received spans, the port times out once deadline expires */
+  uart_setDeadline( &cmds->uart, deadlineUs );
+  do
   {
-    for ( i = 0; i < result; i++ )
-    {
-      if ( i != CMDS_FRAME_POS_CKS )
-        cks ^= cmds_rx_buf.frame_a[ i ];
-    }
-    if ( cmds_rx_buf.frame_s.cks != cks )
-      result = COBS_RESULT_ERROR; /* Bad checksum */
-    else if ( ( cmds_rx_buf.frame_s.typ & 0xf0 ) == CMDS_FTNTF )
+    if ( !( spanLen = uart_recvSpan( &cmds->uart, &span ) ) )
     {
-      /* Notification callback */
-      if ( ntfCb )
-        ntfCb();
-      return COBS_RESULT_ERROR;
+      result = COBS_RESULT_TIMEOUT;
+      break;
     }
-  }
+    result = cobs_decFeed( &cmds->cobs, buf->frame_a, sizeof( cmds_buffer_t ),
+                           span, spanLen, &used );
+    uart_consume( &cmds->uart, used );
+  } while ( result == COBS_RESULT_NONE );
+  uart_setDeadline( &cmds->uart, 0 );
+
+  /* Verify checksum, the XOR of a whole frame with its checksum is zero */
+  if ( ( result > 0 ) && ( cmds->cobs.xor != 0 ) )
+    result = COBS_RESULT_ERROR; /* Bad checksum */
 
 #ifdef DEBUG_CMDS
 
   printf( "CMND_RX: |" );
   if ( result == COBS_RESULT_ERROR )
-    printf( " COBS error " );
+    printf( " COBS error, %u bytes dropped so far ", cmds->cobs.dropped );
   else if ( result == COBS_RESULT_TIMEOUT )
     printf( " Port timeout " );
   else
   {
     for ( i = 0; i < result; i++ )
     {
-      printf( " %02x ", cmds_rx_buf.frame_a[ i ] );
+      printf( " %02x ", buf->frame_a[ i ] );
       if ( i != ( result - 1 ) )
         printf( ":" );
     }
   }
   printf( "|\n" );
 
+#endif /* DEBUG_CMDS */
+
   return result;
+}
 
-#endif /* DEBUG_CMDS */
+/***************************************************************************/
+/***************************************************************************/
+int16_t cmds_recvNow( cmds_t *cmds, cmds_ntf_cb_t ntfCb )
+{
+  /* Any expired deadline just takes the data available */
+  return cmds_recvUntil( cmds, ntfCb, 1 );
 }
 
 /****************************************************************************
@@ -150,6 +208,53 @@ int16_t cmds_recv( cmds_ntf_cb_t ntfCb )
 **                                                                         **
 ****************************************************************************/
 
+/**
+ * @brief Fill the header of the transmission frame, whose payload is already
+ *        in place, and encode it straight into the UART buffer.
+ *
+ * @param[in]      pldLen:  Length of the payload.
+ * @param[in]      pldCks:  XOR of the payload bytes.
+ */
+static void sendFrame( cmds_t *cmds, uint8_t typ, uint8_t cmd,
+                       uint16_t pldLen, uint8_t pldCks )
+{
+  uint16_t frameLen = CMDS_FRAME_HEADER_LEN + pldLen;
+  uint32_t encMax   = cobs_encodeMax( frameLen );
+  uint8_t *enc;
+#ifdef DEBUG_CMDS
+  uint16_t i;
+#endif
+
+  cmds->txBuf.frame_s.len = htobe16( pldLen );
+  cmds->txBuf.frame_s.typ = typ;
+  cmds->txBuf.frame_s.cmd = cmd;
+  cmds->txBuf.frame_s.cks =
+    pldCks ^ ( pldLen >> 8 ) ^ ( pldLen & 0xFF ) ^ typ ^ cmd;
+
+#ifdef DEBUG_CMDS
+
+  /* Plain command frame output */
+  printf( "\nCMND_TX: |" );
+  for ( i = 0; i < frameLen; i++ )
+  {
+    printf( " %02x ", cmds->txBuf.frame_a[ i ] );
+    if ( i != ( frameLen - 1 ) )
+      printf( ":" );
+  }
+  printf( "|\n" );
+
+#endif /* DEBUG_CMDS */
+
+  /* Encode frame straight into the UART buffer and send it at once */
+  if ( ( enc = uart_sendReserve( &cmds->uart, encMax ) ) )
+  {
+    uart_sendCommit( &cmds->uart, cobs_encodeBuf( cmds->txBuf.frame_a,
+                                                  frameLen, enc, encMax ) );
+    uart_frameEnd( &cmds->uart );
+  }
+  cmds->txCnt++;
+}
+
 #endif /* CMDS_C_SRC */
 
 /****************************************************************************
@@ -15,55 +15,41 @@
 ****************************************************************************/
 
 #include "cobs.h"
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if !defined( COBS_NO_SIMD ) && defined( __GNUC__ ) &&                       \
+    ( defined( __x86_64__ ) || defined( __i386__ ) )
+#define COBS_SIMD_X86
+#include <immintrin.h>
+#endif
+
 /****************************************************************************
 **                                                                         **
-**                         TYPEDEFS AND STRUCTURES                         **
+**                         DEFINITIONS AND MACROS                          **
 **                                                                         **
 ****************************************************************************/
 
-struct cobs_tx_s
-{
-  uint16_t pos[ COBS_SIZE_CODES_ARRAY ];
-  uint8_t  code[ COBS_SIZE_CODES_ARRAY ];
-  uint8_t  codePos;
-};
-
-struct cobs_rx_s
-{
-  uint8_t dataBytes;
-  uint8_t zeroes;
-};
-
-/* Struct of transmission using COBS. */
-struct usart_tx_s
-{
-  uint16_t         totBytes; /* Total number of bytes to send. */
-  uint16_t         proBytes; /* Number of processed bytes. */
-  struct cobs_tx_s cobs;     /* COBS data. */
-};
-
-/* Struct of transmission using COBS. */
-struct usart_rx_s
-{
-  uint16_t         totBytes; /* Total number of bytes to send. */
-  int16_t          proBytes; /* Number of bytes sent. */
-  uint8_t          startMsg;
-  uint8_t          payload;
-  struct cobs_rx_s cobs; /* COBS data. */
-};
+/* Word-wide zero byte test, true if any byte in x is zero */
+#define HAS_ZERO( x )                                                         \
+  ( ( ( x ) - ( ( uintptr_t ) -1 / 0xFF ) ) & ~( x ) &                        \
+    ( ( ( uintptr_t ) -1 / 0xFF ) * 0x80 ) )
 
 /****************************************************************************
 **                                                                         **
-**                            GLOBAL VARIABLES                             **
+**                         TYPEDEFS AND STRUCTURES                         **
 **                                                                         **
 ****************************************************************************/
 
-static struct usart_rx_s usart_rxPkt;
+/* Zero scanning function, returns the first zero in [p, end) or end */
+typedef const uint8_t *( *findZero_t )( const uint8_t *p, const uint8_t *end );
+
+/* Copy and XOR function, see cobs_copyXor() */
+typedef uint8_t ( *copyXor_t )( uint8_t *dst, const uint8_t *src,
+                                uint32_t len );
 
 /****************************************************************************
 **                                                                         **
@@ -73,6 +59,30 @@ static struct usart_rx_s usart_rxPkt;
 
 static void debug( _Bool tx, uint8_t byte, _Bool first, _Bool last );
 
+static void decStore( cobs_dec_t *dec, uint8_t *buff, uint16_t len,
+                      const uint8_t *src, uint16_t num );
+
+static void decDrop( cobs_dec_t *dec );
+
+static void pickSimd( void );
+
+static const uint8_t *findZeroDispatch( const uint8_t *p, const uint8_t *end );
+
+static const uint8_t *findZeroWord( const uint8_t *p, const uint8_t *end );
+
+static uint8_t copyXorDispatch( uint8_t *dst, const uint8_t *src,
+                                uint32_t len );
+
+static uint8_t copyXorWord( uint8_t *dst, const uint8_t *src, uint32_t len );
+
+#ifdef COBS_SIMD_X86
+static const uint8_t *findZeroSse2( const uint8_t *p, const uint8_t *end );
+
+static const uint8_t *findZeroAvx2( const uint8_t *p, const uint8_t *end );
+
+static uint8_t copyXorAvx2( uint8_t *dst, const uint8_t *src, uint32_t len );
+#endif
+
 #ifdef DEBUG_COBS
 #define debug_tx( ... ) debug( 1, __VA_ARGS__ )
 #define debug_rx( ... ) debug( 0, __VA_ARGS__ )
@@ -81,380 +91,344 @@ static void debug( _Bool tx, uint8_t byte, _Bool first, _Bool last );
 #define debug_rx( ... ) ( void ) 0
 #endif /* DEBUG_COBS*/
 
+/****************************************************************************
+**                                                                         **
+**                            GLOBAL VARIABLES                             **
+**                                                                         **
+****************************************************************************/
+
+/* Best zero scanner and XOR for this CPU, chosen on first use */
+static findZero_t findZero = findZeroDispatch;
+static copyXor_t  copyXor  = copyXorDispatch;
+
 /****************************************************************************
 **                                                                         **
 **                           EXPORTED FUNCTIONS                            **
 **                                                                         **
 ****************************************************************************/
 
-int16_t cobs_encode( uint8_t *buff, uint16_t len, cobs_byteOut_t output )
+int16_t cobs_encode( uint8_t *buff, uint16_t len, cobs_byteOut_t output,
+                     void *ctx )
 {
-  struct usart_tx_s usart_txPkt;
-  uint8_t *         tmpPtr      = buff;
-  uint8_t *         lastZeroPtr = NULL;
-  uint8_t *         codePtr     = NULL;
-  uint16_t          codePos     = 0;
-  uint16_t          code        = 0x01;
-  uint8_t           numZeroes   = 0;
-  int16_t           outIdx      = 0;
-
-  /* Initialize COBS structure. */
-  memset( &usart_txPkt, 0, sizeof( struct usart_tx_s ) );
-  codePtr = usart_txPkt.cobs.code;
+  uint8_t encoded[ cobs_encodeMax( len ) ];
+  int32_t encLen;
+  int32_t i;
 
-  /*
-   * proBytes = number of encoded bytes
-   * length   = Number of in data bytes to encode
-   */
-  while ( usart_txPkt.proBytes < len )
+  encLen = cobs_encodeBuf( buff, len, encoded, sizeof( encoded ) );
+
+  /* Send out encoded bytes through the callback */
+  for ( i = 0; i < encLen; i++ )
+    output( ctx, encoded[ i ] );
+
+  return ( encLen );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+int32_t cobs_encodeBuf( const uint8_t *in, uint16_t len, uint8_t *out,
+                        uint32_t outCap )
+{
+  uint32_t outLen    = 0;
+  uint32_t codeIdx   = 0;
+  uint8_t  dataBytes = 0; /* Data bytes in the current block */
+  uint8_t  zeroes    = 0; /* Zeroes pending to be coded */
+  uint16_t run;
+  uint16_t chunk;
+  uint16_t i = 0;
+
+  if ( outCap < cobs_encodeMax( len ) )
+    return COBS_RESULT_ERROR;
+
+  /* Start delimiter, then room for the first code */
+  out[ outLen++ ] = 0x00;
+  codeIdx         = outLen++;
+
+  while ( i < len )
   {
-    if ( *tmpPtr == 0 )
+    if ( in[ i ] == 0 )
     {
-      numZeroes++;
-      if ( ( numZeroes == 2 ) && ( code != 0x01 ) )
+      i++;
+      zeroes++;
+      if ( ( zeroes == 2 ) && dataBytes )
       {
-        if ( ( code + 0xDF ) <= 0xFE )
+        if ( dataBytes <= 0xFE - 0xE0 )
         {
           /* The (n-E0) data bytes, plus two trailing zeroes. */
-          code += 0xDF;
-          numZeroes = 0;
+          out[ codeIdx ] = 0xE0 + dataBytes;
+          zeroes         = 0;
         }
         else
         {
           /* The (n-1) data bytes followed by a single zero. */
-          numZeroes = 1;
-        }
-
-        *codePtr = code;
-        usart_txPkt.totBytes++;
-        if ( codePtr == usart_txPkt.cobs.code + usart_txPkt.cobs.codePos )
-        {
-          usart_txPkt.cobs.pos[ usart_txPkt.cobs.codePos ] = codePos;
-          usart_txPkt.cobs.codePos++;
+          out[ codeIdx ] = dataBytes + 1;
+          zeroes         = 1;
         }
-
-        /* Reset counters. */
-        codePtr = tmpPtr;
-        codePos = usart_txPkt.proBytes;
-        code    = 0x01;
+        codeIdx   = outLen++;
+        dataBytes = 0;
       }
-      else if ( numZeroes == 0x0F )
+      else if ( zeroes == 0x0F )
       {
         /* We have reached maximun number of zeroes in a row. */
-        code     = numZeroes + 0xD0;
-        codePtr  = lastZeroPtr;
-        *codePtr = code;
-        usart_txPkt.totBytes++;
-
-        /* Reset counters. */
-        codePtr   = tmpPtr;
-        codePos   = usart_txPkt.proBytes;
-        numZeroes = 0;
-        code      = 0x01;
-      }
-      else if ( ( codePtr ==
-                  usart_txPkt.cobs.code + usart_txPkt.cobs.codePos ) &&
-                ( code == 0x01 ) && ( numZeroes == 1 ) )
-      {
-        codePtr = tmpPtr;
-        codePos = usart_txPkt.proBytes;
+        out[ codeIdx ] = 0xD0 + zeroes;
+        codeIdx        = outLen++;
+        zeroes         = 0;
       }
-
-      lastZeroPtr = tmpPtr;
     }
-    else if ( numZeroes )
+    else
     {
-      /* Finish previous block. */
-      if ( numZeroes < 3 )
+      if ( zeroes )
       {
-        if ( code == 0x01 )
-        {
-          if ( numZeroes == 2 )
-          {
-            /* The (n-E0) data bytes, plus two trailing zeroes. */
-            code += 0xDF;
-          }
-          else
-          {
-            /* The (n-1) data bytes followed by a single zero. */
-            /* Nothing to do. */
-          }
-
-          *codePtr = code;
-          usart_txPkt.totBytes++;
-
-          if ( codePtr != lastZeroPtr )
-          {
-            codePtr = lastZeroPtr;
-            codePos = usart_txPkt.proBytes - 1;
-          }
-          else
-          {
-            /* Add aditional byte. */
-            codePtr = usart_txPkt.cobs.code + usart_txPkt.cobs.codePos;
-            codePos = usart_txPkt.proBytes;
-          }
-        }
+        /* Finish previous block. */
+        if ( dataBytes )
+          out[ codeIdx ] = dataBytes + 1;
+        else if ( zeroes == 1 )
+          out[ codeIdx ] = 0x01;
+        else if ( zeroes == 2 )
+          out[ codeIdx ] = 0xE0;
         else
-        {
-          /* The (n-1) data bytes followed by a single zero. */
-          *codePtr = code;
-          usart_txPkt.totBytes++;
-
-          if ( codePtr == usart_txPkt.cobs.code + usart_txPkt.cobs.codePos )
-          {
-            usart_txPkt.cobs.pos[ usart_txPkt.cobs.codePos ] = codePos;
-            usart_txPkt.cobs.codePos++;
-          }
-
-          codePtr = lastZeroPtr;
-          codePos = usart_txPkt.proBytes - 1;
-        }
-      }
-      else
-      {
-        /* A run of (n-D0) zeroes. */
-        code     = numZeroes + 0xD0;
-        *codePtr = code;
-        usart_txPkt.totBytes++;
-        codePtr = lastZeroPtr;
-        codePos = usart_txPkt.proBytes - 1;
+          out[ codeIdx ] = 0xD0 + zeroes; /* A run of (n-D0) zeroes. */
+        codeIdx   = outLen++;
+        dataBytes = 0;
+        zeroes    = 0;
       }
 
-      /* Reset counters. */
-      numZeroes = 0;
-      code      = 0x02;
-      usart_txPkt.totBytes++;
-    }
-    else
-    {
-      /* Increment code. */
-      code++;
-      if ( code == 0xD0 )
+      /* Copy the whole run of data bytes up to the next zero. */
+      run = findZero( in + i, in + len ) - ( in + i );
+      while ( run )
       {
-        /*
-         * We have reached the maximum number of bytes not followed by a
-         * zero.
-         */
-        *codePtr = 0xD0;
-        usart_txPkt.totBytes++;
-        if ( codePtr == usart_txPkt.cobs.code + usart_txPkt.cobs.codePos )
+        chunk = COBS_MAX_BLOCK - dataBytes;
+        if ( chunk > run )
+          chunk = run;
+        memcpy( out + outLen, in + i, chunk );
+        outLen += chunk;
+        i += chunk;
+        run -= chunk;
+        dataBytes += chunk;
+        if ( dataBytes == COBS_MAX_BLOCK )
         {
-          usart_txPkt.cobs.pos[ usart_txPkt.cobs.codePos ] = codePos;
-          usart_txPkt.cobs.codePos++;
+          /*
+           * We have reached the maximum number of bytes not followed by a
+           * zero.
+           */
+          out[ codeIdx ] = 0xD0;
+          codeIdx        = outLen++;
+          dataBytes      = 0;
         }
-
-        /* Add aditional byte.*/
-        codePtr = usart_txPkt.cobs.code + usart_txPkt.cobs.codePos;
-        codePos = usart_txPkt.proBytes + 1;
-
-        /* Reset counters. */
-        code = 0x01;
       }
-
-      usart_txPkt.totBytes++;
+      continue;
     }
-
-    /* Increment pointers. */
-    tmpPtr++;
-    usart_txPkt.proBytes++;
   }
 
-  /* Finish message. */
-  numZeroes++;
-  if ( numZeroes == 2 )
+  /* Finish message, as if it was followed by a zero. */
+  zeroes++;
+  if ( zeroes == 2 )
   {
-    if ( ( code + 0xDF ) <= 0xFE )
+    if ( dataBytes <= 0xFE - 0xE0 )
     {
       /* The (n-E0) data bytes, plus two trailing zeroes. */
-      code += 0xDF;
+      out[ codeIdx ] = 0xE0 + dataBytes;
     }
     else
     {
-      /* The (n-1) data bytes followed by a single zero. */
-      *codePtr = code;
-      usart_txPkt.totBytes++;
-      if ( codePtr == usart_txPkt.cobs.code + usart_txPkt.cobs.codePos )
-      {
-        usart_txPkt.cobs.pos[ usart_txPkt.cobs.codePos ] = codePos;
-        usart_txPkt.cobs.codePos++;
-      }
-
-      codePtr = lastZeroPtr;
-      code    = 0x01;
+      /* The (n-1) data bytes followed by a single zero, then the other. */
+      out[ codeIdx ]  = dataBytes + 1;
+      out[ outLen++ ] = 0x01;
     }
   }
-  else if ( numZeroes > 2 )
+  else if ( zeroes > 2 )
   {
     /* A run of zeroes. */
-    code = numZeroes + 0xD0;
+    out[ codeIdx ] = 0xD0 + zeroes;
   }
+  else
+    out[ codeIdx ] = dataBytes + 1;
 
-  *codePtr = code;
-  usart_txPkt.totBytes++;
-  if ( codePtr == usart_txPkt.cobs.code + usart_txPkt.cobs.codePos )
-    usart_txPkt.cobs.pos[ usart_txPkt.cobs.codePos ] = codePos;
-
-  /* Send out encoded bytes through the callback */
-  usart_txPkt.proBytes     = 0;
-  usart_txPkt.cobs.codePos = 0;
-  while ( outIdx < usart_txPkt.totBytes + 1 )
-  {
-    if ( outIdx == 0 )
-    {
-      /* First zero as start delimiter */
-      debug_tx( 0x00, 1, outIdx == usart_txPkt.totBytes );
-      output( 0x00 );
-      outIdx++;
-    }
-    else if ( ( usart_txPkt.cobs.pos[ usart_txPkt.cobs.codePos ] ==
-                usart_txPkt.proBytes ) &&
-              ( usart_txPkt.cobs.code[ usart_txPkt.cobs.codePos ] != 0 ) )
-    {
-      debug_tx( usart_txPkt.cobs.code[ usart_txPkt.cobs.codePos ], 0,
-                outIdx == usart_txPkt.totBytes );
-      output( usart_txPkt.cobs.code[ usart_txPkt.cobs.codePos ] );
-      usart_txPkt.cobs.codePos++;
-      outIdx++;
-    }
-    else
-    {
-      uint8_t data = 0;
-
-      while ( data == 0 )
-      {
-        data = buff[ usart_txPkt.proBytes++ ];
-        if ( data != 0 )
-        {
-          debug_tx( data, 0, outIdx == usart_txPkt.totBytes );
-          output( data );
-          outIdx++;
-        }
-      }
-    }
-  }
+#ifdef DEBUG_COBS
+  for ( codeIdx = 0; codeIdx < outLen; codeIdx++ )
+    debug_tx( out[ codeIdx ], codeIdx == 0, codeIdx == outLen - 1 );
+#endif /* DEBUG_COBS */
 
-  return ( outIdx );
+  return ( outLen );
 }
 
 /***************************************************************************/
 /***************************************************************************/
-int16_t cobs_decode( uint8_t *buff, uint16_t len, cobs_byteIn_t input )
+uint32_t cobs_encodeMax( uint16_t len )
 {
-  uint8_t inByte  = 0;
-  uint8_t numChar = 0;
+  /*
+   * Delimiter, plus data bytes, plus codes. Every code but 0xD0 stands for at
+   * least one zero, the last one for the trailing virtual zero.
+   */
+  return 1 + len + len / COBS_MAX_BLOCK + 1;
+}
 
-  numChar = input( &inByte );
-  if ( numChar == 0 )
-    goto timeout;
+/***************************************************************************/
+/***************************************************************************/
+uint8_t cobs_copyXor( uint8_t *dst, const uint8_t *src, uint32_t len )
+{
+  return copyXor( dst, src, len );
+}
 
-  if ( inByte == 0 )
+/***************************************************************************/
+/***************************************************************************/
+void cobs_setSimd( _Bool enable )
+{
+  if ( enable )
+    pickSimd();
+  else
   {
-    uint16_t dataBytes = usart_rxPkt.cobs.dataBytes;
-    /* Initialize COBS structure. */
-    usart_rxPkt.totBytes       = 5;
-    usart_rxPkt.proBytes       = 0;
-    usart_rxPkt.startMsg       = 1;
-    usart_rxPkt.payload        = 0;
-    usart_rxPkt.cobs.dataBytes = 0;
-    usart_rxPkt.cobs.zeroes    = 0;
-    memset( buff, 0, 5 );
-    if ( dataBytes == 0 )
-      goto first;
-    else
-      goto nothing;
+    findZero = findZeroWord;
+    copyXor  = copyXorWord;
   }
-  else if ( ( inByte != 0 ) && ( usart_rxPkt.startMsg == 1 ) )
+}
+
+/***************************************************************************/
+/***************************************************************************/
+int16_t cobs_decFeed( cobs_dec_t *dec, uint8_t *buff, uint16_t len,
+                      const uint8_t *in, uint16_t inLen, uint16_t *used )
+{
+  const uint8_t *p      = in;
+  const uint8_t *end    = in + inLen;
+  const uint8_t *skip;
+  int16_t        result = COBS_RESULT_NONE;
+  uint16_t       num;
+  uint8_t        code;
+
+  /* Longer frames couldn't be told from errors */
+  if ( len > INT16_MAX )
+    len = INT16_MAX;
+
+  while ( p < end )
   {
-    if ( ( usart_rxPkt.proBytes >= 2 ) && ( usart_rxPkt.payload == 0 ) )
+    if ( *p == 0 )
     {
-      usart_rxPkt.totBytes += ( buff[ 0 ] << 8 ) + buff[ 1 ];
-      if ( usart_rxPkt.totBytes > len )
-        goto error;
-
-      memset( buff + 5, 0, usart_rxPkt.totBytes - 5 );
-      usart_rxPkt.payload = 1;
+      /* Start delimiter, initialize COBS structure. */
+      dec->totBytes  = 5;
+      dec->proBytes  = 0;
+      dec->encBytes  = 0;
+      dec->startMsg  = 1;
+      dec->endMsg    = 0;
+      dec->payload   = 0;
+      dec->dataBytes = 0;
+      dec->zeroes    = 0;
+      dec->xor       = 0;
+      p++;
+      continue;
     }
-
-    if ( usart_rxPkt.cobs.dataBytes == 0 )
+    else if ( !dec->startMsg )
+    {
+      /* Not in a frame, skip everything up to the next delimiter. */
+      skip = memchr( p, 0, end - p );
+      if ( !skip )
+        skip = end;
+      if ( !dec->endMsg )
+        dec->dropped += skip - p;
+      p = skip;
+      continue;
+    }
+    else if ( dec->dataBytes == 0 )
     {
       /* Read COBS code. */
-      if ( inByte < 0xD0 )
+      code = *p++;
+      dec->encBytes++;
+      if ( code < 0xD0 )
       {
-        usart_rxPkt.cobs.dataBytes = inByte - 1;
-        usart_rxPkt.cobs.zeroes    = 1;
+        dec->dataBytes = code - 1;
+        dec->zeroes    = 1;
       }
-      else if ( inByte == 0xD0 )
+      else if ( code == 0xD0 )
       {
-        usart_rxPkt.cobs.dataBytes = inByte - 1;
-        usart_rxPkt.cobs.zeroes    = 0;
+        dec->dataBytes = code - 1;
+        dec->zeroes    = 0;
       }
-      else if ( ( inByte == 0xD1 ) || ( inByte == 0xD2 ) )
-        goto error;
-      else if ( inByte < 0xE0 )
+      else if ( ( code == 0xD1 ) || ( code == 0xD2 ) || ( code == 0xFF ) )
       {
-        /* Move pointer to the new position. */
-        usart_rxPkt.cobs.dataBytes = 0;
-        usart_rxPkt.cobs.zeroes    = inByte - 0xD0;
+        decDrop( dec );
+        result = COBS_RESULT_ERROR;
+        break;
       }
-      else if ( inByte < 0xFF )
+      else if ( code < 0xE0 )
       {
-        usart_rxPkt.cobs.dataBytes = inByte - 0xE0;
-        usart_rxPkt.cobs.zeroes    = 2;
+        dec->dataBytes = 0;
+        dec->zeroes    = code - 0xD0;
       }
       else
-        goto error;
-
-      if ( usart_rxPkt.cobs.dataBytes == 0 )
       {
-        usart_rxPkt.proBytes += usart_rxPkt.cobs.zeroes;
-        usart_rxPkt.cobs.zeroes = 0;
+        dec->dataBytes = code - 0xE0;
+        dec->zeroes    = 2;
       }
     }
     else
     {
-      if ( usart_rxPkt.proBytes < usart_rxPkt.totBytes )
-      {
-        /* Read data byte. */
-        buff[ usart_rxPkt.proBytes ] = inByte;
-      }
+      /* Read data bytes, up to the end of the block or a delimiter. */
+      num = dec->dataBytes;
+      if ( num > end - p )
+        num = end - p;
+      num = findZero( p, p + num ) - p;
+      if ( num == 0 )
+        continue;
+      decStore( dec, buff, len, p, num );
+      dec->dataBytes -= num;
+      dec->encBytes += num;
+      p += num;
+    }
+
+    if ( dec->dataBytes == 0 )
+    {
+      decStore( dec, buff, len, NULL, dec->zeroes );
+      dec->zeroes = 0;
+    }
 
-      ++usart_rxPkt.proBytes;
-      if ( --usart_rxPkt.cobs.dataBytes == 0 )
+    /* Validate the length as soon as the header is in. */
+    if ( !dec->payload && ( dec->proBytes >= 2 ) )
+    {
+      dec->totBytes += ( buff[ 0 ] << 8 ) + buff[ 1 ];
+      dec->payload = 1;
+      if ( dec->totBytes > len )
       {
-        usart_rxPkt.proBytes += usart_rxPkt.cobs.zeroes;
-        usart_rxPkt.cobs.zeroes = 0;
+        decDrop( dec );
+        result = COBS_RESULT_ERROR;
+        break;
       }
     }
+
+    if ( dec->proBytes >= dec->totBytes )
+    {
+      dec->startMsg = 0;
+      dec->endMsg   = 1;
+      result        = dec->totBytes;
+      break;
+    }
   }
-  else
-    goto nothing;
 
-  if ( usart_rxPkt.proBytes >= usart_rxPkt.totBytes )
+  *used = p - in;
+
+#ifdef DEBUG_COBS
+  for ( num = 0; num < *used; num++ )
   {
-    usart_rxPkt.startMsg = 0;
-    goto finished;
+    debug_rx( in[ num ], in[ num ] == 0,
+              ( result != COBS_RESULT_NONE ) && ( num == *used - 1 ) );
   }
-  else
-    goto incomplete;
-
-timeout:
-  debug_rx( inByte, 1, 1 );
-  return COBS_RESULT_TIMEOUT;
-nothing:
-  return COBS_RESULT_NONE;
-first:
-  debug_rx( inByte, 1, 0 );
-  return COBS_RESULT_NONE;
-error:
-  debug_rx( inByte, 0, 1 );
-  return COBS_RESULT_ERROR;
-incomplete:
-  debug_rx( inByte, 0, 0 );
-  return COBS_RESULT_NONE;
-finished:
-  debug_rx( inByte, 0, 1 );
-  return ( usart_rxPkt.totBytes );
+#endif /* DEBUG_COBS */
+
+  return result;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+int16_t cobs_decode( cobs_dec_t *dec, uint8_t *buff, uint16_t len,
+                     cobs_byteIn_t input, void *ctx )
+{
+  uint8_t  inByte = 0;
+  uint16_t used;
+
+  if ( input( ctx, &inByte ) == 0 )
+  {
+    debug_rx( inByte, 1, 1 );
+    return COBS_RESULT_TIMEOUT;
+  }
+
+  return cobs_decFeed( dec, buff, len, &inByte, 1, &used );
 }
 
 /****************************************************************************
@@ -477,6 +451,243 @@ static void debug( _Bool tx, uint8_t byte, _Bool first, _Bool last )
     printf( ":" );
 }
 
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Append decoded bytes to the message, dropping those beyond its
+ *        length limit.
+ *
+ * @param[in]     src:  Bytes to append, NULL to append zeroes.
+ * @param[in]     num:  Number of bytes to append.
+ */
+static void decStore( cobs_dec_t *dec, uint8_t *buff, uint16_t len,
+                      const uint8_t *src, uint16_t num )
+{
+  uint32_t room = ( dec->proBytes < len ) ? len - dec->proBytes : 0;
+  uint16_t copy = ( num < room ) ? num : room;
+
+  if ( src )
+    dec->xor ^= copyXor( buff + dec->proBytes, src, copy );
+  else
+    memset( buff + dec->proBytes, 0, copy );
+  dec->proBytes += num;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Drop the current frame and start looking for the next delimiter.
+ */
+static void decDrop( cobs_dec_t *dec )
+{
+  dec->dropped += dec->encBytes;
+  dec->startMsg = 0;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Pick the widest zero scanner and XOR the CPU supports.
+ */
+static void pickSimd( void )
+{
+  findZero = findZeroWord;
+  copyXor  = copyXorWord;
+#ifdef COBS_SIMD_X86
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports( "avx2" ) )
+  {
+    findZero = findZeroAvx2;
+    copyXor  = copyXorAvx2;
+  }
+  else if ( __builtin_cpu_supports( "sse2" ) )
+    findZero = findZeroSse2;
+#endif
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Pick the best zero scanner on first use and run it.
+ */
+static const uint8_t *findZeroDispatch( const uint8_t *p, const uint8_t *end )
+{
+  pickSimd();
+  return findZero( p, end );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Portable zero scanner, a machine word at a time.
+ */
+static const uint8_t *findZeroWord( const uint8_t *p, const uint8_t *end )
+{
+  uintptr_t word;
+
+  while ( ( end - p ) >= ( ptrdiff_t ) sizeof( word ) )
+  {
+    memcpy( &word, p, sizeof( word ) );
+    if ( HAS_ZERO( word ) )
+      break;
+    p += sizeof( word );
+  }
+  while ( ( p < end ) && *p )
+    p++;
+
+  return p;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Pick the best XOR on first use and run it.
+ */
+static uint8_t copyXorDispatch( uint8_t *dst, const uint8_t *src,
+                                uint32_t len )
+{
+  pickSimd();
+  return copyXor( dst, src, len );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Portable copy and XOR, four 64-bit words at a time. Compilers turn
+ *        it into SSE2 on x86-64.
+ */
+static uint8_t copyXorWord( uint8_t *dst, const uint8_t *src, uint32_t len )
+{
+  uint64_t word[ 4 ];
+  uint64_t acc[ 4 ] = { 0, 0, 0, 0 };
+  uint8_t  xor      = 0;
+
+  while ( len >= sizeof( word ) )
+  {
+    memcpy( word, src, sizeof( word ) );
+    if ( dst )
+    {
+      memcpy( dst, word, sizeof( word ) );
+      dst += sizeof( word );
+    }
+    acc[ 0 ] ^= word[ 0 ];
+    acc[ 1 ] ^= word[ 1 ];
+    acc[ 2 ] ^= word[ 2 ];
+    acc[ 3 ] ^= word[ 3 ];
+    src += sizeof( word );
+    len -= sizeof( word );
+  }
+
+  /* Fold the accumulators into a byte */
+  acc[ 0 ] ^= acc[ 1 ] ^ acc[ 2 ] ^ acc[ 3 ];
+  acc[ 0 ] ^= acc[ 0 ] >> 32;
+  acc[ 0 ] ^= acc[ 0 ] >> 16;
+  acc[ 0 ] ^= acc[ 0 ] >> 8;
+  xor = acc[ 0 ];
+
+  while ( len-- )
+  {
+    if ( dst )
+      *dst++ = *src;
+    xor ^= *src++;
+  }
+
+  return xor;
+}
+
+#ifdef COBS_SIMD_X86
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief SSE2 zero scanner, 16 bytes at a time.
+ */
+__attribute__( ( target( "sse2" ) ) ) static const uint8_t *
+findZeroSse2( const uint8_t *p, const uint8_t *end )
+{
+  const __m128i zero = _mm_setzero_si128();
+  int           mask;
+
+  while ( ( end - p ) >= 16 )
+  {
+    mask = _mm_movemask_epi8(
+      _mm_cmpeq_epi8( _mm_loadu_si128( ( const __m128i * ) p ), zero ) );
+    if ( mask )
+      return p + __builtin_ctz( mask );
+    p += 16;
+  }
+
+  return findZeroWord( p, end );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief AVX2 zero scanner, 32 bytes at a time.
+ */
+__attribute__( ( target( "avx2" ) ) ) static const uint8_t *
+findZeroAvx2( const uint8_t *p, const uint8_t *end )
+{
+  const __m256i zero = _mm256_setzero_si256();
+  int           mask;
+
+  while ( ( end - p ) >= 32 )
+  {
+    mask = _mm256_movemask_epi8(
+      _mm256_cmpeq_epi8( _mm256_loadu_si256( ( const __m256i * ) p ), zero ) );
+    if ( mask )
+    {
+      _mm256_zeroupper();
+      return p + __builtin_ctz( mask );
+    }
+    p += 32;
+  }
+
+  /* Leaving dirty upper halves would stall the SSE code that follows */
+  _mm256_zeroupper();
+  return findZeroSse2( p, end );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief AVX2 copy and XOR, 64 bytes at a time.
+ */
+__attribute__( ( target( "avx2" ) ) ) static uint8_t
+copyXorAvx2( uint8_t *dst, const uint8_t *src, uint32_t len )
+{
+  __m256i  acc0 = _mm256_setzero_si256();
+  __m256i  acc1 = _mm256_setzero_si256();
+  __m256i  in0;
+  __m256i  in1;
+  uint64_t word[ 4 ];
+  uint8_t  xor;
+
+  while ( len >= 64 )
+  {
+    in0 = _mm256_loadu_si256( ( const __m256i * ) src );
+    in1 = _mm256_loadu_si256( ( const __m256i * ) ( src + 32 ) );
+    if ( dst )
+    {
+      _mm256_storeu_si256( ( __m256i * ) dst, in0 );
+      _mm256_storeu_si256( ( __m256i * ) ( dst + 32 ), in1 );
+      dst += 64;
+    }
+    acc0 = _mm256_xor_si256( acc0, in0 );
+    acc1 = _mm256_xor_si256( acc1, in1 );
+    src += 64;
+    len -= 64;
+  }
+
+  /* The tail is XORed with the folded accumulators */
+  _mm256_storeu_si256( ( __m256i * ) word, _mm256_xor_si256( acc0, acc1 ) );
+  _mm256_zeroupper();
+  xor = copyXorWord( dst, src, len );
+  xor ^= copyXorWord( NULL, ( const uint8_t * ) word, sizeof( word ) );
+
+  return xor;
+}
+#endif /* COBS_SIMD_X86 */
+
 #endif /* !COBS_C_SRC */
 
 /****************************************************************************
@@ -28,183 +28,475 @@
 **                                                                         **
 ****************************************************************************/
 
-static kbi_socket_t *findSocket( uint16_t locPort );
+static kbi_socket_t *findSocket( kbi_dev_t *dev, uint16_t locPort );
 
-/****************************************************************************
-**                                                                         **
-**                           EXPORTED VARIABLES                            **
-**                                                                         **
-****************************************************************************/
+static uint16_t sockBucket( kbi_dev_t *dev, uint16_t locPort );
+
+static kbi_socket_t *sockInsert( kbi_dev_t *dev, uint16_t locPort );
+
+static void sockRelease( kbi_dev_t *dev, kbi_socket_t *sock );
+
+static void hdrPorts( kbi_sendHdr_t *hdr, uint16_t locPort, uint16_t peerPort );
+
+static void hdrAddr( kbi_sendHdr_t *hdr, uint16_t locPort, uint16_t peerPort,
+                     const struct in6_addr *addr );
+
+static void hdrName( kbi_sendHdr_t *hdr, uint16_t locPort, uint16_t peerPort,
+                     const char *name );
+
+static void sockSend( kbi_dev_t *dev, const kbi_sendHdr_t *hdr, uint8_t *pld,
+                      uint16_t pldLen );
+
+static void ntfCb( cmds_t *cmds );
+
+static void ntfFrame( kbi_dev_t *dev, cmds_buffer_t *buf );
+
+static int16_t recvRsp( kbi_dev_t *dev, uint64_t deadlineUs );
+
+static _Bool cmdTry( kbi_dev_t *dev, uint8_t fc, uint8_t cmd,
+                     uint64_t deadlineUs );
+
+static _Bool cmdRetry( kbi_dev_t *dev, uint8_t fc, uint8_t cmd,
+                       const kbi_sendHdr_t *hdr, const struct iovec *iov,
+                       uint8_t iovCnt, uint16_t toutMs );
+
+static _Bool cmdAside( kbi_dev_t *dev, uint8_t fc, uint8_t cmd,
+                       const kbi_sendHdr_t *hdr, const struct iovec *iov,
+                       uint8_t iovCnt, uint16_t toutMs );
+
+static uint16_t cmdFill( kbi_dev_t *dev, const kbi_sendHdr_t *hdr,
+                         const struct iovec *iov, uint8_t iovCnt,
+                         uint8_t *pldCks );
+
+static _Bool cmdWait( kbi_dev_t *dev, uint8_t cmd, uint64_t deadlineUs );
+
+static _Bool pollUntil( kbi_dev_t *dev, uint8_t cmd, uint8_t *pld,
+                        uint16_t len, uint64_t deadlineUs );
+
+static _Bool pollBusy( kbi_dev_t *dev, uint8_t cmd, uint16_t len );
+
+static _Bool queueInit( kbi_queue_t *q );
+
+static void queueFree( kbi_queue_t *q );
+
+static cmds_buffer_t *queueTail( kbi_queue_t *q );
+
+static void queuePush( kbi_queue_t *q );
+
+static cmds_buffer_t *queueWait( kbi_queue_t *q, uint64_t deadlineUs );
+
+static void queuePop( kbi_queue_t *q );
+
+static void *rxReader( void *arg );
+
+static void *rxWorker( void *arg );
+
+static void pipeStep( kbi_dev_t *dev );
+
+static void pipeDrain( kbi_dev_t *dev );
+
+static uint64_t pipeDeadline( kbi_dev_t *dev );
+
+static void pipeMatch( kbi_dev_t *dev );
+
+static void pipeExpire( kbi_dev_t *dev );
+
+static kbi_req_t *pipeTake( kbi_dev_t *dev, uint8_t fc, uint8_t cmd,
+                            kbi_done_t done, void *ctx );
+
+static void pipeSend( kbi_dev_t *dev, kbi_req_t *req, uint64_t now );
+
+static void pipeComplete( kbi_dev_t *dev, kbi_req_t *req, _Bool ok );
 
 /****************************************************************************
 **                                                                         **
-**                            GLOBAL VARIABLES                             **
+**                           EXPORTED VARIABLES                            **
 **                                                                         **
 ****************************************************************************/
 
-/* List of device's sockets */
-kbi_socket_t kbi_sockets[ KBI_MAX_SOCKETS ];
-
 /****************************************************************************
 **                                                                         **
 **                           EXPORTED FUNCTIONS                            **
 **                                                                         **
 ****************************************************************************/
 
-_Bool kbi_init( char *device )
+_Bool kbi_init( kbi_dev_t *dev, char *device )
 {
-  uint8_t status;
-  status = uart_init( device, KBI_PORT_TOUT_MS );
-  if ( status )
-    memset( kbi_sockets, 0, sizeof( kbi_sockets ) );
+  uint32_t baud = KBI_UART_BAUD ? KBI_UART_BAUD : UART_BAUD_DEFAULT;
+  uint8_t  status;
+
+  memset( dev, 0, sizeof( kbi_dev_t ) );
+  if ( !kbi_setMaxSockets( dev, KBI_MAX_SOCKETS ) )
+    return 0;
+  status = uart_init( &dev->cmds.uart, device, baud, KBI_UART_FLOWCTRL,
+                      KBI_PORT_TOUT_MS );
+  dev->baud = baud;
+  if ( status && !KBI_UART_BAUD && !( dev->baud = kbi_probeBaud( dev ) ) )
+  {
+    uart_close( &dev->cmds.uart );
+    status = 0;
+  }
+  if ( !status )
+    kbi_finish( dev );
   return status;
 }
 
 /***************************************************************************/
 /***************************************************************************/
-void kbi_finish( void ) { uart_close(); }
+uint32_t kbi_probeBaud( kbi_dev_t *dev )
+{
+  static const uint32_t rates[] = { KBI_PROBE_RATES };
+  uint8_t               i;
+
+  for ( i = 0; i < sizeof( rates ) / sizeof( rates[ 0 ] ); i++ )
+  {
+    if ( !uart_setBaud( &dev->cmds.uart, rates[ i ], KBI_UART_FLOWCTRL ) )
+      continue;
+
+    /* A single try per rate, garbage is all that comes at a wrong one */
+    cmds_send( &dev->cmds, CMDS_FTCMD | CMDS_FCCMD_READ, CMDS_CMD_UPTIME, NULL,
+               0 );
+    if ( ( cmds_recv( &dev->cmds, NULL ) > 0 ) &&
+         ( ( dev->cmds.rxBuf.frame_s.typ & 0xF0 ) == CMDS_FTRSP ) &&
+         ( dev->cmds.rxBuf.frame_s.cmd == CMDS_CMD_UPTIME ) )
+      return rates[ i ];
+  }
+
+  return 0;
+}
 
 /***************************************************************************/
 /***************************************************************************/
-_Bool kbi_cmd( uint8_t fc, uint8_t cmd, uint8_t *pld, uint16_t pldLen )
+_Bool kbi_setBaud( kbi_dev_t *dev, uint32_t baud )
 {
-  uint8_t retries = KBI_CMD_RETRIES;
-  while ( retries )
+  uint32_t        baudBe = htobe32( baud );
+  uint64_t        grace;
+  uint64_t        now;
+  struct timespec ts;
+
+  if ( ( KBI_CMD_BAUD < 0 ) || ( baud == dev->baud ) )
+    return ( baud == dev->baud );
+
+  /* The device answers at the current rate before switching */
+  if ( !kbi_cmd( dev, CMDS_FCCMD_WRITE, ( uint8_t ) KBI_CMD_BAUD,
+                 ( uint8_t * ) &baudBe, 4 ) )
+    return 0;
+  grace = uart_nowUs() + ( uint64_t ) KBI_BAUD_GRACE_MS * 1000;
+  if ( uart_setBaud( &dev->cmds.uart, baud, KBI_UART_FLOWCTRL ) &&
+       kbi_cmdTout( dev, CMDS_FCCMD_READ, CMDS_CMD_UPTIME, NULL, 0,
+                    KBI_BAUD_PROBE_MS ) )
   {
-    cmds_send( CMDS_FTCMD | fc, cmd, pld, pldLen );
-    if ( cmds_recv( kbi_ntf ) > 0 )
-    {
-      /* Find matching response */
-      if ( ( cmds_rx_buf.frame_s.typ & CMDS_FTRSP ) &&
-           ( cmds_rx_buf.frame_s.cmd == cmd ) )
-      {
-        /* Processes that always have a minumum duration */
-        switch ( cmd )
-        {
-        case CMDS_CMD_CLEAR:
-          sleep( 1 );
-          break;
-        case CMDS_CMD_IFUP:
-          sleep( 5 );
-          break;
-        }
-        return 1;
-      }
-    }
-    retries--;
+    dev->baud = baud;
+    return 1;
+  }
+
+  /* Nothing valid got through, the device goes back on its own */
+  now = uart_nowUs();
+  if ( grace > now )
+  {
+    ts.tv_sec  = ( grace - now ) / 1000000;
+    ts.tv_nsec = ( grace - now ) % 1000000 * 1000;
+    nanosleep( &ts, NULL );
   }
+  uart_setBaud( &dev->cmds.uart, dev->baud, KBI_UART_FLOWCTRL );
   return 0;
 }
 
 /***************************************************************************/
 /***************************************************************************/
-void kbi_ntf( void )
+_Bool kbi_setMaxSockets( kbi_dev_t *dev, uint16_t max )
 {
-  kbi_socket_t *  sock;
-  uint8_t         fc = cmds_rx_buf.frame_s.typ & 0x0F;
-  struct in6_addr addr;
-  char            addrStr[ INET6_ADDRSTRLEN ];
-  char            domain[ 32 ] = "";
-  uint16_t        pos          = 0;
-  uint16_t        dec1, dec2, dec3;
-  _Bool           cond1, cond2;
-  uint16_t        udpLen;
+  kbi_socket_t *old     = dev->sockets;
+  uint16_t *    oldHash = dev->sockHash;
+  uint16_t      oldMax  = dev->sockMax;
+  kbi_socket_t *sock;
+  uint16_t      open = 0;
+  uint16_t      i;
+  uint8_t       bits = 0;
 
-  switch ( fc )
+  for ( i = 0; i < oldMax; i++ )
   {
-  /* Ping reply reception */
-  case CMDS_FCNTF_NPINGREPLY:
-    memcpy( domain, cmds_rx_buf.frame_s.pld + pos, 32 );
-    pos += 32;
-  case CMDS_FCNTF_PINGREPLY:
-    memcpy( addr.s6_addr, cmds_rx_buf.frame_s.pld + pos, 16 );
-    pos += 16;
-    memcpy( &dec1, cmds_rx_buf.frame_s.pld + pos, 2 );
-    pos += 2;
-    memcpy( &dec2, cmds_rx_buf.frame_s.pld + pos, 2 );
-    pos += 2;
-    memcpy( &dec3, cmds_rx_buf.frame_s.pld + pos, 2 );
-    inet_ntop( AF_INET6, addr.s6_addr, addrStr, INET6_ADDRSTRLEN );
-    dec1 = be16toh( dec1 );
-    dec2 = be16toh( dec2 );
-    dec3 = be16toh( dec3 );
-    printf( "ping reply: saddr %s [%s] id %u sq %u - %u bytes\n", addrStr,
-            domain, dec3, dec1, dec2 );
-    break;
+    if ( old[ i ].locPort )
+      open++;
+  }
+  if ( !max || ( max < open ) )
+    return 0;
 
-  /* UDP traffic reception */
-  case CMDS_FCNTF_SOCKRECV:
-  case CMDS_FCNTF_NSOCKRECV:
-    memcpy( &dec1, cmds_rx_buf.frame_s.pld + pos, 2 );
-    pos += 2;
-    memcpy( &dec2, cmds_rx_buf.frame_s.pld + pos, 2 );
-    pos += 2;
-    if ( fc == CMDS_FCNTF_NSOCKRECV )
-    {
-      memcpy( domain, cmds_rx_buf.frame_s.pld + pos, 32 );
-      pos += 32;
-    }
-    memcpy( addr.s6_addr, cmds_rx_buf.frame_s.pld + pos, 16 );
-    pos += 16;
-    udpLen = be16toh( cmds_rx_buf.frame_s.len ) - pos;
-    inet_ntop( AF_INET6, addr.s6_addr, addrStr, INET6_ADDRSTRLEN );
-    dec1 = be16toh( dec1 );
-    dec2 = be16toh( dec2 );
-    printf( "udp rcv: saddr %s [%s] sport %u dport %u - %u bytes\n", addrStr,
-            domain, dec2, dec1, udpLen );
-    /* Find a socket listening to this port */
-    if ( !( sock = findSocket( dec1 ) ) )
-      break;
-    cond1 = !memcmp( sock->peerName, addrStr, strlen( sock->peerName ) );
-    cond2 = ( sock->peerPort == 0 || sock->peerPort == dec2 );
-    if ( cond1 && cond2 )
-    {
-      sock->handler( dec1, dec2, addrStr, cmds_rx_buf.frame_s.pld + pos,
-                     udpLen );
-    }
-    break;
+  /* At least a bucket per socket, so chains are one socket long on average */
+  while ( ( 1u << bits ) < max )
+    bits++;
+  dev->sockets  = calloc( max, sizeof( kbi_socket_t ) );
+  dev->sockHash = calloc( 1u << bits, sizeof( uint16_t ) );
+  if ( !dev->sockets || !dev->sockHash )
+  {
+    free( dev->sockets );
+    free( dev->sockHash );
+    dev->sockets  = old;
+    dev->sockHash = oldHash;
+    return 0;
+  }
+  dev->sockMax      = max;
+  dev->sockHashBits = bits;
 
-  /* Destination unreachable */
-  case CMDS_FCNTF_DSTUNREACH:
-    memcpy( addr.s6_addr, cmds_rx_buf.frame_s.pld, 16 );
-    inet_ntop( AF_INET6, addr.s6_addr, addrStr, INET6_ADDRSTRLEN );
-    printf( "dst unreachable: daddr %s\n", addrStr );
-    break;
+  /* Every socket is free, then the open ones are taken again */
+  for ( i = 0; i < max; i++ )
+    dev->sockets[ i ].next = ( i + 1 < max ) ? i + 2 : 0;
+  dev->sockFree = 1;
+  for ( i = 0; i < oldMax; i++ )
+  {
+    if ( !old[ i ].locPort )
+      continue;
+    sock          = sockInsert( dev, old[ i ].locPort );
+    old[ i ].next = sock->next;
+    *sock         = old[ i ];
+  }
+  free( old );
+  free( oldHash );
+  return 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+void kbi_finish( kbi_dev_t *dev )
+{
+  kbi_rxStop( dev );
+  uart_close( &dev->cmds.uart );
+  free( dev->sockets );
+  free( dev->sockHash );
+  dev->sockets  = NULL;
+  dev->sockHash = NULL;
+  dev->sockMax  = 0;
+  dev->sockFree = 0;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+_Bool kbi_cmd( kbi_dev_t *dev, uint8_t fc, uint8_t cmd, uint8_t *pld,
+               uint16_t pldLen )
+{
+  return kbi_cmdTout( dev, fc, cmd, pld, pldLen, KBI_PORT_TOUT_MS );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+_Bool kbi_cmdTout( kbi_dev_t *dev, uint8_t fc, uint8_t cmd, uint8_t *pld,
+                   uint16_t pldLen, uint16_t toutMs )
+{
+  struct iovec iov = { pld, pldLen };
+
+  return kbi_cmdv( dev, fc, cmd, &iov, 1, toutMs );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+_Bool kbi_cmdv( kbi_dev_t *dev, uint8_t fc, uint8_t cmd,
+                const struct iovec *iov, uint8_t iovCnt, uint16_t toutMs )
+{
+  cmds_buffer_t rsp;
+  uint16_t      rspLen;
+
+  /* Responses to pipelined commands would be taken as stray frames */
+  pipeDrain( dev );
+
+  if ( !cmdRetry( dev, fc, cmd, NULL, iov, iovCnt, toutMs ) )
+    return 0;
+
+  /* Processes the device keeps busy with after answering, the response is
+     kept for the caller */
+  if ( ( cmd == CMDS_CMD_CLEAR ) || ( cmd == CMDS_CMD_IFUP ) )
+  {
+    rspLen = CMDS_FRAME_HEADER_LEN + be16toh( dev->cmds.rxBuf.frame_s.len );
+    memcpy( rsp.frame_a, dev->cmds.rxBuf.frame_a, rspLen );
+    pollUntil( dev, CMDS_CMD_STATUS, NULL, 0,
+               uart_nowUs() + ( uint64_t ) KBI_READY_TOUT_MS * 1000 );
+    memcpy( dev->cmds.rxBuf.frame_a, rsp.frame_a, rspLen );
   }
+  return 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+void kbi_pipeCmd( kbi_dev_t *dev, uint8_t fc, uint8_t cmd, uint8_t *pld,
+                  uint16_t pldLen, kbi_done_t done, void *ctx )
+{
+  while ( !kbi_cmdAsync( dev, fc, cmd, pld, pldLen, done, ctx ) )
+    pipeStep( dev );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+_Bool kbi_cmdAsync( kbi_dev_t *dev, uint8_t fc, uint8_t cmd, uint8_t *pld,
+                    uint16_t pldLen, kbi_done_t done, void *ctx )
+{
+  kbi_req_t *req;
+
+  if ( !( req = pipeTake( dev, fc, cmd, done, ctx ) ) )
+    return 0;
+  if ( pldLen > CMDS_FRAME_PAYLOAD_MAX_LEN )
+    pldLen = CMDS_FRAME_PAYLOAD_MAX_LEN;
+
+  req->pldLen = pldLen;
+  memcpy( req->pld, pld, pldLen );
+  pipeSend( dev, req, uart_nowUs() );
+
+  return 1;
 }
 
 /***************************************************************************/
 /***************************************************************************/
-_Bool kbi_waitFor( uint8_t cmd, uint8_t *pld, uint16_t len, uint16_t tout )
+int kbi_fd( kbi_dev_t *dev ) { return dev->cmds.uart.fd; }
+
+/***************************************************************************/
+/***************************************************************************/
+void kbi_process( kbi_dev_t *dev )
 {
-  time_t end = time( NULL ) + tout;
-  while ( time( NULL ) < end )
+  int16_t result;
+
+  while ( ( result = cmds_recvNow( &dev->cmds, ntfCb ) ) !=
+          COBS_RESULT_TIMEOUT )
   {
-    if ( kbi_cmd( CMDS_FCCMD_READ, cmd, NULL, 0 ) )
-    {
-      if ( cmds_rx_buf.frame_s.len >= len )
-      {
-        if ( memcmp( pld, cmds_rx_buf.frame_s.pld, len ) == 0 )
-          return 1;
-      }
-    }
-    sleep( 1 );
+    if ( ( result > 0 ) && dev->pipeCnt )
+      pipeMatch( dev );
   }
-  return 0;
+  pipeExpire( dev );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+int32_t kbi_nextTimeout( kbi_dev_t *dev )
+{
+  uint64_t deadline = pipeDeadline( dev );
+  uint64_t now;
+
+  if ( deadline == UINT64_MAX )
+    return -1;
+  now = uart_nowUs();
+  return ( deadline > now ) ? ( deadline - now + 999 ) / 1000 : 0;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+_Bool kbi_pipeWait( kbi_dev_t *dev )
+{
+  _Bool ok;
+
+  pipeDrain( dev );
+  ok              = ( dev->pipeErrors == 0 );
+  dev->pipeErrors = 0;
+  return ok;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+_Bool kbi_rxStart( kbi_dev_t *dev )
+{
+  kbi_rx_t *rx = &dev->rx;
+
+  if ( rx->run || ( dev->cmds.uart.fd == -1 ) )
+    return 0;
+  if ( !queueInit( &rx->rsp ) )
+    return 0;
+  if ( !queueInit( &rx->ntf ) )
+  {
+    queueFree( &rx->rsp );
+    return 0;
+  }
+
+  /* Frames are written by the sending thread, the reader never flushes */
+  uart_setCoalesce( &dev->cmds.uart, 0 );
+  atomic_store( &rx->dropped, 0 );
+  atomic_store( &rx->run, 1 );
+  if ( pthread_create( &rx->reader, NULL, rxReader, dev ) )
+  {
+    atomic_store( &rx->run, 0 );
+    queueFree( &rx->rsp );
+    queueFree( &rx->ntf );
+    return 0;
+  }
+  if ( pthread_create( &rx->worker, NULL, rxWorker, dev ) )
+  {
+    atomic_store( &rx->run, 0 );
+    pthread_join( rx->reader, NULL );
+    queueFree( &rx->rsp );
+    queueFree( &rx->ntf );
+    return 0;
+  }
+  return 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+void kbi_rxStop( kbi_dev_t *dev )
+{
+  kbi_rx_t *rx = &dev->rx;
+
+  if ( !atomic_exchange( &rx->run, 0 ) )
+    return;
+
+  /* Both threads wait for KBI_RX_POLL_MS at most */
+  pthread_join( rx->reader, NULL );
+  pthread_join( rx->worker, NULL );
+  queueFree( &rx->rsp );
+  queueFree( &rx->ntf );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+int16_t kbi_recv( kbi_dev_t *dev )
+{
+  int16_t result = recvRsp(
+    dev, uart_nowUs() + uart_getTimeout( &dev->cmds.uart ) * 1000 );
+
+  if ( dev->pipeCnt )
+  {
+    if ( result > 0 )
+      pipeMatch( dev );
+    pipeExpire( dev );
+  }
+  return result;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+void kbi_ntf( kbi_dev_t *dev ) { ntfFrame( dev, &dev->cmds.rxBuf ); }
+
+/***************************************************************************/
+/***************************************************************************/
+_Bool kbi_waitFor( kbi_dev_t *dev, uint8_t cmd, uint8_t *pld, uint16_t len,
+                   uint16_t tout )
+{
+  /* Responses to pipelined commands would be taken as stray frames */
+  pipeDrain( dev );
+
+  return pollUntil( dev, cmd, pld, len,
+                    uart_nowUs() + ( uint64_t ) tout * 1000000 );
 }
 
 /***************************************************************************/
 /***************************************************************************/
-uint16_t kbi_socketConnect( uint16_t locPort, uint16_t peerPort, char *peerName,
+uint16_t kbi_socketConnect( kbi_dev_t *dev, uint16_t locPort,
+                            uint16_t peerPort, char *peerName,
                             kbi_handler_t handler )
 {
-  kbi_socket_t *sock;
-  uint8_t       pld[ 2 ];
-  uint16_t      pldLen = 0;
-  uint16_t      port;
+  kbi_socket_t *  sock;
+  struct in6_addr addr;
+  uint8_t         pld[ 2 ];
+  uint16_t        pldLen = 0;
+  uint16_t        port;
+  uint8_t         peer;
+
+  /* Make sure a socket struct is free */
+  if ( !dev->sockFree )
+    return 0;
 
-  /* Find a free socket struct */
-  if ( !( sock = findSocket( 0 ) ) )
+  /* Parse the peer, names the socket can't keep terminated are rejected */
+  if ( !*peerName )
+    peer = KBI_PEER_ANY;
+  else if ( inet_pton( AF_INET6, peerName, &addr ) == 1 )
+    peer = KBI_PEER_ADDR;
+  else if ( strlen( peerName ) < sizeof( sock->peerName ) )
+    peer = KBI_PEER_NAME;
+  else
     return 0;
 
   /* Open socket in the module */
@@ -214,120 +506,1020 @@ uint16_t kbi_socketConnect( uint16_t locPort, uint16_t peerPort, char *peerName,
     port   = htobe16( locPort );
     memcpy( pld, &port, 2 );
   }
-  if ( !kbi_cmd( CMDS_FCCMD_WRITE, CMDS_CMD_SOCKET_OPEN_CLOSE, pld, pldLen ) ||
-       ( cmds_rx_buf.frame_s.typ != ( CMDS_FTRSP | CMDS_FCRSP_VALUE ) ) )
+  if ( !kbi_cmd( dev, CMDS_FCCMD_WRITE, CMDS_CMD_SOCKET_OPEN_CLOSE, pld,
+                 pldLen ) ||
+       ( dev->cmds.rxBuf.frame_s.typ != ( CMDS_FTRSP | CMDS_FCRSP_VALUE ) ) )
     return 0;
 
   /* Get the received port */
-  memcpy( &port, cmds_rx_buf.frame_s.pld, 2 );
+  memcpy( &port, dev->cmds.rxBuf.frame_s.pld, 2 );
   port = be16toh( port );
 
-  /* Save the socket struct */
-  sock->locPort  = port;
+  /* Save the socket struct, the device may give a port already open back */
+  if ( !( sock = findSocket( dev, port ) ) )
+    sock = sockInsert( dev, port );
   sock->peerPort = peerPort;
-  memcpy( sock->peerName, peerName, strlen( peerName ) );
-  sock->handler = handler;
+  sock->handler  = handler;
+  sock->peer     = peer;
+  if ( peer == KBI_PEER_ADDR )
+    sock->peerAddr = addr;
+  else if ( peer == KBI_PEER_NAME )
+    strcpy( sock->peerName, peerName );
+
+  /* Every send to the peer starts with the same header */
+  if ( sock->peer == KBI_PEER_ADDR )
+    hdrAddr( &sock->dst, port, peerPort, &sock->peerAddr );
+  else if ( sock->peer == KBI_PEER_NAME )
+    hdrName( &sock->dst, port, peerPort, sock->peerName );
 
   return port;
 }
 
 /***************************************************************************/
 /***************************************************************************/
-uint16_t kbi_socketBind( uint16_t locPort, kbi_handler_t handler )
+uint16_t kbi_socketBind( kbi_dev_t *dev, uint16_t locPort,
+                         kbi_handler_t handler )
 {
-  return kbi_socketConnect( locPort, 0, "", handler );
+  return kbi_socketConnect( dev, locPort, 0, "", handler );
 }
 
 /***************************************************************************/
 /***************************************************************************/
-void kbi_socketSend( uint16_t locPort, uint16_t peerPort, char *peerName,
-                     uint8_t *pld, uint16_t pldLen )
+void kbi_socketSend( kbi_dev_t *dev, uint16_t locPort, uint16_t peerPort,
+                     char *peerName, uint8_t *pld, uint16_t pldLen )
 {
-  kbi_socket_t *sock;
-  uint16_t      pos = 0;
-  uint16_t      port;
-  char *        name;
-  uint8_t       cmd;
-  uint8_t       cmdPld[ CMDS_FRAME_PAYLOAD_MAX_LEN ]; // Careful, it's big!
+  kbi_socket_t *  sock;
+  kbi_sendHdr_t   hdr;
+  struct in6_addr addr;
 
   /* See if the socket is open */
-  if ( !( sock = findSocket( locPort ) ) )
+  if ( !( sock = findSocket( dev, locPort ) ) )
     return;
 
-  /* Set the local port */
-  port = htobe16( locPort );
-  memcpy( &cmdPld[ pos ], &port, 2 );
-  pos += 2;
-
-  /* If peerName not set, use the socket's one */
-  if ( peerName )
-  {
-    name = peerName;
-    port = htobe16( peerPort );
-  }
-  else
+  /* If peerName not set, use the socket's header, already built */
+  if ( !peerName || !*peerName )
   {
-    name = sock->peerName;
-    port = htobe16( sock->peerPort );
+    if ( sock->peer != KBI_PEER_ANY )
+      sockSend( dev, &sock->dst, pld, pldLen );
+    return;
   }
 
-  /* Set the peer's port */
-  memcpy( &cmdPld[ pos ], &port, 2 );
-  pos += 2;
-
   /* Address destination */
-  if ( inet_pton( AF_INET6, name, &cmdPld[ pos ] ) )
-  {
-    pos += 16;
-    cmd = CMDS_CMD_SOCKET_SEND;
-  }
-  /* Domain destiantion */
+  if ( inet_pton( AF_INET6, peerName, &addr ) == 1 )
+    hdrAddr( &hdr, locPort, peerPort, &addr );
+  /* Domain destination */
   else
-  {
-    strcpy( &cmdPld[ pos ], name );
-    pos += 32;
-    cmd = CMDS_CMD_NAMED_SOCKET_SEND;
-  }
-
-  /* Set the payload */
-  memcpy( &cmdPld[ pos ], pld, pldLen );
-  pos += pldLen;
-
-  /* Send the traffic */
-  kbi_cmd( CMDS_FCCMD_WRITE, cmd, cmdPld, pos );
+    hdrName( &hdr, locPort, peerPort, peerName );
+  sockSend( dev, &hdr, pld, pldLen );
 }
 
 /***************************************************************************/
 /***************************************************************************/
-void kbi_socketClose( uint16_t locPort )
+void kbi_socketSendAddr( kbi_dev_t *dev, uint16_t locPort, uint16_t peerPort,
+                         const struct in6_addr *peerAddr, uint8_t *pld,
+                         uint16_t pldLen )
 {
-  uint8_t  pld[ 2 ];
-  uint16_t port;
+  kbi_sendHdr_t hdr;
 
   /* See if the socket is open */
-  if ( !findSocket( locPort ) )
+  if ( !findSocket( dev, locPort ) )
     return;
 
-  /* Send the command */
-  port = htobe16( locPort );
-  memcpy( pld, &port, 2 );
-  kbi_cmd( CMDS_FCCMD_DELETE, CMDS_CMD_SOCKET_OPEN_CLOSE, pld, 2 );
+  hdrAddr( &hdr, locPort, peerPort, peerAddr );
+  sockSend( dev, &hdr, pld, pldLen );
 }
 
-/****************************************************************************
-**                                                                         **
-**                             LOCAL FUNCTIONS                             **
-**                                                                         **
-****************************************************************************/
+/***************************************************************************/
+/***************************************************************************/
+_Bool kbi_socketSendAsync( kbi_dev_t *dev, uint16_t locPort,
+                           uint16_t peerPort, const struct in6_addr *peerAddr,
+                           uint8_t *pld, uint16_t pldLen, kbi_done_t done,
+                           void *ctx )
+{
+  kbi_socket_t *       sock;
+  kbi_sendHdr_t        hdr;
+  const kbi_sendHdr_t *dst = &hdr;
+  kbi_req_t *          req;
 
-static kbi_socket_t *findSocket( uint16_t locPort )
+  /* See if the socket is open and has somewhere to send to */
+  if ( !( sock = findSocket( dev, locPort ) ) )
+    return 0;
+  if ( peerAddr )
+    hdrAddr( &hdr, locPort, peerPort, peerAddr );
+  else if ( sock->peer != KBI_PEER_ANY )
+    dst = &sock->dst;
+  else
+    return 0;
+
+  if ( !( req = pipeTake( dev, CMDS_FCCMD_WRITE, dst->cmd, done, ctx ) ) )
+    return 0;
+  if ( pldLen > CMDS_FRAME_PAYLOAD_MAX_LEN - dst->len )
+    pldLen = CMDS_FRAME_PAYLOAD_MAX_LEN - dst->len;
+
+  req->pldLen = dst->len + pldLen;
+  memcpy( req->pld, dst->data, dst->len );
+  memcpy( req->pld + dst->len, pld, pldLen );
+  pipeSend( dev, req, uart_nowUs() );
+
+  return 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+void kbi_socketClose( kbi_dev_t *dev, uint16_t locPort )
+{
+  kbi_socket_t *sock;
+  uint8_t       pld[ 2 ];
+  uint16_t      port;
+
+  /* See if the socket is open */
+  if ( !( sock = findSocket( dev, locPort ) ) )
+    return;
+
+  /* Send the command, traffic to the port is not wanted anymore anyway */
+  port = htobe16( locPort );
+  memcpy( pld, &port, 2 );
+  kbi_cmd( dev, CMDS_FCCMD_DELETE, CMDS_CMD_SOCKET_OPEN_CLOSE, pld, 2 );
+  sockRelease( dev, sock );
+}
+
+/****************************************************************************
+**                                                                         **
+**                             LOCAL FUNCTIONS                             **
+**                                                                         **
+****************************************************************************/
+
+/**
+ * @brief Find the open socket with a local port in its bucket.
+ *
+ * @return        Socket, NULL if the port is not open.
+ */
+static kbi_socket_t *findSocket( kbi_dev_t *dev, uint16_t locPort )
+{
+  kbi_socket_t *sock;
+  uint16_t      i;
+
+  if ( !locPort || !dev->sockHash )
+    return NULL;
+
+  for ( i = dev->sockHash[ sockBucket( dev, locPort ) ]; i; i = sock->next )
+  {
+    sock = &dev->sockets[ i - 1 ];
+    if ( sock->locPort == locPort )
+      return sock;
+  }
+  return NULL;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Get the bucket of a local port, by multiplicative hashing so that
+ *        consecutive ports are spread.
+ */
+static uint16_t sockBucket( kbi_dev_t *dev, uint16_t locPort )
+{
+  return ( uint16_t )( locPort * 40503u ) >> ( 16 - dev->sockHashBits );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Take a socket from the free list and add it to its port bucket.
+ *        There must be a free one.
+ */
+static kbi_socket_t *sockInsert( kbi_dev_t *dev, uint16_t locPort )
+{
+  uint16_t      i    = dev->sockFree;
+  kbi_socket_t *sock = &dev->sockets[ i - 1 ];
+  uint16_t *    head = &dev->sockHash[ sockBucket( dev, locPort ) ];
+
+  dev->sockFree = sock->next;
+  memset( sock, 0, sizeof( kbi_socket_t ) );
+  sock->locPort = locPort;
+  sock->next    = *head;
+  *head         = i;
+  return sock;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Remove an open socket from its port bucket and free it.
+ */
+static void sockRelease( kbi_dev_t *dev, kbi_socket_t *sock )
+{
+  uint16_t  i    = sock - dev->sockets + 1;
+  uint16_t *link = &dev->sockHash[ sockBucket( dev, sock->locPort ) ];
+
+  while ( *link != i )
+    link = &dev->sockets[ *link - 1 ].next;
+  *link         = sock->next;
+  sock->locPort = 0;
+  sock->next    = dev->sockFree;
+  dev->sockFree = i;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Set the local and peer's ports of a send command payload header.
+ */
+static void hdrPorts( kbi_sendHdr_t *hdr, uint16_t locPort, uint16_t peerPort )
+{
+  uint16_t port;
+
+  port = htobe16( locPort );
+  memcpy( &hdr->data[ 0 ], &port, 2 );
+  port = htobe16( peerPort );
+  memcpy( &hdr->data[ 2 ], &port, 2 );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Build the send command payload header to an address, and its XOR.
+ *
+ * @param[in]      addr:  Destination address.
+ */
+static void hdrAddr( kbi_sendHdr_t *hdr, uint16_t locPort, uint16_t peerPort,
+                     const struct in6_addr *addr )
+{
+  hdrPorts( hdr, locPort, peerPort );
+  memcpy( &hdr->data[ 4 ], addr, 16 );
+  hdr->len = 20;
+  hdr->cmd = CMDS_CMD_SOCKET_SEND;
+  hdr->cks = cobs_copyXor( NULL, hdr->data, hdr->len );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Build the send command payload header to a domain name, and its
+ *        XOR. The name field is zero padded, longer names are cut.
+ *
+ * @param[in]      name:  Destination domain name, up to 32 characters.
+ */
+static void hdrName( kbi_sendHdr_t *hdr, uint16_t locPort, uint16_t peerPort,
+                     const char *name )
+{
+  size_t len = strnlen( name, 32 );
+
+  hdrPorts( hdr, locPort, peerPort );
+  memcpy( &hdr->data[ 4 ], name, len );
+  memset( &hdr->data[ 4 + len ], 0, 32 - len );
+  hdr->len = 36;
+  hdr->cmd = CMDS_CMD_NAMED_SOCKET_SEND;
+  hdr->cks = cobs_copyXor( NULL, hdr->data, hdr->len );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Send UDP traffic with a prebuilt header, retrying up to
+ *        KBI_CMD_RETRIES times as kbi_cmd(). The header and the payload are
+ *        written in place in the transmission frame, only the payload is
+ *        XORed.
+ */
+static void sockSend( kbi_dev_t *dev, const kbi_sendHdr_t *hdr, uint8_t *pld,
+                      uint16_t pldLen )
+{
+  struct iovec iov = { pld, pldLen };
+
+  /* Responses to pipelined commands would be taken as stray frames */
+  pipeDrain( dev );
+
+  cmdRetry( dev, CMDS_FCCMD_WRITE, hdr->cmd, hdr, &iov, 1, KBI_PORT_TOUT_MS );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Notification callback for the commands layer, the link is the first
+ *        member of the device context.
+ */
+static void ntfCb( cmds_t *cmds ) { kbi_ntf( ( kbi_dev_t * ) cmds ); }
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Log a notification frame and pass UDP traffic to its socket, the
+ *        frame may be in the receive buffer or in the notifications queue.
+ */
+static void ntfFrame( kbi_dev_t *dev, cmds_buffer_t *buf )
+{
+  kbi_socket_t *  sock;
+  uint8_t         fc = buf->frame_s.typ & 0x0F;
+  struct in6_addr addr;
+  const char *    domain = "";
+  uint16_t        pos    = 0;
+  uint16_t        dec1, dec2;
+  _Bool           cond1, cond2;
+  uint16_t        udpLen;
+#if KBI_NTF_LOG
+  uint16_t dec3;
+  char     addrStr[ INET6_ADDRSTRLEN ];
+#endif
+
+  switch ( fc )
+  {
+#if KBI_NTF_LOG
+  /* Ping reply reception */
+  case CMDS_FCNTF_NPINGREPLY:
+    domain = ( char * ) buf->frame_s.pld + pos;
+    pos += 32;
+  case CMDS_FCNTF_PINGREPLY:
+    memcpy( addr.s6_addr, buf->frame_s.pld + pos, 16 );
+    pos += 16;
+    memcpy( &dec1, buf->frame_s.pld + pos, 2 );
+    pos += 2;
+    memcpy( &dec2, buf->frame_s.pld + pos, 2 );
+    pos += 2;
+    memcpy( &dec3, buf->frame_s.pld + pos, 2 );
+    inet_ntop( AF_INET6, addr.s6_addr, addrStr, INET6_ADDRSTRLEN );
+    dec1 = be16toh( dec1 );
+    dec2 = be16toh( dec2 );
+    dec3 = be16toh( dec3 );
+    printf( "ping reply: saddr %s [%.32s] id %u sq %u - %u bytes\n", addrStr,
+            domain, dec3, dec1, dec2 );
+    break;
+#endif
+
+  /* UDP traffic reception */
+  case CMDS_FCNTF_SOCKRECV:
+  case CMDS_FCNTF_NSOCKRECV:
+    memcpy( &dec1, buf->frame_s.pld + pos, 2 );
+    pos += 2;
+    memcpy( &dec2, buf->frame_s.pld + pos, 2 );
+    pos += 2;
+    if ( fc == CMDS_FCNTF_NSOCKRECV )
+    {
+      domain = ( char * ) buf->frame_s.pld + pos;
+      pos += 32;
+    }
+    memcpy( addr.s6_addr, buf->frame_s.pld + pos, 16 );
+    pos += 16;
+    udpLen = be16toh( buf->frame_s.len ) - pos;
+    dec1   = be16toh( dec1 );
+    dec2   = be16toh( dec2 );
+#if KBI_NTF_LOG
+    inet_ntop( AF_INET6, addr.s6_addr, addrStr, INET6_ADDRSTRLEN );
+    printf( "udp rcv: saddr %s [%.32s] sport %u dport %u - %u bytes\n",
+            addrStr, domain, dec2, dec1, udpLen );
+#endif
+    /* Find a socket listening to this port */
+    if ( !( sock = findSocket( dev, dec1 ) ) )
+      break;
+    switch ( sock->peer )
+    {
+    case KBI_PEER_ADDR:
+      cond1 = !memcmp( &sock->peerAddr, &addr, sizeof( addr ) );
+      break;
+    case KBI_PEER_NAME:
+      cond1 = !strncmp( sock->peerName, domain, sizeof( sock->peerName ) );
+      break;
+    default:
+      cond1 = 1;
+      break;
+    }
+    cond2 = ( sock->peerPort == 0 || sock->peerPort == dec2 );
+    if ( cond1 && cond2 )
+      sock->handler( dev, dec1, dec2, &addr, buf->frame_s.pld + pos, udpLen );
+    break;
+
+#if KBI_NTF_LOG
+  /* Destination unreachable */
+  case CMDS_FCNTF_DSTUNREACH:
+    memcpy( addr.s6_addr, buf->frame_s.pld, 16 );
+    inet_ntop( AF_INET6, addr.s6_addr, addrStr, INET6_ADDRSTRLEN );
+    printf( "dst unreachable: daddr %s\n", addrStr );
+    break;
+#endif
+  }
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Receive a frame, or wait, up to the deadline of the oldest pipelined
+ *        command. Then complete or retry the expired ones.
+ */
+static void pipeStep( kbi_dev_t *dev )
+{
+  if ( recvRsp( dev, pipeDeadline( dev ) ) > 0 )
+    pipeMatch( dev );
+  pipeExpire( dev );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Receive responses until every pipelined command is completed,
+ *        leaving the failures counted for kbi_pipeWait().
+ */
+static void pipeDrain( kbi_dev_t *dev )
+{
+  while ( dev->pipeCnt )
+    pipeStep( dev );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Get the deadline of the oldest pipelined command.
+ *
+ * @return        Monotonic time in microseconds, UINT64_MAX if none.
+ */
+static uint64_t pipeDeadline( kbi_dev_t *dev )
+{
+  uint64_t deadline = UINT64_MAX;
+  uint8_t  i;
+
+  for ( i = 0; i < KBI_PIPE_DEPTH; i++ )
+  {
+    if ( dev->pipe[ i ].retries && ( dev->pipe[ i ].deadlineUs < deadline ) )
+      deadline = dev->pipe[ i ].deadlineUs;
+  }
+  return deadline;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Complete the oldest pipelined command answered by the frame in the
+ *        receive buffer, if any.
+ */
+static void pipeMatch( kbi_dev_t *dev )
+{
+  kbi_req_t *match = NULL;
+  kbi_req_t *req;
+  uint8_t    i;
+
+  if ( ( dev->cmds.rxBuf.frame_s.typ & 0xF0 ) != CMDS_FTRSP )
+    return;
+
+  /* Tries sent before the last answered one are lost, or answered late */
+  for ( i = 0; i < dev->pipeCnt; i++ )
+  {
+    req = &dev->pipe[ ( dev->pipeHead + i ) % KBI_PIPE_DEPTH ];
+    if ( req->retries && ( req->cmd == dev->cmds.rxBuf.frame_s.cmd ) &&
+         ( !match || ( req->seq < match->seq ) ) &&
+         ( ( int32_t )( req->seq - dev->pipeRxSeq ) > 0 ) )
+      match = req;
+  }
+
+  /* Tries sent before it are lost, retry them now instead of on timeout */
+  if ( match )
+  {
+    dev->pipeRxSeq = match->seq;
+    for ( i = 0; i < dev->pipeCnt; i++ )
+    {
+      req = &dev->pipe[ ( dev->pipeHead + i ) % KBI_PIPE_DEPTH ];
+      if ( ( int32_t )( req->seq - match->seq ) < 0 )
+        req->deadlineUs = 1; /* Already expired, 0 is no deadline for UART */
+    }
+  }
+
+  /* Late answers to an earlier try are still good */
+  for ( i = 0; !match && ( i < dev->pipeCnt ); i++ )
+  {
+    req = &dev->pipe[ ( dev->pipeHead + i ) % KBI_PIPE_DEPTH ];
+    if ( req->retries && ( req->cmd == dev->cmds.rxBuf.frame_s.cmd ) )
+      match = req;
+  }
+
+  if ( match )
+    pipeComplete( dev, match, 1 );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Resend the pipelined commands whose response is overdue, or complete
+ *        them as failed once out of retries.
+ */
+static void pipeExpire( kbi_dev_t *dev )
+{
+  kbi_req_t *req;
+  uint64_t   now = uart_nowUs();
+  uint8_t    i;
+
+  for ( i = 0; i < dev->pipeCnt; i++ )
+  {
+    req = &dev->pipe[ ( dev->pipeHead + i ) % KBI_PIPE_DEPTH ];
+    if ( !req->retries || ( req->deadlineUs > now ) )
+      continue;
+    if ( --req->retries )
+      pipeSend( dev, req, now );
+    else
+    {
+      dev->pipeErrors++;
+      pipeComplete( dev, req, 0 );
+      return; /* The callback may have changed the pipeline */
+    }
+  }
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Take the next free slot of the pipeline for a command, its payload
+ *        to be written by the caller before sending it.
+ *
+ * @return         Request, NULL if the pipeline is full.
+ */
+static kbi_req_t *pipeTake( kbi_dev_t *dev, uint8_t fc, uint8_t cmd,
+                            kbi_done_t done, void *ctx )
+{
+  kbi_req_t *req;
+
+  if ( dev->pipeCnt == KBI_PIPE_DEPTH )
+    return NULL;
+
+  req = &dev->pipe[ ( dev->pipeHead + dev->pipeCnt ) % KBI_PIPE_DEPTH ];
+  dev->pipeCnt++;
+  req->done    = done;
+  req->ctx     = ctx;
+  req->fc      = CMDS_FTCMD | fc;
+  req->cmd     = cmd;
+  req->retries = KBI_CMD_RETRIES;
+  return req;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Send a try of a pipelined command.
+ *
+ * @param[in]      now:  Current time, see uart_nowUs().
+ */
+static void pipeSend( kbi_dev_t *dev, kbi_req_t *req, uint64_t now )
+{
+  req->seq        = ++dev->pipeTxSeq;
+  req->deadlineUs = now + KBI_PORT_TOUT_MS * 1000;
+  cmds_send( &dev->cmds, req->fc, req->cmd, req->pld, req->pldLen );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Release a pipelined command slot and run its completion callback.
+ *        Completed slots at the head of the pipeline are reused from then on.
+ */
+static void pipeComplete( kbi_dev_t *dev, kbi_req_t *req, _Bool ok )
+{
+  kbi_done_t done = req->done;
+  void *     ctx  = req->ctx;
+
+  req->retries = 0;
+  while ( dev->pipeCnt && !dev->pipe[ dev->pipeHead ].retries )
+  {
+    dev->pipeHead = ( dev->pipeHead + 1 ) % KBI_PIPE_DEPTH;
+    dev->pipeCnt--;
+  }
+
+  if ( done )
+    done( dev, ctx, ok );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Receive a frame for the thread sending commands, up to a deadline.
+ *        Without a receive thread notifications are dispatched meanwhile,
+ *        with it they never get here.
+ *
+ * @return        Same as cmds_recvUntil(), the frame is in dev->cmds.rxBuf.
+ */
+static int16_t recvRsp( kbi_dev_t *dev, uint64_t deadlineUs )
+{
+  cmds_buffer_t *buf;
+  uint16_t       len;
+
+  if ( !atomic_load( &dev->rx.run ) )
+    return cmds_recvUntil( &dev->cmds, ntfCb, deadlineUs );
+
+  if ( !( buf = queueWait( &dev->rx.rsp, deadlineUs ) ) )
+    return COBS_RESULT_TIMEOUT;
+  len = CMDS_FRAME_HEADER_LEN + be16toh( buf->frame_s.len );
+  memcpy( dev->cmds.rxBuf.frame_a, buf->frame_a, len );
+  queuePop( &dev->rx.rsp );
+  return len;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Send a single try of a command without payload and wait for its
+ *        response.
+ *
+ * @param[in]      deadlineUs:  Monotonic time in microseconds to give up.
+ *
+ * @return         0: No response received.
+ *                 1: Response received, available in dev->cmds.rxBuf.
+ */
+static _Bool cmdTry( kbi_dev_t *dev, uint8_t fc, uint8_t cmd,
+                     uint64_t deadlineUs )
+{
+  cmds_send( &dev->cmds, CMDS_FTCMD | fc, cmd, NULL, 0 );
+  return cmdWait( dev, cmd, deadlineUs );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Send a command, trying up to KBI_CMD_RETRIES times. The payload is
+ *        written once in the transmission frame and committed again on every
+ *        retry, unless a handler sent another frame while waiting.
+ *
+ * @param[in]      hdr:     Socket send header before the payload, or NULL.
+ * @param[in]      iov:     Payload segments, a single one after a header.
+ * @param[in]      toutMs:  Time in milliseconds to wait for every response.
+ *
+ * @return         0: No response received.
+ *                 1: Response received, available in dev->cmds.rxBuf.
+ */
+static _Bool cmdRetry( kbi_dev_t *dev, uint8_t fc, uint8_t cmd,
+                       const kbi_sendHdr_t *hdr, const struct iovec *iov,
+                       uint8_t iovCnt, uint16_t toutMs )
+{
+  const uint8_t *rx = dev->cmds.rxBuf.frame_a;
+  const uint8_t *seg;
+  uint16_t       pldLen;
+  uint16_t       txCnt;
+  uint8_t        retries;
+  uint8_t        cks;
+  uint8_t        i;
+
+  /* Handlers answering from the receive buffer lose it while waiting */
+  for ( i = 0; i < iovCnt; i++ )
+  {
+    seg = iov[ i ].iov_base;
+    if ( iov[ i ].iov_len && ( seg >= rx ) &&
+         ( seg < rx + sizeof( cmds_buffer_t ) ) )
+      return cmdAside( dev, fc, cmd, hdr, iov, iovCnt, toutMs );
+  }
+
+  pldLen = cmdFill( dev, hdr, iov, iovCnt, &cks );
+  txCnt  = dev->cmds.txCnt;
+  for ( retries = KBI_CMD_RETRIES; retries; retries-- )
+  {
+    if ( dev->cmds.txCnt != txCnt )
+      cmdFill( dev, hdr, iov, iovCnt, &cks );
+    cmds_commitXor( &dev->cmds, CMDS_FTCMD | fc, cmd, pldLen, cks );
+    txCnt = dev->cmds.txCnt;
+    if ( cmdWait( dev, cmd, uart_nowUs() + ( uint64_t ) toutMs * 1000 ) )
+      return 1;
+  }
+  return 0;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Same as cmdRetry() with the payload copied aside first, for
+ *        payloads in the receive buffer. Kept apart so that other sends
+ *        don't take the stack for it.
+ */
+__attribute__( ( noinline ) ) static _Bool
+cmdAside( kbi_dev_t *dev, uint8_t fc, uint8_t cmd, const kbi_sendHdr_t *hdr,
+          const struct iovec *iov, uint8_t iovCnt, uint16_t toutMs )
+{
+  uint8_t      pld[ CMDS_FRAME_PAYLOAD_MAX_LEN ];
+  struct iovec aside = { pld, 0 };
+  size_t       len;
+  uint8_t      i;
+
+  for ( i = 0; i < iovCnt; i++ )
+  {
+    len = sizeof( pld ) - aside.iov_len;
+    if ( iov[ i ].iov_len < len )
+      len = iov[ i ].iov_len;
+    memcpy( pld + aside.iov_len, iov[ i ].iov_base, len );
+    aside.iov_len += len;
+  }
+  return cmdRetry( dev, fc, cmd, hdr, &aside, 1, toutMs );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Write a command payload in the transmission frame, after a socket
+ *        send header whose XOR is already known if given.
+ *
+ * @param[out]     pldCks:  XOR of the payload bytes.
+ *
+ * @return         Length of the payload written.
+ */
+static uint16_t cmdFill( kbi_dev_t *dev, const kbi_sendHdr_t *hdr,
+                         const struct iovec *iov, uint8_t iovCnt,
+                         uint8_t *pldCks )
+{
+  uint8_t *frame;
+  size_t   len;
+
+  if ( !hdr )
+    return cmds_gather( &dev->cmds, iov, iovCnt, pldCks );
+
+  frame = cmds_reserve( &dev->cmds );
+  memcpy( frame, hdr->data, hdr->len );
+  len = CMDS_FRAME_PAYLOAD_MAX_LEN - hdr->len;
+  if ( iov->iov_len < len )
+    len = iov->iov_len;
+  *pldCks = hdr->cks ^ cobs_copyXor( frame + hdr->len, iov->iov_base, len );
+  return hdr->len + len;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Wait for the response to a command already sent.
+ *
+ * @param[in]      deadlineUs:  Monotonic time in microseconds to give up.
+ *
+ * @return         0: No response received.
+ *                 1: Response received, available in dev->cmds.rxBuf.
+ */
+static _Bool cmdWait( kbi_dev_t *dev, uint8_t cmd, uint64_t deadlineUs )
+{
+  int16_t result;
+
+  /* Notifications or stray frames don't restart the wait */
+  while ( ( result = recvRsp( dev, deadlineUs ) ) != COBS_RESULT_TIMEOUT )
+  {
+    /* Find matching response */
+    if ( ( result > 0 ) &&
+         ( ( dev->cmds.rxBuf.frame_s.typ & 0xF0 ) == CMDS_FTRSP ) &&
+         ( dev->cmds.rxBuf.frame_s.cmd == cmd ) )
+      return 1;
+  }
+  return 0;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Keep sending a read command until the device answers with a payload
+ *        starting as the given one, or any payload if len is 0, but for a
+ *        transient status when polling it. Tries are
+ *        spaced from KBI_POLL_MIN_MS, doubling up to KBI_POLL_MAX_MS, so a
+ *        ready device is noticed right away and a busy one isn't flooded.
+ *
+ * @param[in]      deadlineUs:  Monotonic time in microseconds to give up.
+ *
+ * @return         0: Deadline expired without a match.
+ *                 1: Payload match found.
+ */
+static _Bool pollUntil( kbi_dev_t *dev, uint8_t cmd, uint8_t *pld,
+                        uint16_t len, uint64_t deadlineUs )
+{
+  uint64_t        waitUs = KBI_POLL_MIN_MS * 1000;
+  uint64_t        now    = uart_nowUs();
+  uint64_t        tryDeadline;
+  struct timespec ts;
+
+  while ( now < deadlineUs )
+  {
+    /* A device still resetting doesn't answer, don't wait past the end */
+    tryDeadline = now + KBI_PORT_TOUT_MS * 1000;
+    if ( tryDeadline > deadlineUs )
+      tryDeadline = deadlineUs;
+    if ( cmdTry( dev, CMDS_FCCMD_READ, cmd, tryDeadline ) &&
+         !pollBusy( dev, cmd, len ) &&
+         ( be16toh( dev->cmds.rxBuf.frame_s.len ) >= len ) &&
+         ( !len || !memcmp( pld, dev->cmds.rxBuf.frame_s.pld, len ) ) )
+      return 1;
+
+    now = uart_nowUs();
+    if ( now + waitUs >= deadlineUs )
+      break;
+    /* usleep() may not take a whole second */
+    ts.tv_sec  = waitUs / 1000000;
+    ts.tv_nsec = waitUs % 1000000 * 1000;
+    nanosleep( &ts, NULL );
+    now += waitUs;
+    if ( ( waitUs *= 2 ) > KBI_POLL_MAX_MS * 1000 )
+      waitUs = KBI_POLL_MAX_MS * 1000;
+  }
+  return 0;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Tell whether a poll response shows the device still busy, either
+ *        answering busy or, for a status poll with no payload to match, in a
+ *        state it leaves by itself.
+ *
+ * @return         0: The response can be matched.
+ *                 1: The device is to be polled again.
+ */
+static _Bool pollBusy( kbi_dev_t *dev, uint8_t cmd, uint16_t len )
+{
+  cmds_frame_t *rsp = &dev->cmds.rxBuf.frame_s;
+
+  if ( rsp->typ == ( CMDS_FTRSP | CMDS_FCRSP_BUSY ) )
+    return 1;
+  if ( ( cmd != CMDS_CMD_STATUS ) || len || !rsp->len )
+    return 0;
+
+  switch ( rsp->pld[ 0 ] )
+  {
+  case CMDS_STATUS_BOOTING:
+  case CMDS_STATUS_REBOOTING:
+  case CMDS_STATUS_CHANGING:
+  case CMDS_STATUS_CLEARING:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Initialize an empty frames queue.
+ *
+ * @return        0: Unable to create the wake up primitives.
+ *                1: Queue ready.
+ */
+static _Bool queueInit( kbi_queue_t *q )
+{
+  pthread_condattr_t attr;
+  _Bool              ok = 0;
+
+  atomic_store( &q->head, 0 );
+  atomic_store( &q->tail, 0 );
+  atomic_store( &q->waiting, 0 );
+  if ( pthread_mutex_init( &q->lock, NULL ) )
+    return 0;
+
+  /* Waits are bound by uart_nowUs() deadlines, so use the same clock */
+  if ( !pthread_condattr_init( &attr ) )
+  {
+    ok = !pthread_condattr_setclock( &attr, CLOCK_MONOTONIC ) &&
+         !pthread_cond_init( &q->cond, &attr );
+    pthread_condattr_destroy( &attr );
+  }
+  if ( !ok )
+    pthread_mutex_destroy( &q->lock );
+  return ok;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Release the wake up primitives of a queue, its threads are stopped.
+ */
+static void queueFree( kbi_queue_t *q )
+{
+  pthread_cond_destroy( &q->cond );
+  pthread_mutex_destroy( &q->lock );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Get the free frame to be filled and pushed by the producer.
+ *
+ * @return        Frame buffer, NULL if the queue is full.
+ */
+static cmds_buffer_t *queueTail( kbi_queue_t *q )
+{
+  uint32_t tail = atomic_load_explicit( &q->tail, memory_order_relaxed );
+
+  if ( tail - atomic_load_explicit( &q->head, memory_order_acquire ) ==
+       KBI_RX_QUEUE_LEN )
+    return NULL;
+  return &q->frames[ tail & ( KBI_RX_QUEUE_LEN - 1 ) ];
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Publish the frame got with queueTail() and wake the consumer up if
+ *        it is sleeping.
+ */
+static void queuePush( kbi_queue_t *q )
+{
+  /* Sequentially consistent against waiting, so no wake up is missed */
+  atomic_fetch_add( &q->tail, 1 );
+  if ( atomic_load( &q->waiting ) )
+  {
+    pthread_mutex_lock( &q->lock );
+    pthread_cond_signal( &q->cond );
+    pthread_mutex_unlock( &q->lock );
+  }
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Get the oldest frame of a queue, sleeping while it is empty.
+ *
+ * @param[in]      deadlineUs:  Monotonic time in microseconds to give up.
+ *
+ * @return        Frame buffer, to be released with queuePop(). NULL if the
+ *                deadline expired.
+ */
+static cmds_buffer_t *queueWait( kbi_queue_t *q, uint64_t deadlineUs )
+{
+  struct timespec ts;
+  uint32_t        head;
+  _Bool           expired = 0;
+
+  head       = atomic_load_explicit( &q->head, memory_order_relaxed );
+  ts.tv_sec  = deadlineUs / 1000000;
+  ts.tv_nsec = ( deadlineUs % 1000000 ) * 1000;
+  while ( atomic_load( &q->tail ) == head )
+  {
+    if ( expired )
+      return NULL;
+    pthread_mutex_lock( &q->lock );
+    atomic_store( &q->waiting, 1 );
+    if ( atomic_load( &q->tail ) == head )
+      expired = pthread_cond_timedwait( &q->cond, &q->lock, &ts ) != 0;
+    atomic_store( &q->waiting, 0 );
+    pthread_mutex_unlock( &q->lock );
+  }
+  return &q->frames[ head & ( KBI_RX_QUEUE_LEN - 1 ) ];
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Release the frame got with queueWait() for the producer.
+ */
+static void queuePop( kbi_queue_t *q )
+{
+  atomic_fetch_add_explicit( &q->head, 1, memory_order_release );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Receive thread. Frames are decoded straight into the free slot of
+ *        the notifications queue, responses are copied to their own queue.
+ *        A partially received frame keeps its buffer until completed.
+ */
+static void *rxReader( void *arg )
+{
+  kbi_dev_t *    dev = arg;
+  kbi_rx_t *     rx  = &dev->rx;
+  cmds_buffer_t *buf = NULL;
+  cmds_buffer_t *rsp;
+  int16_t        result;
+
+  while ( atomic_load( &rx->run ) )
+  {
+    if ( !buf && !( buf = queueTail( &rx->ntf ) ) )
+      buf = &rx->spare;
+
+    result = cmds_recvFrame( &dev->cmds, buf,
+                             uart_nowUs() + KBI_RX_POLL_MS * 1000 );
+    if ( result == COBS_RESULT_TIMEOUT )
+      continue;
+
+    if ( result > 0 )
+    {
+      if ( ( buf->frame_s.typ & 0xF0 ) == CMDS_FTNTF )
+      {
+        if ( buf != &rx->spare )
+          queuePush( &rx->ntf );
+        else
+          atomic_fetch_add( &rx->dropped, 1 );
+      }
+      else if ( ( rsp = queueTail( &rx->rsp ) ) )
+      {
+        memcpy( rsp->frame_a, buf->frame_a, result );
+        queuePush( &rx->rsp );
+      }
+      else
+        atomic_fetch_add( &rx->dropped, 1 );
+    }
+    buf = NULL;
+  }
+  return NULL;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Notifications thread, runs kbi_ntf() and the socket handlers on the
+ *        queued frames without holding the receive thread.
+ */
+static void *rxWorker( void *arg )
 {
-  int8_t i;
+  kbi_dev_t *    dev = arg;
+  cmds_buffer_t *buf;
 
-  for ( i = 0; i < KBI_MAX_SOCKETS; i++ )
+  while ( atomic_load( &dev->rx.run ) )
   {
-    if ( kbi_sockets[ i ].locPort == locPort )
-      return ( kbi_socket_t * ) &kbi_sockets[ i ];
+    if ( !( buf = queueWait( &dev->rx.ntf,
+                             uart_nowUs() + KBI_RX_POLL_MS * 1000 ) ) )
+      continue;
+    ntfFrame( dev, buf );
+    queuePop( &dev->rx.ntf );
   }
   return NULL;
 }
@@ -14,56 +14,202 @@
 **                                                                         **
 ****************************************************************************/
 
+#define _GNU_SOURCE /* posix_openpt() */
+
 #include "uart.h"
 
 /****************************************************************************
 **                                                                         **
-**                           EXPORTED VARIABLES                            **
+**                         TYPEDEFS AND STRUCTURES                         **
 **                                                                         **
 ****************************************************************************/
 
+/* Standard rate to termios speed mapping */
+struct uart_speed_s
+{
+  uint32_t baud;
+  speed_t  speed;
+};
+
+#if defined( __linux__ ) && defined( _IOR )
+/* Kernel termios with arbitrary rate fields, not exposed by the libc */
+struct uart_termios2_s
+{
+  tcflag_t c_iflag;
+  tcflag_t c_oflag;
+  tcflag_t c_cflag;
+  tcflag_t c_lflag;
+  cc_t     c_line;
+  cc_t     c_cc[ 19 ];
+  speed_t  c_ispeed;
+  speed_t  c_ospeed;
+};
+
+#define UART_TCGETS2 _IOR( 'T', 0x2A, struct uart_termios2_s )
+#define UART_TCSETS2 _IOW( 'T', 0x2B, struct uart_termios2_s )
+#define UART_BOTHER 0010000
+#endif
+
 /****************************************************************************
 **                                                                         **
-**                           GLOBAL VARIABLES                              **
+**                      PROTOTYPES OF LOCAL FUNCTIONS                      **
 **                                                                         **
 ****************************************************************************/
 
-/* Serial port file descriptor */
-int uart_fd = -1;
+static uint16_t rxFill( uart_t *uart );
+
+static void txWrite( uart_t *uart, uint16_t len );
+
+static _Bool ttyOpen( const char *addr, int *rfd, int *wfd );
+
+static uint8_t ttySetBaud( int fd, uint32_t baud, _Bool flowCtrl );
+
+static uint8_t ttySetCustomBaud( int fd, uint32_t baud );
+
+static _Bool ptyOpen( const char *addr, int *rfd, int *wfd );
+
+static _Bool tcpOpen( const char *addr, int *rfd, int *wfd );
+
+static _Bool unixOpen( const char *addr, int *rfd, int *wfd );
+
+static _Bool loopOpen( const char *addr, int *rfd, int *wfd );
+
+static ssize_t fdRead( int fd, struct iovec *iov, int iovcnt );
+
+static ssize_t fdWrite( int fd, const void *buf, size_t len );
+
+static ssize_t sockWrite( int fd, const void *buf, size_t len );
+
+static void fdClose( int rfd, int wfd );
 
 /****************************************************************************
 **                                                                         **
-**                      PROTOTYPES OF LOCAL FUNCTIONS                      **
+**                           EXPORTED VARIABLES                            **
 **                                                                         **
 ****************************************************************************/
 
+/* Built-in transports */
+const uart_transport_t uart_ttyTransport = { NULL, ttyOpen, ttySetBaud,
+                                             fdRead, fdWrite, fdClose };
+
+const uart_transport_t uart_ptyTransport = { "pty:", ptyOpen, NULL,
+                                             fdRead, fdWrite, fdClose };
+
+const uart_transport_t uart_tcpTransport = { "tcp:", tcpOpen, NULL,
+                                             fdRead, sockWrite, fdClose };
+
+const uart_transport_t uart_unixTransport = { "unix:", unixOpen, NULL,
+                                              fdRead, sockWrite, fdClose };
+
+const uart_transport_t uart_loopTransport = { "loop:", loopOpen, NULL,
+                                              fdRead, fdWrite, fdClose };
+
+/****************************************************************************
+**                                                                         **
+**                           GLOBAL VARIABLES                              **
+**                                                                         **
+****************************************************************************/
+
+/* Rates with a termios speed constant, higher ones may not be defined */
+static const struct uart_speed_s uart_speeds[] = {
+    { 9600, B9600 },       { 19200, B19200 },     { 38400, B38400 },
+    { 57600, B57600 },     { 115200, B115200 },   { 230400, B230400 },
+#ifdef B460800
+    { 460800, B460800 },
+#endif
+#ifdef B500000
+    { 500000, B500000 },
+#endif
+#ifdef B576000
+    { 576000, B576000 },
+#endif
+#ifdef B921600
+    { 921600, B921600 },
+#endif
+#ifdef B1000000
+    { 1000000, B1000000 },
+#endif
+#ifdef B1152000
+    { 1152000, B1152000 },
+#endif
+#ifdef B1500000
+    { 1500000, B1500000 },
+#endif
+#ifdef B2000000
+    { 2000000, B2000000 },
+#endif
+#ifdef B2500000
+    { 2500000, B2500000 },
+#endif
+#ifdef B3000000
+    { 3000000, B3000000 },
+#endif
+#ifdef B3500000
+    { 3500000, B3500000 },
+#endif
+#ifdef B4000000
+    { 4000000, B4000000 },
+#endif
+};
+
+/* Transports selected by their device string prefix */
+static const uart_transport_t *uart_transports[] = {
+    &uart_ptyTransport, &uart_tcpTransport, &uart_unixTransport,
+    &uart_loopTransport };
+
 /****************************************************************************
 **                                                                         **
 **                           EXPORTED FUNCTIONS                            **
 **                                                                         **
 ****************************************************************************/
 
-uint8_t uart_init( char *device, uint16_t portToutMs )
+uint8_t uart_init( uart_t *uart, char *device, uint32_t baud, _Bool flowCtrl,
+                   uint16_t portToutMs )
+{
+  const uart_transport_t *tr = &uart_ttyTransport;
+  const char *            prefix;
+  uint8_t                 i;
+
+  for ( i = 0; i < sizeof( uart_transports ) / sizeof( uart_transports[ 0 ] );
+        i++ )
+  {
+    prefix = uart_transports[ i ]->prefix;
+    if ( strncmp( device, prefix, strlen( prefix ) ) == 0 )
+    {
+      tr = uart_transports[ i ];
+      device += strlen( prefix );
+      break;
+    }
+  }
+
+  return uart_initTransport( uart, tr, device, baud, flowCtrl, portToutMs );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+uint8_t uart_initTransport( uart_t *uart, const uart_transport_t *tr,
+                            char *addr, uint32_t baud, _Bool flowCtrl,
+                            uint16_t portToutMs )
 {
   uint8_t result = 0;
 
-  uart_fd = open( device, O_RDWR | O_NOCTTY );
-  if ( uart_fd != -1 )
+  if ( tr->open( addr, &uart->fd, &uart->wfd ) )
   {
-    struct termios options;
-    options.c_cflag       = B115200 | CS8 | CLOCAL | CREAD;
-    options.c_iflag       = IGNPAR;
-    options.c_oflag       = 0;
-    options.c_lflag       = 0;
-    options.c_cc[ VMIN ]  = 0;
-    options.c_cc[ VTIME ] = portToutMs / 100;
-    tcflush( uart_fd, TCIFLUSH );
-    tcsetattr( uart_fd, TCSANOW, &options );
-    result = 1;
+    uart->tr           = tr;
+    uart->toutMs       = portToutMs;
+    uart->deadlineUs   = 0;
+    uart->txLen        = 0;
+    uart->txFrameStart = 0;
+    uart->txCoalesce   = 0;
+    result             = uart_setBaud( uart, baud, flowCtrl );
+    if ( !result )
+      uart_close( uart );
   }
   else
   {
-    result = 0;
+    uart->fd  = -1;
+    uart->wfd = -1;
+    result    = 0;
   }
 
   return ( result );
@@ -71,24 +217,158 @@ uint8_t uart_init( char *device, uint16_t portToutMs )
 
 /***************************************************************************/
 /***************************************************************************/
-void uart_sendChar( uint8_t byte )
+uint8_t uart_setBaud( uart_t *uart, uint32_t baud, _Bool flowCtrl )
+{
+  if ( uart->fd == -1 )
+    return 0;
+
+  /* Let pending data leave at the previous rate */
+  uart_flush( uart );
+  if ( uart->tr->setBaud && !uart->tr->setBaud( uart->fd, baud, flowCtrl ) )
+    return 0;
+
+  /* Anything received so far was sent at the previous rate */
+  uart->rxHead = 0;
+  uart->rxTail = 0;
+
+  return 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+char *uart_ptyName( uart_t *uart )
+{
+  if ( ( uart->fd == -1 ) || ( uart->tr != &uart_ptyTransport ) )
+    return NULL;
+  return ptsname( uart->fd );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+void uart_sendChar( uart_t *uart, uint8_t byte )
+{
+  if ( uart->txLen == UART_TX_BUF_SIZE )
+  {
+    /* Try not to break the current frame, just send out the previous ones */
+    if ( uart->txFrameStart )
+      txWrite( uart, uart->txFrameStart );
+    else
+      txWrite( uart, uart->txLen );
+  }
+
+  uart->txBuf[ uart->txLen++ ] = byte;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+uint8_t *uart_sendReserve( uart_t *uart, uint16_t len )
+{
+  if ( len > UART_TX_BUF_SIZE )
+    return NULL;
+
+  if ( UART_TX_BUF_SIZE - uart->txLen < len )
+    uart_flush( uart );
+  return &uart->txBuf[ uart->txLen ];
+}
+
+/***************************************************************************/
+/***************************************************************************/
+void uart_sendCommit( uart_t *uart, uint16_t len ) { uart->txLen += len; }
+
+/***************************************************************************/
+/***************************************************************************/
+void uart_frameEnd( uart_t *uart )
 {
-  if ( uart_fd != -1 )
-    write( uart_fd, &byte, 1 );
+  uart->txFrameStart = uart->txLen;
+  if ( !uart->txCoalesce )
+    uart_flush( uart );
 }
 
 /***************************************************************************/
 /***************************************************************************/
-uint8_t uart_recvChar( uint8_t *byte ) {
-   return read( uart_fd, byte, 1 );
+void uart_flush( uart_t *uart )
+{
+  if ( uart->txLen )
+    txWrite( uart, uart->txLen );
 }
 
 /***************************************************************************/
 /***************************************************************************/
-void uart_close( void )
+void uart_setCoalesce( uart_t *uart, _Bool enable )
 {
-  if ( uart_fd != -1 )
-    close( uart_fd );
+  uart->txCoalesce = enable;
+  if ( !enable )
+    uart_flush( uart );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+uint16_t uart_getTimeout( uart_t *uart ) { return uart->toutMs; }
+
+/***************************************************************************/
+/***************************************************************************/
+uint64_t uart_nowUs( void )
+{
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  return ( uint64_t ) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+void uart_setDeadline( uart_t *uart, uint64_t deadlineUs )
+{
+  uart->deadlineUs = deadlineUs;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+uint8_t uart_recvChar( uart_t *uart, uint8_t *byte )
+{
+  /* Drain the port into the ring only when there is nothing left in it */
+  if ( ( uart->rxHead == uart->rxTail ) && !rxFill( uart ) )
+    return 0;
+
+  *byte = uart->rxRing[ uart->rxTail++ & ( UART_RX_RING_SIZE - 1 ) ];
+  return 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+uint16_t uart_recvSpan( uart_t *uart, const uint8_t **data )
+{
+  uint32_t tail = uart->rxTail & ( UART_RX_RING_SIZE - 1 );
+  uint32_t used;
+
+  if ( ( uart->rxHead == uart->rxTail ) && !rxFill( uart ) )
+    return 0;
+
+  /* Only up to the end of the ring, the rest comes in the next span */
+  used  = uart->rxHead - uart->rxTail;
+  *data = &uart->rxRing[ tail ];
+  if ( used > UART_RX_RING_SIZE - tail )
+    used = UART_RX_RING_SIZE - tail;
+  return used;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+void uart_consume( uart_t *uart, uint16_t len ) { uart->rxTail += len; }
+
+/***************************************************************************/
+/***************************************************************************/
+void uart_close( uart_t *uart )
+{
+  uart_flush( uart );
+  if ( uart->fd != -1 )
+    uart->tr->close( uart->fd, uart->wfd );
+  uart->fd           = -1;
+  uart->wfd          = -1;
+  uart->rxHead       = 0;
+  uart->rxTail       = 0;
+  uart->txLen        = 0;
+  uart->txFrameStart = 0;
 }
 
 /****************************************************************************
@@ -97,6 +377,374 @@ void uart_close( void )
 **                                                                         **
 ****************************************************************************/
 
+/**
+ * @brief Read all the available port data into the receive ring free space
+ *        with a single system call. Waits for data up to the deadline, or up
+ *        to the port timeout if there is none.
+ *
+ * @return        Number of bytes added to the ring, 0 on timeout or error.
+ */
+static uint16_t rxFill( uart_t *uart )
+{
+  struct iovec  iov[ 2 ];
+  struct pollfd pfd;
+  uint32_t      head = uart->rxHead & ( UART_RX_RING_SIZE - 1 );
+  uint32_t      free = UART_RX_RING_SIZE - ( uart->rxHead - uart->rxTail );
+  uint64_t      deadline;
+  uint64_t      now;
+  int           wait;
+  ssize_t       num;
+
+  if ( ( uart->fd == -1 ) || ( free == 0 ) )
+    return 0;
+
+  /*
+   * Coalesced frames must be out before waiting for their responses. Other
+   * frames are already, and the buffer may be in use by a sending thread.
+   */
+  if ( uart->txCoalesce )
+    uart_flush( uart );
+
+  /*
+   * Wait for data, rounding the remaining time up to the next millisecond.
+   * Once the deadline is over the port is still checked for available data.
+   */
+  now        = uart_nowUs();
+  deadline   = uart->deadlineUs;
+  pfd.fd     = uart->fd;
+  pfd.events = POLLIN;
+  if ( !deadline )
+    deadline = now + uart->toutMs * 1000;
+  do
+  {
+    wait = ( now < deadline ) ? ( deadline - now + 999 ) / 1000 : 0;
+    num  = poll( &pfd, 1, wait );
+    now  = uart_nowUs();
+  } while ( ( ( num == 0 ) && ( now < deadline ) ) ||
+            ( ( num < 0 ) && ( errno == EINTR ) ) );
+  if ( ( num <= 0 ) || !( pfd.revents & POLLIN ) )
+    return 0;
+
+  /* Free space may wrap around the end of the ring */
+  iov[ 0 ].iov_base = &uart->rxRing[ head ];
+  iov[ 0 ].iov_len  = UART_RX_RING_SIZE - head;
+  if ( iov[ 0 ].iov_len > free )
+    iov[ 0 ].iov_len = free;
+  iov[ 1 ].iov_base = uart->rxRing;
+  iov[ 1 ].iov_len  = free - iov[ 0 ].iov_len;
+
+  num = uart->tr->read( uart->fd, iov, iov[ 1 ].iov_len ? 2 : 1 );
+  if ( num <= 0 )
+    return 0;
+
+  uart->rxHead += num;
+  return num;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Write the first bytes of the transmit buffer to the port and move
+ *        the remaining ones to its start. Partial and interrupted writes are
+ *        resumed, a full port is waited for up to the default timeout.
+ *
+ * @param[in]     len:  Number of bytes to write.
+ */
+static void txWrite( uart_t *uart, uint16_t len )
+{
+  struct pollfd pfd;
+  uint64_t      deadline = 0;
+  uint64_t      now;
+  uint16_t      pos = 0;
+  ssize_t       num;
+
+  while ( ( uart->fd != -1 ) && ( pos < len ) )
+  {
+    num = uart->tr->write( uart->wfd, &uart->txBuf[ pos ], len - pos );
+    if ( num > 0 )
+    {
+      pos += num;
+      continue;
+    }
+    if ( ( num < 0 ) && ( errno == EINTR ) )
+      continue;
+    if ( !num || ( ( errno != EAGAIN ) && ( errno != EWOULDBLOCK ) ) )
+      break;
+
+    /* Non-blocking ports take the rest once they drained */
+    now = uart_nowUs();
+    if ( !deadline )
+      deadline = now + uart->toutMs * 1000;
+    if ( now >= deadline )
+      break;
+    pfd.fd     = uart->wfd;
+    pfd.events = POLLOUT;
+    poll( &pfd, 1, ( deadline - now + 999 ) / 1000 );
+  }
+
+  /* Drop anything that could not be written along with the written data */
+  memmove( uart->txBuf, &uart->txBuf[ len ], uart->txLen - len );
+  uart->txLen -= len;
+  if ( uart->txFrameStart > len )
+    uart->txFrameStart -= len;
+  else
+    uart->txFrameStart = 0;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Open a serial device.
+ */
+static _Bool ttyOpen( const char *addr, int *rfd, int *wfd )
+{
+  *rfd = open( addr, O_RDWR | O_NOCTTY );
+  *wfd = *rfd;
+  return ( *rfd != -1 );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Configure a serial device in raw mode at the given rate.
+ *
+ * @return        1 Success, 0 Rate not supported.
+ */
+static uint8_t ttySetBaud( int fd, uint32_t baud, _Bool flowCtrl )
+{
+  struct termios options;
+  speed_t        speed  = B0;
+  _Bool          custom = 0;
+  uint8_t        i;
+
+  for ( i = 0; i < sizeof( uart_speeds ) / sizeof( uart_speeds[ 0 ] ); i++ )
+  {
+    if ( uart_speeds[ i ].baud == baud )
+      speed = uart_speeds[ i ].speed;
+  }
+
+  /* Keep the current rate until the custom one is set */
+  if ( speed == B0 )
+  {
+    tcgetattr( fd, &options );
+    speed  = cfgetospeed( &options );
+    custom = 1;
+  }
+
+  memset( &options, 0, sizeof( options ) );
+  options.c_cflag = CS8 | CLOCAL | CREAD;
+  if ( flowCtrl )
+    options.c_cflag |= CRTSCTS;
+  cfsetspeed( &options, speed );
+  options.c_iflag       = IGNPAR;
+  options.c_oflag       = 0;
+  options.c_lflag       = 0;
+  options.c_cc[ VMIN ]  = 0;
+  options.c_cc[ VTIME ] = 0; /* Waits are done with poll() */
+
+  tcdrain( fd );
+  if ( tcsetattr( fd, TCSANOW, &options ) != 0 )
+    return 0;
+  if ( custom && !ttySetCustomBaud( fd, baud ) )
+    return 0;
+  tcflush( fd, TCIFLUSH );
+
+  return 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Set a rate without a termios speed constant. Linux supports any rate
+ *        through the termios2 BOTHER interface, as long as the driver does.
+ *
+ * @return        1 Success, 0 Not supported.
+ */
+static uint8_t ttySetCustomBaud( int fd, uint32_t baud )
+{
+#ifdef UART_BOTHER
+  struct uart_termios2_s options;
+
+  if ( ioctl( fd, UART_TCGETS2, &options ) != 0 )
+    return 0;
+  options.c_cflag &= ~CBAUD;
+  options.c_cflag |= UART_BOTHER;
+  options.c_ispeed = baud;
+  options.c_ospeed = baud;
+  if ( ioctl( fd, UART_TCSETS2, &options ) != 0 )
+    return 0;
+
+  /* Drivers round to the closest rate they can do, check it's near enough */
+  if ( ioctl( fd, UART_TCGETS2, &options ) != 0 )
+    return 0;
+  return ( options.c_ospeed >= baud - baud / 50 ) &&
+         ( options.c_ospeed <= baud + baud / 50 );
+#else
+  return 0;
+#endif
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Create a new pseudo terminal in raw mode, the other end is available
+ *        in the path given by uart_ptyName().
+ */
+static _Bool ptyOpen( const char *addr, int *rfd, int *wfd )
+{
+  struct termios options;
+
+  ( void ) addr;
+  *rfd = posix_openpt( O_RDWR | O_NOCTTY );
+  *wfd = *rfd;
+  if ( *rfd == -1 )
+    return 0;
+
+  if ( ( grantpt( *rfd ) != 0 ) || ( unlockpt( *rfd ) != 0 ) ||
+       ( tcgetattr( *rfd, &options ) != 0 ) )
+  {
+    close( *rfd );
+    return 0;
+  }
+  cfmakeraw( &options );
+  tcsetattr( *rfd, TCSANOW, &options );
+
+  return 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Connect to a TCP serial bridge given as HOST:PORT, IPv6 addresses
+ *        may be enclosed in brackets.
+ */
+static _Bool tcpOpen( const char *addr, int *rfd, int *wfd )
+{
+  struct addrinfo  hints;
+  struct addrinfo *list;
+  struct addrinfo *ai;
+  char             host[ 256 ];
+  char *           port;
+  int              one = 1;
+
+  /* Split host and port at the last colon */
+  strncpy( host, addr, sizeof( host ) - 1 );
+  host[ sizeof( host ) - 1 ] = '\0';
+  if ( !( port = strrchr( host, ':' ) ) )
+    return 0;
+  *port++ = '\0';
+  if ( ( host[ 0 ] == '[' ) && ( port[ -2 ] == ']' ) )
+  {
+    port[ -2 ] = '\0';
+    memmove( host, host + 1, strlen( host ) );
+  }
+
+  memset( &hints, 0, sizeof( hints ) );
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ( getaddrinfo( host, port, &hints, &list ) != 0 )
+    return 0;
+
+  *rfd = -1;
+  for ( ai = list; ai && ( *rfd == -1 ); ai = ai->ai_next )
+  {
+    *rfd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+    if ( ( *rfd != -1 ) &&
+         ( connect( *rfd, ai->ai_addr, ai->ai_addrlen ) != 0 ) )
+    {
+      close( *rfd );
+      *rfd = -1;
+    }
+  }
+  freeaddrinfo( list );
+
+  /* Frames are written at once, don't let them wait for more data */
+  if ( *rfd != -1 )
+    setsockopt( *rfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+  *wfd = *rfd;
+
+  return ( *rfd != -1 );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Connect to a serial bridge listening in a UNIX domain socket path.
+ */
+static _Bool unixOpen( const char *addr, int *rfd, int *wfd )
+{
+  struct sockaddr_un sun;
+
+  memset( &sun, 0, sizeof( sun ) );
+  sun.sun_family = AF_UNIX;
+  if ( strlen( addr ) >= sizeof( sun.sun_path ) )
+    return 0;
+  strcpy( sun.sun_path, addr );
+
+  *rfd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  *wfd = *rfd;
+  if ( *rfd == -1 )
+    return 0;
+  if ( connect( *rfd, ( struct sockaddr * ) &sun, sizeof( sun ) ) != 0 )
+  {
+    close( *rfd );
+    return 0;
+  }
+
+  return 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Create an in-memory loopback, everything sent is received back.
+ */
+static _Bool loopOpen( const char *addr, int *rfd, int *wfd )
+{
+  int fds[ 2 ];
+
+  ( void ) addr;
+  if ( pipe( fds ) != 0 )
+    return 0;
+  *rfd = fds[ 0 ];
+  *wfd = fds[ 1 ];
+
+  return 1;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+static ssize_t fdRead( int fd, struct iovec *iov, int iovcnt )
+{
+  return readv( fd, iov, iovcnt );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+static ssize_t fdWrite( int fd, const void *buf, size_t len )
+{
+  return write( fd, buf, len );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/**
+ * @brief Write to a socket, a closed peer must not raise SIGPIPE.
+ */
+static ssize_t sockWrite( int fd, const void *buf, size_t len )
+{
+  return send( fd, buf, len, MSG_NOSIGNAL );
+}
+
+/***************************************************************************/
+/***************************************************************************/
+static void fdClose( int rfd, int wfd )
+{
+  close( rfd );
+  if ( wfd != rfd )
+    close( wfd );
+}
+
 #endif /* !UART_SERIAL_C_SRC */
 
 /****************************************************************************